@@ -100,6 +100,9 @@
 #define TCR_ASID16          (_AC(1, UL) << 36)
 #define TCR_TBI0            (_AC(1, UL) << 37)
 #define TCR_IPS_1TB         (_AC(2, UL) << 32)
+#define TCR_HA              (_AC(1, UL) << 39)  /* Hardware Access flag updates, FEAT_HAFDBS */
+
+#define TTBR_ASID_SHIFT     48
 
 #define TCR_TG_FLAGS        TCR_TG0_4K | TCR_TG1_4K
 #define TCR_CACHE_FLAGS     TCR_IRGN_WBWA | TCR_ORGN_WBWA
@@ -144,18 +147,47 @@
 #define AARCH64_PMD_PGT_SIZE     _AC(0x4000, UL)
 #define AARCH64_PTE_PGT_BASE     _AC(0x7000, UL)
 #define AARCH64_PTE_PGT_SIZE     _AC(0x1000, UL)
+#define AARCH64_SHM_PMD_PGT_BASE _AC(0x8000, UL)
+#define AARCH64_SHM_PMD_PGT_SIZE _AC(0x1000, UL)
 #define AARCH64_BOOT_INFO        _AC(0x10000, UL)
+#define AARCH64_CONSOLE_RING     _AC(0x20000, UL)
+#define AARCH64_CONSOLE_RING_SZ  _AC(0x11000, UL)
+#define AARCH64_CONSOLE_DATA     _AC(0x21000, UL)
+#define AARCH64_CONSOLE_DATA_SZ  _AC(0x10000, UL)
 #define AARCH64_GUEST_MIN_BASE   _AC(0x100000, UL)
 #define AARCH64_MMIO_BASE        _AC(0x100000000, UL)
 #define AARCH64_MMIO_SZ          _AC(0x40000000, UL)
+#define AARCH64_SHM_BASE         _AC(0x140000000, UL)
+#define AARCH64_SHM_SZ           _AC(0x40000000, UL)
 #define AARCH64_GUEST_BLOCK_SIZE _AC(0x200000, UL)
 #define AARCH64_PGT_MAP_START	 AARCH64_BOOT_INFO
 // move these out of here?
 
+// Exception syndrome defs
+#define HSR_EC_SHIFT             26
+#define HSR_EC_MASK              0x3f
+#define HSR_EC_WFX               0x01
+#define HSR_WFX_TI_WFE           _BITUL(0)
+
+// Generic timer defs
+#define AARCH64_VTIMER_IRQ       27
+#define CNTV_CTL_ENABLE          _BITUL(0)
+#define CNTV_CTL_IMASK           _BITUL(1)
+#define CNTV_CTL_ISTATUS         _BITUL(2)
+
 
 uint64_t aarch64_get_counter_frequency(void);
+uint64_t aarch64_get_counter(void);
+uint64_t aarch64_ns_to_ticks(uint64_t ns);
+uint64_t aarch64_ticks_to_ns(uint64_t ticks);
+
+// Programs VCpu's virtual timer to fire ticks counter ticks from now, delivered to the VMM as a VPPI event fault while the VCpu runs
+void vcpu_vtimer_arm(size_t vcpu_id, uint64_t ticks);
+void vcpu_vtimer_disarm(size_t vcpu_id);
 
 void setup_memory_mapping(uint8_t* mem, uint64_t mem_size);
+// Maps [gpa, gpa + size) of the shared memory window as Normal cacheable memory, both must be 2MB aligned and inside the window
+void setup_shm_mapping(uint8_t* mem, uint64_t gpa, uint64_t size);
 void setup_system_registers(size_t vcpu_id, uint64_t sp);
 void setup_tcb_registers(size_t vcpu_id, uint64_t p_entry, uint64_t boot_info_addr);
 
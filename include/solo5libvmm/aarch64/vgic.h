@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Virtual interrupt injection through the VGIC list registers
+/*
+    vgic_inject_irq() places an IRQ in a free list register of the guest's VCpu, or queues it until one is freed. seL4 requests an EOI
+    maintenance interrupt for injected IRQs, so when the guest EOIs one the VMM gets a VGIC maintenance fault, which fault_handle passes
+    to vgic_handle_maintenance() to free the list register, run the IRQ's ack callback and inject the next queued IRQ. A typical use is
+    raising a guest IRQ directly from notified() when a driver PD signals new packets or completed block requests, so the guest can sleep
+    in WFI rather than polling.
+*/
+
+// Number of list registers implemented by the GIC, 4 on most GICv2/GICv3 implementations
+#ifndef VGIC_NUM_LR
+#define VGIC_NUM_LR 4
+#endif
+
+// IRQs waiting for a free list register per guest
+#ifndef VGIC_PENDING_MAX
+#define VGIC_PENDING_MAX 32
+#endif
+
+#ifndef VGIC_MAX_HANDLERS
+#define VGIC_MAX_HANDLERS 16
+#endif
+
+#define VGIC_DEFAULT_PRIORITY 0xa0
+#define VGIC_GROUP 0
+
+struct guest;
+
+// Called when the guest EOIs irq, e.g. to ack the physical/driver side
+typedef void (*vgic_ack_fn)(struct guest* guest, uint16_t irq, void* cookie);
+
+struct vgic_stats
+{
+    uint64_t injected;          // IRQs written to a list register
+    uint64_t coalesced;         // Injections dropped as IRQ was already pending
+    uint64_t queued;            // Injections that had to wait for a list register
+    uint64_t dropped;           // Injections lost as pending queue was full
+    uint64_t maintenance;       // Maintenance faults handled
+};
+
+struct vgic_handler
+{
+    uint16_t irq;
+    uint8_t priority;
+    vgic_ack_fn ack;
+    void* cookie;
+};
+
+// Per guest VGIC state, kept in struct guest
+struct vgic_state
+{
+    uint16_t lr[VGIC_NUM_LR];                   // IRQ in each list register, 0xffff if free
+    uint8_t lr_fresh;                           // Bit per list register written since the guest last ran, still pending
+    uint16_t pending[VGIC_PENDING_MAX];
+    size_t pending_head;
+    size_t pending_count;
+    struct vgic_handler handlers[VGIC_MAX_HANDLERS];
+    size_t num_handlers;
+    struct vgic_stats stats;
+};
+
+// Registers priority and optional ack callback of a virtual IRQ, unregistered IRQs are injected with default priority
+bool vgic_register_irq(struct guest* guest, uint16_t irq, uint8_t priority, vgic_ack_fn ack, void* cookie);
+
+// Raises irq in guest, returns false if it could not be injected or queued
+bool vgic_inject_irq(struct guest* guest, uint16_t irq);
+
+// Returns true if guest has an IRQ it has not taken yet, i.e. waiting for a list register or written to one since the guest last ran.
+// The pending/active state of list registers can not be read back, but a WFI only traps when no virtual IRQ is pending, so a list
+// register the guest has run with is active. A register written before a resume that is not seen here (fault replies) is reported once
+// more at most, the guest then resumes and WFIs again
+bool vgic_irq_pending(struct guest* guest);
+
+// Called by guest_resume, list registers written so far are seen by the guest from now on
+void vgic_resume(struct guest* guest);
+
+// Handles a VGIC maintenance fault of guest, does not resume guest
+void vgic_handle_maintenance(struct guest* guest);
+
+// Forgets all list register and pending state and the registered IRQs, called by guest_init and guest_clear
+void vgic_reset(struct guest* guest);
+
+void vgic_get_stats(struct guest* guest, struct vgic_stats* stats);
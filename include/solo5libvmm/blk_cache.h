@@ -0,0 +1,106 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+
+// Block cache
+/*
+    Set associative cache of guest block devices shared by all guests of the VMM, keyed by (guest, handle, block). Its lines live in
+    memory the VMM hands over once with blk_cache_init() (e.g. a memory region mapped into the VMM PD). Once a device is attached with
+    blk_cache_attach(), fault_handle serves BLOCK_READs whose blocks are all cached (and BLOCK_WRITEs in write-back mode)
+    synchronously and resumes the guest, only misses are reported to the VMM as before.
+
+    On a reported BLOCK_READ miss the VMM may read blk_cache_fetch_len() bytes instead of hc->len, which extends the request with readahead
+    once a sequential stream is detected, and hands whatever it read to blk_cache_fill(). In write-through mode a BLOCK_WRITE invalidates
+    the cached blocks and is reported to the VMM, in write-back mode dirty blocks are handed to the write callback when evicted, on
+    blk_cache_flush(), on barriers (guest POLL or HALT, if flush_on_barrier is set) and when the guest is cleared.
+*/
+
+// Most sets used, fewer if the storage given to blk_cache_init() is smaller. Must be a power of 2
+#ifndef BLK_CACHE_SETS
+#define BLK_CACHE_SETS 256
+#endif
+
+#ifndef BLK_CACHE_WAYS
+#define BLK_CACHE_WAYS 4
+#endif
+
+// Largest block size that can be cached, every cache line holds one block
+#ifndef BLK_CACHE_BLOCK_SIZE
+#define BLK_CACHE_BLOCK_SIZE 512
+#endif
+
+#ifndef BLK_CACHE_MAX_DEVICES
+#define BLK_CACHE_MAX_DEVICES 8
+#endif
+
+// Consecutive sequential reads before readahead starts
+#define BLK_CACHE_SEQ_THRESHOLD 2
+
+struct blk_cache_config
+{
+    bool write_back;                            // Writes complete in the cache, otherwise they invalidate it and go to the driver
+    bool flush_on_barrier;                      // Write dirty blocks back whenever the guest POLLs or HALTs
+    size_t readahead;                           // Most blocks fetched beyond a sequential read, 0 disables readahead
+};
+
+// Writes blocks back to the driver, data is only valid during the call. Returns false if the write could not be queued
+typedef bool (*blk_cache_write_fn)(struct guest* guest, uint64_t handle, uint64_t offset, const void* data, size_t len, void* cookie);
+
+struct blk_cache_stats
+{
+    uint64_t read_hits;                         // BLOCK_READs served from the cache
+    uint64_t read_misses;                       // BLOCK_READs reported to the VMM
+    uint64_t write_hits;                        // BLOCK_WRITEs absorbed by the cache (write-back)
+    uint64_t write_misses;                      // BLOCK_WRITEs reported to the VMM
+    uint64_t filled;                            // Blocks inserted by blk_cache_fill
+    uint64_t readahead;                         // Blocks requested beyond the guest's reads by blk_cache_fetch_len
+    uint64_t evictions;                         // Valid blocks replaced
+    uint64_t writebacks;                        // Dirty blocks handed to the write callback
+    uint64_t errors;                            // Failed write callbacks, the blocks stay dirty
+};
+
+// Hands the cache its storage, 8-byte aligned. Each set takes BLK_CACHE_WAYS blocks of BLK_CACHE_BLOCK_SIZE plus a few bytes of line
+// state, the number of sets is the largest power of 2 that fits, at most BLK_CACHE_SETS. Call before attaching devices
+bool blk_cache_init(void* storage, size_t size);
+
+// Caches a block device of guest, geometry is the one advertised in its MFT entry (guest_setup fills it in). block_size must be a power
+// of 2 no larger than BLK_CACHE_BLOCK_SIZE, write may only be NULL in write-through mode
+bool blk_cache_attach(struct guest* guest, uint64_t handle, const struct mft_block_basic* geometry, const struct blk_cache_config* config,
+    blk_cache_write_fn write, void* cookie);
+
+// Writes back and drops all blocks of the device
+void blk_cache_detach(struct guest* guest, uint64_t handle);
+
+// Serves a BLOCK_READ if every block is cached, resuming the guest, called by fault_handle. Returns false on a miss
+bool blk_cache_read(struct guest* guest, struct hvt_hc_block_read* hc);
+
+// Handles a BLOCK_WRITE, called by fault_handle. Returns true if it completed in the cache and the guest was resumed
+bool blk_cache_write(struct guest* guest, struct hvt_hc_block_write* hc);
+
+// Bytes the VMM should read from hc->offset to serve a BLOCK_READ miss, hc->len plus readahead
+size_t blk_cache_fetch_len(struct guest* guest, const struct hvt_hc_block_read* hc);
+
+// Inserts blocks read from the driver, blocks that are already cached are kept as they may be newer
+void blk_cache_fill(struct guest* guest, uint64_t handle, uint64_t offset, const void* data, size_t len);
+
+// Writes back all dirty blocks of the device, returns false if any write callback failed
+bool blk_cache_flush(struct guest* guest, uint64_t handle);
+
+// Flushes devices configured with flush_on_barrier, called by fault_handle on POLL and HALT
+void blk_cache_barrier(struct guest* guest);
+
+// Writes back dirty blocks of all devices of guest, used by guest_clear. Clean blocks stay cached for the next boot
+void blk_cache_flush_all(struct guest* guest);
+
+// Detaches all devices of guest, called by guest_deinit
+void blk_cache_release(struct guest* guest);
+
+// Fills capacity and block size of the guest's block MFT entries with an attached cache, called by guest_setup
+void blk_cache_setup(struct guest* guest);
+
+void blk_cache_get_stats(struct guest* guest, uint64_t handle, struct blk_cache_stats* stats);
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+
+// Block request queue
+/*
+    Forwards BLOCK_READ/BLOCK_WRITE hypercalls to the block driver with several requests in flight. Guest handles are mapped to driver
+    devices with blk_queue_map(), fault_handle then queues the hypercalls of mapped handles that the block cache could not serve and
+    reports HVT_HYPERCALL_NONE, the guest is resumed once its request completes.
+
+    Requests are issued straight away while fewer than depth are in flight, once the driver is saturated they wait and hypercalls touching
+    contiguous ranges of the same device (e.g. guests sharing a disk image) are merged into one request of up to BLK_QUEUE_MAX_SEGMENTS
+    segments. Segments point into guest memory, the driver reads write data from them and stores read data into them before calling
+    blk_queue_complete() with the request tag, completions may arrive in any order. Completed reads are inserted into the block cache.
+
+    Devices set up with blk_queue_zero_init() have their write payloads scanned for zeros and keep a map of ranges known to read as
+    zeros (written with zeros, or unallocated in a sparse backing as told by blk_queue_mark_zero()). All-zero writes become
+    BLK_OP_WRITE_ZEROES requests without data if the driver supports them, and complete straight away if their range is already known to be
+    zero. Reads of known zero ranges are served with a zero fill without a driver round trip.
+*/
+
+// Requests waiting or in flight
+#ifndef BLK_QUEUE_MAX_REQUESTS
+#define BLK_QUEUE_MAX_REQUESTS 64
+#endif
+
+// Hypercalls merged into one request
+#ifndef BLK_QUEUE_MAX_SEGMENTS
+#define BLK_QUEUE_MAX_SEGMENTS 16
+#endif
+
+// Largest merged request
+#ifndef BLK_QUEUE_MAX_BYTES
+#define BLK_QUEUE_MAX_BYTES (256 * 1024)
+#endif
+
+#ifndef BLK_QUEUE_MAX_MAPPINGS
+#define BLK_QUEUE_MAX_MAPPINGS 16
+#endif
+
+#ifndef BLK_ZERO_MAX_DEVICES
+#define BLK_ZERO_MAX_DEVICES 4
+#endif
+
+// Smallest granule tracked by a zero map, larger devices get larger granules to fit the map they are given
+#define BLK_ZERO_MIN_GRANULE 4096
+
+// Bytes of zero map covering capacity at granule granularity, e.g. BLK_ZERO_MAP_SIZE(capacity, BLK_ZERO_MIN_GRANULE) for the finest map
+#define BLK_ZERO_MAP_SIZE(capacity, granule) ((((capacity) + (granule) * 64 - 1) / ((granule) * 64)) * 8)
+
+enum blk_op
+{
+    BLK_OP_READ,
+    BLK_OP_WRITE,
+    BLK_OP_WRITE_ZEROES                         // Write zeros over the range (or discard it on sparse backings), segments carry no data
+};
+
+struct blk_segment
+{
+    uint8_t* data;                              // VMM pointer into guest memory
+    size_t len;
+};
+
+struct blk_request
+{
+    uint32_t tag;                               // Passed back to blk_queue_complete
+    enum blk_op op;
+    uint64_t device;
+    uint64_t offset;
+    size_t len;                                 // Sum of segment lengths
+    size_t num_segments;
+    struct blk_segment segments[BLK_QUEUE_MAX_SEGMENTS];
+};
+
+// Hands a request to the driver, req is only valid during the call. Returns false if the driver cannot take it now, call
+// blk_queue_kick() once it can
+typedef bool (*blk_queue_issue_fn)(const struct blk_request* req, void* cookie);
+
+struct blk_queue_stats
+{
+    uint64_t submitted;                         // Hypercalls queued
+    uint64_t merged;                            // Hypercalls merged into another request
+    uint64_t issued;                            // Requests handed to the driver
+    uint64_t completed;                         // Requests completed
+    uint64_t errors;                            // Requests completed with an error
+    uint64_t cancelled;                         // Hypercalls dropped by blk_queue_cancel
+    uint64_t zero_writes;                       // All-zero write hypercalls
+    uint64_t zero_reads;                        // Read hypercalls served with a zero fill
+    uint64_t zero_bytes_saved;                  // Bytes not transferred to or from the driver thanks to zero detection
+    size_t max_inflight;                        // Most requests in flight at once
+};
+
+// depth is the number of requests the driver can have in flight, at most BLK_QUEUE_MAX_REQUESTS
+bool blk_queue_init(size_t depth, blk_queue_issue_fn issue, void* cookie);
+
+// Routes BLOCK_READ/BLOCK_WRITE of a guest handle to a driver device
+bool blk_queue_map(struct guest* guest, uint64_t handle, uint64_t device);
+
+void blk_queue_unmap(struct guest* guest, uint64_t handle);
+
+// Queues a block hypercall reported by fault_handle, called by fault_handle for mapped handles. Returns false if the handle is not mapped
+// or the queue is full, the VMM then handles the hypercall itself
+bool blk_queue_submit(struct guest* guest, enum hvt_hypercall hc, void* hc_data);
+
+// Issues waiting requests after the driver refused one
+void blk_queue_kick(void);
+
+// Completes a request, writes the result of every merged hypercall and resumes the guests
+void blk_queue_complete(uint32_t tag, bool ok);
+
+// Drops queued hypercalls of guest, used by guest_clear. Hypercalls of other guests merged with them keep their place, or fail if the
+// queue has no room left to split their request. Requests already issued still transfer their data, wait for blk_queue_pending() to reach
+// 0 before reusing guest memory
+void blk_queue_cancel(struct guest* guest);
+
+// Hypercalls of guest waiting or in flight
+size_t blk_queue_pending(struct guest* guest);
+
+// Cancels the hypercalls of guest and unmaps its handles, called by guest_deinit. Like after blk_queue_cancel, guest memory must stay
+// mapped until blk_queue_pending() reaches 0
+void blk_queue_release(struct guest* guest);
+
+// Enables zero detection for a driver device of capacity bytes, write_zeroes tells whether the driver handles BLK_OP_WRITE_ZEROES. The map
+// keeps a bit per granule in map_bits (map_size bytes, caller memory that must stay valid), the granule is the smallest power of 2 of at
+// least BLK_ZERO_MIN_GRANULE bytes for which the map covers the whole device
+bool blk_queue_zero_init(uint64_t device, uint64_t capacity, bool write_zeroes, uint64_t* map_bits, size_t map_size);
+
+// Records a range known to read as zeros, e.g. unallocated extents of a sparse image. Only whole granules are recorded
+void blk_queue_mark_zero(uint64_t device, uint64_t offset, uint64_t len);
+
+// Records a write of a guest handle that was served without the queue, e.g. absorbed by a write-back block cache, its range no longer
+// counts as known zero. Called by blk_cache_write
+void blk_queue_absorbed(struct guest* guest, uint64_t handle, uint64_t offset, uint64_t len);
+
+void blk_queue_get_stats(struct blk_queue_stats* stats);
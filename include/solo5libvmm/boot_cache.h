@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+
+// Number of distinct image/config combinations remembered, override at build time with -DBOOT_CACHE_ENTRIES=n
+#ifndef BOOT_CACHE_ENTRIES
+#define BOOT_CACHE_ENTRIES 1
+#endif
+
+// Largest possible boot block, boot info followed by the cmdline (with terminator) and the MFT aligned to its natural alignment
+#define BOOT_CACHE_BLOCK_SIZE (sizeof(struct hvt_boot_info) + HVT_CMDLINE_SIZE + 1 + alignof(struct mft) + MFT1_NOTE_MAX_SIZE)
+
+// Parsed boot state of a guest image, everything guest_setup produces apart from loaded segments and registers
+struct boot_cache_entry
+{
+    bool valid;
+    uint64_t key;
+    size_t kernel_size;
+    size_t mem_size;
+    size_t cmdline_len;
+    uint64_t p_entry;
+    uint64_t p_end;
+    // Offset of cmdline copy within block, compared on lookup so a key collision can not return another config's block
+    size_t cmdline_offset;
+    // Offset of MFT copy within block, and its size
+    size_t mft_offset;
+    size_t mft_size;
+    // Copy of guest memory from AARCH64_BOOT_INFO onwards (boot info, cmdline and MFT) as prepared by guest_setup
+    size_t block_size;
+    alignas(struct mft) uint8_t block[BOOT_CACHE_BLOCK_SIZE];
+};
+
+struct boot_cache_stats
+{
+    uint64_t hits;
+    uint64_t misses;
+};
+
+// Fast non-cryptographic 64 bit hash, processes 32 bytes per round
+uint64_t boot_cache_hash(const uint8_t* data, size_t size, uint64_t seed);
+
+// Computes cache key of a guest image and the configuration it is being booted with
+uint64_t boot_cache_key(const uint8_t* kernel, size_t kernel_size, size_t mem_size, const char* cmdline, size_t cmdline_len);
+
+// Returns matching entry or NULL, counts towards hit/miss stats. Besides the key the sizes and cmdline bytes must match, the kernel itself is
+// only covered by the key and its size, callers must check the entry point and end they get from loading it against the entry's
+struct boot_cache_entry* boot_cache_lookup(uint64_t key, size_t kernel_size, size_t mem_size, const char* cmdline, size_t cmdline_len);
+
+// Stores boot state, replacing the oldest entry if cache is full. Returns false and caches nothing if the block or the cmdline/MFT ranges
+// within it are out of bounds
+bool boot_cache_insert(uint64_t key, size_t kernel_size, size_t mem_size, size_t cmdline_len, uint64_t p_entry, uint64_t p_end,
+    const uint8_t* block, size_t block_size, size_t cmdline_offset, size_t mft_offset, size_t mft_size);
+
+// Drops a single entry, e.g. one whose image no longer loads to the cached entry point
+void boot_cache_remove(struct boot_cache_entry* entry);
+
+// Drops all entries, stats are kept
+void boot_cache_invalidate(void);
+
+void boot_cache_get_stats(struct boot_cache_stats* stats);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/timer.h>
+
+// Buffered guest console
+/*
+    Once a console is attached with console_init(), guest_setup advertises the shared console ring (see hvt_ext.h) to the guest and the
+    library handles PUTS hypercalls itself: their data is appended to the same ring and the guest resumed straight away, fault_handle
+    then reports HVT_HYPERCALL_NONE. The ring is drained into the write callback in batches: on any guest exit once CONSOLE_DRAIN_THRESHOLD
+    bytes are waiting, CONSOLE_FLUSH_NS after output was first seen through the timer queue, before guest_clear wipes guest memory, or
+    whenever the VMM calls console_drain() itself (e.g. from a low priority notification).
+*/
+
+// Bytes waiting in the ring that make any guest exit drain it
+#ifndef CONSOLE_DRAIN_THRESHOLD
+#define CONSOLE_DRAIN_THRESHOLD 4096
+#endif
+
+// Longest time output may sit in the ring before it is drained
+#ifndef CONSOLE_FLUSH_NS
+#define CONSOLE_FLUSH_NS 20000000
+#endif
+
+struct guest;
+
+// Receives drained guest output, data is not NUL terminated
+typedef void (*console_write_fn)(struct guest* guest, const char* data, size_t len, void* cookie);
+
+struct console_stats
+{
+    uint64_t puts;              // PUTS hypercalls handled
+    uint64_t bytes;             // Bytes written to the console
+    uint64_t flushes;           // Calls of the write callback
+    uint64_t overruns;          // Drains that found the guest's ring head inconsistent, its pending data was dropped
+};
+
+// Per guest console state, kept in struct guest
+struct console_state
+{
+    bool attached;
+    console_write_fn write;
+    void* cookie;
+    struct timer_event flush_event;
+    struct console_stats stats;
+};
+
+// Attaches a console to guest, call between guest_init and guest_setup. A NULL write callback prints output with printf
+void console_init(struct guest* guest, console_write_fn write, void* cookie);
+
+// Detaches console, remaining output is drained first. Guest keeps the ring until its next guest_setup. Also done by guest_deinit
+void console_deinit(struct guest* guest);
+
+bool console_attached(struct guest* guest);
+
+// Resets the ring in guest memory, returns its guest address or 0 if no console is attached. Called by guest_setup
+uint64_t console_setup(struct guest* guest);
+
+// Handles a PUTS hypercall of guest, guest must have been stopped by fault_handle, it is resumed before returning
+void console_puts(struct guest* guest, struct hvt_hc_puts* hc);
+
+// Writes everything waiting in the ring to the console
+void console_drain(struct guest* guest);
+
+// Called by fault_handle on every exit, drains a full enough ring and schedules the deferred flush
+void console_exit(struct guest* guest);
+
+void console_get_stats(struct guest* guest, struct console_stats* stats);
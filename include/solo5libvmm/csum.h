@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Internet checksum (RFC 1071) engine
+/*
+    Sums are ones' complement sums of big endian 16-bit words kept in 32 bits, chain csum_partial() calls over the parts of a packet (all
+    but the last part must have an even length) and finish with csum_fold(). Uses NEON when built for a target that has it, unless
+    CSUM_NO_NEON is defined (the csum_bench host tool builds both variants).
+*/
+
+// Adds data to sum
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum);
+
+// Adds a 16-bit value to sum
+static inline uint32_t csum_add16(uint32_t sum, uint16_t value)
+{
+    uint64_t s = (uint64_t)sum + value;
+    return (uint32_t)((s & 0xffff) + (s >> 16));
+}
+
+// Folds sum to 16 bits and complements it, the result is what goes into a checksum field (0 if a packet including its checksum is valid)
+static inline uint16_t csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
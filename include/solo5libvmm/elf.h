@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// OS-specific PT_LOAD p_flags bit set by the s5lpack tool, the segment file data is an LZ4 block which decompresses to at most p_memsz bytes,
+// any remaining bytes up to p_memsz are zero
+#define ELF_PF_LZ4 0x00100000
+
 bool elf_load_note(uint8_t* elf_ptr, size_t elf_size, uint32_t note_type, size_t note_align, size_t max_note_size, uint8_t* out_note_buf, size_t* acc_note_size);
 
-bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* guest_mem, size_t guest_mem_size, uint64_t p_min_loadaddr, uint64_t* p_entry, uint64_t* p_end);
\ No newline at end of file
+bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* guest_mem, size_t guest_mem_size, uint64_t p_min_loadaddr, uint64_t* p_entry, uint64_t* p_end);
@@ -4,8 +4,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <microkit.h>
+#include <solo5libvmm/guest.h>
 #include <solo5libvmm/solo5/hvt_abi.h>
 
 char* fault_to_string(seL4_Word fault_label);
 
-bool fault_handle(size_t vcpu_id, microkit_msginfo msginfo, uint8_t* guest_mem, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault);
\ No newline at end of file
+// Decodes a fault of guest, route microkit fault() calls with guest_from_vcpu(child). On a valid hypercall the guest is left stopped with
+// pc advanced past the hypercall, hypercall_data points at the hypercall struct in guest memory (bounds checked against guest RAM)
+bool fault_handle(struct guest* guest, microkit_msginfo msginfo, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault);
\ No newline at end of file
@@ -3,25 +3,184 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <solo5libvmm/aarch64/vgic.h>
+#include <solo5libvmm/console.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/iopoll.h>
+#include <solo5libvmm/mmio.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/poll.h>
+#include <solo5libvmm/ratelimit.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/shm.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/wss.h>
+
+// Maximum number of guests (one VCpu each) a single VMM PD can drive, VCpu IDs must be below this
+#ifndef GUEST_MAX_VCPUS
+#define GUEST_MAX_VCPUS 64
+#endif
+
+// Reported through hypercall_id when fault_handle consumed the fault itself (e.g. a scheduler time slice expiring), nothing for VMM to do
+#define HVT_HYPERCALL_NONE ((enum hvt_hypercall)0)
+
+// seL4 fault labels are small integers, exits are also counted per label
+#define GUEST_FAULT_LABELS 8
+
+enum guest_state
+{
+    GUEST_STATE_STOPPED,                        // Stopped by VMM or on an unhandled fault
+    GUEST_STATE_RUNNING,
+    GUEST_STATE_BLOCKED,                        // Stopped waiting on a hypercall to complete
+    GUEST_STATE_IDLE                            // Stopped after WFI until a timer deadline or I/O event
+};
+
+// All times are in generic counter ticks
+struct guest_stats
+{
+    uint64_t exits;                             // All faults delivered to fault_handle
+    uint64_t exits_by_fault[GUEST_FAULT_LABELS];// Faults indexed by seL4 fault label
+    uint64_t hypercalls[HVT_HYPERCALL_MAX];     // Decoded hypercalls, indexed by enum hvt_hypercall
+    uint64_t ext_hypercalls[HVT_EXT_HYPERCALL_COUNT];// Extension hypercalls, indexed from HVT_EXT_HYPERCALL_BASE
+    uint64_t unhandled;                         // Faults fault_handle could not handle, guest was stopped
+    uint64_t boots;                             // Successful guest_setup calls
+    uint64_t run_ticks;                         // Time between guest_resume and the next exit or stop
+    uint64_t stopped_ticks;                     // Time stopped not waiting on a hypercall
+    uint64_t idle_ticks;                        // Time idle in WFI
+    uint64_t blocked_ticks[HVT_HYPERCALL_MAX];  // Time stopped waiting on a hypercall, indexed by hypercall class
+};
+
+// Seqlock protected copy of guest stats, place in memory shared with a monitoring PD which polls it with guest_stats_read
+struct guest_stats_snapshot
+{
+    volatile uint64_t seq;
+    uint64_t timestamp;
+    struct guest_stats stats;
+};
+
+struct guest_acct
+{
+    enum guest_state state;
+    enum hvt_hypercall blocked_on;
+    uint64_t since;                             // Counter value at last state transition
+};
+
+struct guest_boot_state
+{
+    bool booted;
+    uint64_t p_entry;
+    uint64_t p_end;
+    uint64_t mft;                               // Guest address of MFT copy in boot info area
+};
+
+// Per guest context, one per VCpu driven by this VMM
+struct guest
+{
+    size_t vcpu_id;
+    uint8_t* mem;                               // Guest memory as mapped in VMM, guest physical address 0
+    size_t mem_size;
+    struct guest_stats stats;
+    struct guest_acct acct;
+    struct guest_boot_state boot;
+
+    // State of the library's modules, reset by guest_init and released by guest_deinit
+    struct sched_entity sched;
+    struct poll_state poll;
+    struct vgic_state vgic;
+    struct idle_state idle;
+    struct console_state console;
+    struct mmio_state mmio;
+    struct shm_state shm;
+    struct net_state net;
+    struct iopoll_state iopoll;
+    struct ratelimit_state ratelimit;
+    struct wss_state wss;
+};
+
+// Initialises guest context and registers it so faults on vcpu_id can be routed to it
+/*
+    vcpu_id - ID of VCpu the guest runs on, each guest must have a unique VCpu
+    mem - Guest memory as mapped in the VMM (from guests perspective memory always starts from address 0)
+    mem_size - Total memory given to guest, this includes space for guest image, stack and heap, truncated down to 2MB alignment, error if 0
+*/
+bool guest_init(struct guest* guest, size_t vcpu_id, uint8_t* mem, size_t mem_size);
+
+// Unregisters guest and releases what the library keeps for it (scheduler entry, pending and deferred hypercalls, armed timers, console
+// output still buffered, switch ports, queued packets, cached blocks, block requests), it must be stopped first. Block requests already
+// issued to the driver still transfer their data, keep guest memory mapped until blk_queue_pending() is 0. The context can be reused with
+// guest_init afterwards
+void guest_deinit(struct guest* guest);
+
+// Returns guest registered on vcpu_id or NULL, use to route microkit fault() calls
+struct guest* guest_from_vcpu(size_t vcpu_id);
+
+// Returns VMM pointer to size bytes of guest memory at guest physical address gpa, or NULL if range is not entirely inside guest RAM or
+// one shared memory window (see shm.h)
+void* guest_ptr(struct guest* guest, uint64_t gpa, size_t size);
+
+// Returns the MFT guest_setup copied into guest memory, or NULL if its entry count is out of range or its entries do not fit guest memory.
+// For the setup functions called by guest_setup, which fill in MFT fields
+struct mft* guest_mft(struct guest* guest);
+
+// Records a guest state transition, time since the last transition is charged to the previous state. Called by the library at every
+// resume/stop/exit, VMMs stopping guests without guest_stop should call this themselves
+void guest_account(struct guest* guest, enum guest_state state, enum hvt_hypercall blocked_on);
+
+// Copies guest stats including time spent in the current state so far
+void guest_get_stats(struct guest* guest, struct guest_stats* stats);
+
+// Writes current stats into snapshot, cheap enough to call on every exit
+void guest_stats_publish(struct guest* guest, struct guest_stats_snapshot* snapshot);
+
+// Reads a consistent copy of a published snapshot, for use by the monitoring side, returns snapshot timestamp
+uint64_t guest_stats_read(const struct guest_stats_snapshot* snapshot, struct guest_stats* stats);
 
 // Sets up memory and VCpu registers of virtual guest
-/*  
-    boot_vcpu_id - ID of VCpu for guest to run on, should always be 0 as a VMM only runs 1 guest, but left as param for future changes
+/*
     kernel - Pointer to guest image
     kernel_size - Size of guest image in bytes
-    virtual_memory_offset - VMM can map in guest memory at a different address than what guest sees (from guests perspective memory always starts from address 0), this is the difference in bytes
-    memory_size - Total memory given to guest, this includes space for guest image, stack and heap, should be page (4k) aligned, error if not
     max_stack_size - Maximum stack size for guest, if exceeds available memory after image load it will cause error, if set to 0 no limit is set, uses 4k of memory due to setup of protection page
     cmdline - Command line arg passed to guest as per HVT spec
-    mft - Mft structure passed to guest, represents available devices as per HVT spec
+    cmdline_len - Length of cmdline excluding terminator
 */
-bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* mem, size_t mem_size, size_t max_stack_size, char* cmdline, size_t cmdline_len);
+bool guest_setup(struct guest* guest, uint8_t* kernel, size_t kernel_size, size_t max_stack_size, char* cmdline, size_t cmdline_len);
 
 // Start guest execution from current PC value, need to figure out if pc points to next or last executed
-void guest_resume(size_t vcpu_id);
+void guest_resume(struct guest* guest);
 
 // Pauses guest, gonna need to figure out how pc is setup
-void guest_stop(size_t vcpu_id);
+void guest_stop(struct guest* guest);
+
+// Clears guest registers and memory, allows for setting up new guest image after. Returns false if block requests of guest are still in
+// flight (see blk_queue_cancel), guest is then left stopped with its memory untouched, call again once blk_queue_pending() is 0
+bool guest_clear(struct guest* guest);
+
+// Image prepared with guest_stage for a later guest_cutover
+struct guest_stage
+{
+    bool ready;
+    struct guest* guest;                        // Guest the image was prepared for
+    uint8_t* mem;                               // Staging memory, mirrors guest memory from address 0
+    size_t size;                                // Bytes of staging memory copied into the guest, up to the end of the image
+    size_t mem_size;                            // Guest RAM size the image was prepared for
+    uint64_t p_entry;
+    uint64_t p_end;
+    uint64_t mft;
+    uint64_t cutover_ticks;                     // Time the guest was down in its last cutover
+};
+
+// Validates and loads a new image for guest into staging memory while the guest keeps running
+/*
+    staging - VMM memory to prepare the image in (e.g. a spare memory region), must stay untouched until the cutover
+    staging_size - Size of staging memory, only needs to cover the guest address range up to the end of the image
+    Other arguments as for guest_setup
+*/
+bool guest_stage(struct guest* guest, struct guest_stage* stage, uint8_t* staging, size_t staging_size, uint8_t* kernel, size_t kernel_size,
+    char* cmdline, size_t cmdline_len);
 
-// Clears guest registers and memory, allows for setting up new guest image after 
-void guest_clear(size_t vcpu_id, uint8_t* guest_mem, size_t guest_mem_size);
\ No newline at end of file
+// Replaces the running image of guest with a staged one: stops it, copies the staged memory in, zeroes the rest and resets registers,
+// leaving it ready to resume like guest_setup does. Zeroing all RAM beyond the image is most of the downtime, if working set sampling
+// (wss_enable) ran since the old image booted only what it touched is cleared. The stage stays valid, cutting over again restarts the new
+// image. Fails for a stage prepared for another guest, and like guest_clear while block requests of guest are in flight
+bool guest_cutover(struct guest* guest, struct guest_stage* stage);
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+
+// Pool of pre-booted guests
+/*
+    Keeps spare guests of one image booted up to a readiness point so a new instance can be handed out with a resume instead of a full
+    boot. Guests given to the pool with guest_pool_add() (guest_init done, otherwise unused) are booted in the background from timer
+    callbacks and run until they issue the config's ready_on hypercall (HVT_HYPERCALL_POLL for a solo5 guest that finished its init and
+    waits for I/O). fault_handle parks them there, stopped with pc on the hypercall, without reporting it.
+
+    guest_pool_acquire() takes a parked guest, calls the patch callback to write per instance data into it and resumes it, the guest then
+    issues its parked hypercall again which is reported to the VMM as usual. Only data the image reads after its readiness point can be
+    patched this way (e.g. a config block in a shared window). The cmdline and the MFT, including the MACs of switch ports, are read while
+    the guest boots: every pool guest runs with the config's cmdline and the MACs its ports had when it was booted, neither can be changed
+    per instance once a guest is parked. A spare is booted right away to replace it. Guests handed back with guest_pool_release() are
+    cleared and warmed up again, once block requests still in flight for them have completed.
+
+    The first spare is booted from guest_pool_init()/guest_pool_add() themselves, later ones from a refill deadline in the timer queue.
+    That queue only runs while some guest does (see timer.h): a VMM that may have all guests stopped, e.g. after a pooled guest halted,
+    must drive it with timer_next_deadline()/timer_expire() from its own timer, or call guest_pool_refill() itself.
+*/
+
+#ifndef GUEST_POOL_MAX_GUESTS
+#define GUEST_POOL_MAX_GUESTS 16
+#endif
+
+// Delay before booting again after a guest failed to reach its readiness point
+#ifndef GUEST_POOL_RETRY_NS
+#define GUEST_POOL_RETRY_NS 1000000000ULL
+#endif
+
+struct guest_pool_config
+{
+    uint8_t* kernel;                            // Image and boot arguments as for guest_setup, shared by all pool guests
+    size_t kernel_size;
+    size_t max_stack_size;
+    char* cmdline;
+    size_t cmdline_len;
+    enum hvt_hypercall ready_on;                // First hypercall of this kind marks a guest ready, anything but HALT
+    size_t spares;                              // Guests kept ready or warming up
+};
+
+// Writes per instance data into a parked guest before it is resumed
+typedef void (*guest_pool_patch_fn)(struct guest* guest, void* cookie);
+
+struct guest_pool_stats
+{
+    uint64_t warmed;                            // Guests that reached their readiness point
+    uint64_t failures;                          // Guests that halted or failed to boot before it
+    uint64_t acquired;                          // Guests handed out
+    uint64_t misses;                            // guest_pool_acquire calls with no guest ready
+    uint64_t warm_ticks;                        // Time from boot to readiness, summed over warmed guests
+    uint64_t acquire_ticks;                     // Time spent in guest_pool_acquire, summed over handed out guests
+    size_t ready;                               // Guests parked right now
+};
+
+// Sets the image pool guests are booted with, guests already parked keep the previous one until released
+bool guest_pool_init(const struct guest_pool_config* config);
+
+// Gives a guest to the pool, it is booted once spares are needed
+bool guest_pool_add(struct guest* guest);
+
+// Hands out a parked guest and resumes it after patch (may be NULL) ran. Returns NULL if no guest is ready
+struct guest* guest_pool_acquire(guest_pool_patch_fn patch, void* cookie);
+
+// Takes back a guest handed out by guest_pool_acquire, it is cleared and booted again as a spare. While block requests of the guest are
+// in flight it is left stopped and cleared by a later guest_pool_refill
+void guest_pool_release(struct guest* guest);
+
+// Called by fault_handle for every hypercall before it is handled. Returns true if guest is warming up and the hypercall was consumed:
+// parked on its readiness point, or cleared after halting (later, like guest_pool_release, if block requests are in flight)
+bool guest_pool_hold(struct guest* guest, enum hvt_hypercall hc);
+
+// Boots one spare if fewer than config.spares guests are ready or warming up, called from a timer callback which re-arms itself while
+// more are needed. Safe to call from the VMM at any time
+void guest_pool_refill(void);
+
+// Number of guests parked and ready to hand out
+size_t guest_pool_ready(void);
+
+void guest_pool_get_stats(struct guest_pool_stats* stats);
@@ -0,0 +1,158 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+
+// solo5libvmm extensions to the HVT ABI
+/*
+    Everything here is optional for guests, unmodified solo5 bindings keep working. Guests with matching bindings find the extension block
+    directly after struct hvt_boot_info (the cmdline and MFT follow it), identified by HVT_BOOT_INFO_EXT_MAGIC. Fields are only ever
+    appended, size tells the guest how many are present, guest pointer fields set to 0 mean the feature is not offered.
+*/
+
+#define HVT_BOOT_INFO_EXT_MAGIC 0x54584556484c3553ULL   // "S5LHVEXT"
+
+struct hvt_boot_info_ext
+{
+    uint64_t magic;
+    uint64_t size;                                      // sizeof(struct hvt_boot_info_ext) as known by the VMM
+    HVT_GUEST_PTR(struct hvt_console_ring*) console;    // Shared console ring, see below
+};
+
+// Shared console ring
+/*
+    Single producer (guest) single consumer (VMM) byte ring replacing PUTS for guest log output. The guest copies bytes to
+    data[head & (size - 1)] onwards, then publishes them with a release store of head; head and tail are free running. It must not let
+    head - tail exceed size, if the ring is full it issues a PUTS hypercall (len may be 0), which makes the VMM drain the ring before
+    handling it. The VMM drains the ring when the guest exits for other reasons, so ordinary logging costs the guest no exits.
+*/
+
+#define HVT_CONSOLE_RING_MAGIC 0x31534e4f434c3553ULL    // "S5LCONS1"
+
+struct hvt_console_ring
+{
+    uint64_t magic;
+    uint64_t size;                                      // Bytes of data, power of 2
+    HVT_GUEST_PTR(uint8_t*) data;
+    uint64_t reserved0[5];
+    volatile uint64_t head;                             // Written by guest only
+    uint64_t reserved1[7];
+    volatile uint64_t tail;                             // Written by VMM only
+    uint64_t reserved2[7];
+};
+
+_Static_assert(sizeof(struct hvt_boot_info_ext) == 24, "hvt_boot_info_ext - Size mismatch");
+_Static_assert(offsetof(struct hvt_boot_info_ext, console) == 16, "hvt_boot_info_ext - Offset mismatch");
+
+// Head and tail sit on their own cache lines so producer and consumer do not contend
+_Static_assert(sizeof(struct hvt_console_ring) == 192, "hvt_console_ring - Size mismatch");
+_Static_assert(offsetof(struct hvt_console_ring, head) == 64, "hvt_console_ring - Offset mismatch");
+_Static_assert(offsetof(struct hvt_console_ring, tail) == 128, "hvt_console_ring - Offset mismatch");
+
+// Shared memory window manifest entries
+/*
+    A guest asks for a window by declaring an MFT entry of type MFT_DEV_SHM_BASIC named after it, the VMM fills in u as struct
+    mft_shm_basic and sets attached if it has a window of that name. Windows are Normal cacheable memory shared with another PD, e.g.
+    the packet buffers of a network driver, so the guest can produce and consume data in place.
+*/
+
+#define MFT_DEV_SHM_BASIC ((mft_type_t)0x100)
+
+struct mft_shm_basic
+{
+    uint64_t addr;                                      // Guest physical address of window
+    uint64_t size;                                      // Bytes
+};
+
+_Static_assert(sizeof(struct mft_shm_basic) <= sizeof(((struct mft_entry*)0)->u), "mft_shm_basic - Does not fit MFT entry");
+
+// Hypercall results, same values as solo5_result_t
+#define HVT_RESULT_OK 0
+#define HVT_RESULT_AGAIN 1
+#define HVT_RESULT_EINVAL 2
+#define HVT_RESULT_EUNSPEC 3
+
+// Extension hypercalls
+/*
+    Issued like HVT hypercalls (a 32-bit store of the argument struct's guest address to HVT_HYPERCALL_ADDRESS(nr)), numbered from
+    HVT_EXT_HYPERCALL_BASE. They are synchronous and handled by the library, the guest continues as soon as the hypercall returns.
+*/
+
+#define HVT_EXT_HYPERCALL_BASE 64
+
+enum hvt_ext_hypercall
+{
+    HVT_EXT_HYPERCALL_NET_READV = HVT_EXT_HYPERCALL_BASE,
+    HVT_EXT_HYPERCALL_NET_WRITE_LSO,
+    HVT_EXT_HYPERCALL_MAX
+};
+
+#define HVT_EXT_HYPERCALL_COUNT (HVT_EXT_HYPERCALL_MAX - HVT_EXT_HYPERCALL_BASE)
+
+struct hvt_net_iov
+{
+    HVT_GUEST_PTR(void*) data;
+    uint64_t len;                                       // IN: buffer size, OUT: packet length
+};
+
+// HVT_EXT_HYPERCALL_NET_READV: receives up to iovcnt packets in one exit, one per buffer
+struct hvt_hc_net_readv
+{
+    /* IN */
+    uint64_t handle;
+    HVT_GUEST_PTR(struct hvt_net_iov*) iov;
+    uint64_t iovcnt;
+
+    /* OUT */
+    uint64_t npackets;                                  // Buffers filled
+    int ret;                                            // HVT_RESULT_AGAIN if no packet was waiting
+};
+
+// HVT_EXT_HYPERCALL_NET_WRITE_LSO: sends a TCP segment or UDP datagram larger than the MTU
+/*
+    data is an Ethernet frame whose headers (IPv4 or IPv6 TCP, or IPv4 UDP) are those of the first frame to send, followed by the whole
+    payload. The VMM splits TCP payloads into segments of at most mss bytes (0 means as many as the MTU allows) with sequence numbers,
+    IPv4 IDs and flags fixed up, and sends UDP datagrams as IPv4 fragments. Checksums of the guest are ignored and computed per frame.
+*/
+struct hvt_hc_net_write_lso
+{
+    /* IN */
+    uint64_t handle;
+    HVT_GUEST_PTR(const void*) data;
+    uint64_t len;
+    uint64_t mss;
+
+    /* OUT */
+    uint64_t nframes;                                   // Frames sent
+    int ret;
+};
+
+_Static_assert(sizeof(struct hvt_net_iov) == 16, "hvt_net_iov - Size mismatch");
+_Static_assert(sizeof(struct hvt_hc_net_readv) == 40, "hvt_hc_net_readv - Size mismatch");
+_Static_assert(offsetof(struct hvt_hc_net_readv, npackets) == 24, "hvt_hc_net_readv - Offset mismatch");
+_Static_assert(offsetof(struct hvt_hc_net_readv, ret) == 32, "hvt_hc_net_readv - Offset mismatch");
+_Static_assert(sizeof(struct hvt_hc_net_write_lso) == 48, "hvt_hc_net_write_lso - Size mismatch");
+_Static_assert(offsetof(struct hvt_hc_net_write_lso, nframes) == 32, "hvt_hc_net_write_lso - Offset mismatch");
+_Static_assert(offsetof(struct hvt_hc_net_write_lso, ret) == 40, "hvt_hc_net_write_lso - Offset mismatch");
+
+// Net manifest entry extension
+/*
+    MFT_DEV_NET_BASIC entries are filled in as struct mft_net_ext, a compatible superset of struct mft_net_basic. offload tells the guest
+    which work the VMM does for it.
+*/
+
+#define MFT_NET_OFFLOAD_CSUM_TX (1U << 0)                // Checksums of NET_WRITE frames may be left unset
+#define MFT_NET_OFFLOAD_CSUM_RX (1U << 1)                // Checksums of received frames were verified, bad frames are dropped
+#define MFT_NET_OFFLOAD_LSO (1U << 2)                    // HVT_EXT_HYPERCALL_NET_WRITE_LSO is available
+
+struct mft_net_ext
+{
+    uint8_t mac[6];
+    uint16_t mtu;
+    uint32_t offload;
+};
+
+_Static_assert(offsetof(struct mft_net_ext, mtu) == offsetof(struct mft_net_basic, mtu), "mft_net_ext - Offset mismatch");
+_Static_assert(sizeof(struct mft_net_ext) <= sizeof(((struct mft_entry*)0)->u), "mft_net_ext - Does not fit MFT entry");
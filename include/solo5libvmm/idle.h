@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/timer.h>
+
+// WFI/WFE handling
+/*
+    A guest executing WFI is stopped and marked idle (time is accounted as idle_ticks) until an I/O event wakes it: a virtual IRQ
+    injected with vgic_inject_irq(), a handle becoming ready with poll_set_ready(), or an explicit idle_wake(). If the guest armed its own
+    virtual timer before WFI, its deadline is added to the timer queue so it is woken in time. Idle guests give the core to the scheduler.
+    WFE is treated as a yield, it is used in spin loops that expect to be woken by events rather than interrupts.
+*/
+
+struct idle_stats
+{
+    uint64_t wfi;               // WFI traps
+    uint64_t wfe;               // WFE traps
+    uint64_t idled;             // WFI traps that stopped the guest
+    uint64_t wakeups;           // Idle guests woken
+};
+
+struct guest;
+
+// Per guest idle state, kept in struct guest
+struct idle_state
+{
+    bool idle;
+    struct timer_event wake_event;
+    struct idle_stats stats;
+};
+
+// Prepares the idle state of guest, called by guest_init
+void idle_init(struct guest* guest);
+
+// Handles a WFI/WFE trap of guest, pc must already point past the instruction
+void idle_handle_wfx(struct guest* guest, bool is_wfe);
+
+// Wakes guest if idle, no-op otherwise
+void idle_wake(struct guest* guest);
+
+bool idle_is_idle(struct guest* guest);
+
+// Forgets idle state without resuming guest, used by guest_clear and guest_deinit
+void idle_cancel(struct guest* guest);
+
+void idle_get_stats(struct guest* guest, struct idle_stats* stats);
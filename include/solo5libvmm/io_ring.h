@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+
+// Single producer/single consumer descriptor rings
+/*
+    Lock-free rings for forwarding hypercalls between the VMM and driver PDs through a shared memory region, header only so driver PDs can
+    use them without linking the library. A connection is a pair of rings, requests from the VMM to the driver and completions back, each
+    side only ever produces into one and consumes from the other. Head and tail live on their own cache lines so producer and consumer do
+    not share a line that either of them writes.
+
+    Notifications are suppressed while the peer is busy: a consumer about to wait calls io_ring_consumer_idle(), which arms the flag and
+    re-checks the ring so no descriptor can slip in unseen, and the producer only signals (io_ring_notify_needed()) when the flag was armed.
+    Both sides enqueue/dequeue in batches with one release/acquire pair per batch.
+*/
+
+// Descriptors per ring, a power of 2
+#ifndef IO_RING_SIZE
+#define IO_RING_SIZE 256
+#endif
+
+_Static_assert((IO_RING_SIZE & (IO_RING_SIZE - 1)) == 0, "IO ring size must be a power of 2");
+
+#define IO_RING_CACHE_LINE 64
+
+enum io_ring_op
+{
+    IO_RING_OP_NET_WRITE = 1,
+    IO_RING_OP_NET_READ,
+    IO_RING_OP_BLOCK_READ,
+    IO_RING_OP_BLOCK_WRITE,
+    IO_RING_OP_BLOCK_WRITE_ZEROES
+};
+
+// Request and completion descriptor, completions echo the request with status and len filled in
+struct io_ring_desc
+{
+    uint32_t tag;                               // Chosen by the requester (e.g. a pending_tag_t), echoed back
+    uint8_t op;                                 // enum io_ring_op
+    uint8_t reserved;
+    int16_t status;                             // HVT_RESULT_ value in completions
+    uint32_t handle;                            // Device of the request
+    uint32_t len;                               // Buffer length, received length for completed NET_READs
+    uint64_t offset;                            // Byte offset for block requests
+    uint64_t addr;                              // Buffer address as agreed by both PDs, e.g. a guest physical address
+};
+
+_Static_assert(sizeof(struct io_ring_desc) == 32, "io_ring_desc - Size mismatch");
+
+struct io_ring
+{
+    alignas(IO_RING_CACHE_LINE) _Atomic uint32_t head;  // Written by the producer
+    _Atomic uint32_t producer_idle;                     // Producer waits for free space
+    alignas(IO_RING_CACHE_LINE) _Atomic uint32_t tail;  // Written by the consumer
+    _Atomic uint32_t consumer_idle;                     // Consumer waits for descriptors
+    alignas(IO_RING_CACHE_LINE) struct io_ring_desc descs[IO_RING_SIZE];
+};
+
+struct io_ring_pair
+{
+    struct io_ring requests;                    // VMM to driver
+    struct io_ring completions;                 // Driver to VMM
+};
+
+static inline void io_ring_init(struct io_ring* ring)
+{
+    atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->producer_idle, 0, memory_order_relaxed);
+    atomic_store_explicit(&ring->consumer_idle, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline size_t io_ring_count(struct io_ring* ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) - atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+// Copies up to n descriptors in and publishes them at once, returns the number enqueued
+static inline size_t io_ring_enqueue(struct io_ring* ring, const struct io_ring_desc* descs, size_t n)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    size_t space = IO_RING_SIZE - (uint32_t)(head - tail);
+
+    if (n > space) n = space;
+    for (size_t i = 0; i < n; i++)
+        ring->descs[(head + i) & (IO_RING_SIZE - 1)] = descs[i];
+
+    atomic_store_explicit(&ring->head, head + (uint32_t)n, memory_order_release);
+    return n;
+}
+
+// Copies out up to n descriptors and frees their slots at once, returns the number dequeued
+static inline size_t io_ring_dequeue(struct io_ring* ring, struct io_ring_desc* descs, size_t n)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t avail = (uint32_t)(head - tail);
+
+    if (n > avail) n = avail;
+    for (size_t i = 0; i < n; i++)
+        descs[i] = ring->descs[(tail + i) & (IO_RING_SIZE - 1)];
+
+    atomic_store_explicit(&ring->tail, tail + (uint32_t)n, memory_order_release);
+    return n;
+}
+
+// Called by the consumer before waiting for a notification. Returns false if descriptors arrived meanwhile, the consumer should keep
+// dequeuing instead of waiting
+static inline bool io_ring_consumer_idle(struct io_ring* ring)
+{
+    atomic_store_explicit(&ring->consumer_idle, 1, memory_order_relaxed);
+    // Flag store must be visible before the head is checked, pairs with the fence in io_ring_notify_needed
+    atomic_thread_fence(memory_order_seq_cst);
+    if (io_ring_count(ring) == 0) return true;
+
+    atomic_store_explicit(&ring->consumer_idle, 0, memory_order_relaxed);
+    return false;
+}
+
+// Called by the producer before waiting for space, the consumer signals once io_ring_space_notify_needed() says so. Returns false if
+// space became free meanwhile
+static inline bool io_ring_producer_idle(struct io_ring* ring)
+{
+    atomic_store_explicit(&ring->producer_idle, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (io_ring_count(ring) == IO_RING_SIZE) return true;
+
+    atomic_store_explicit(&ring->producer_idle, 0, memory_order_relaxed);
+    return false;
+}
+
+// Called by the producer after enqueueing, returns true (once) if the consumer is waiting and must be notified
+static inline bool io_ring_notify_needed(struct io_ring* ring)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&ring->consumer_idle, memory_order_relaxed)) return false;
+    return atomic_exchange_explicit(&ring->consumer_idle, 0, memory_order_relaxed) != 0;
+}
+
+// Called by the consumer after dequeueing, returns true (once) if the producer is waiting for space and must be notified
+static inline bool io_ring_space_notify_needed(struct io_ring* ring)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&ring->producer_idle, memory_order_relaxed)) return false;
+    return atomic_exchange_explicit(&ring->producer_idle, 0, memory_order_relaxed) != 0;
+}
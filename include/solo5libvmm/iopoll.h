@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Adaptive polling for I/O completions
+/*
+    Like halt-polling: right after forwarding a hypercall to a driver the VMM calls iopoll_wait(), which keeps calling the VMM's poll
+    function (e.g. draining the completion io_ring) for up to the guest's poll window before the VMM goes back to waiting for a
+    notification. A hit saves the notification and scheduling round trip.
+
+    Completions are reported with iopoll_complete() (pending_complete() and blk_queue_complete() do so), the time since iopoll_wait started
+    feeds a moving average of the guest's completion latency. The window follows 1.5x that average while it fits max_ns, and is halved
+    whenever completions take longer, so guests whose driver answers slowly stop burning the core on polls that miss.
+*/
+
+// Reasonable max_ns for drivers that answer within microseconds, polling keeps the VMM from handling other notifications meanwhile
+#ifndef IOPOLL_DEFAULT_MAX_NS
+#define IOPOLL_DEFAULT_MAX_NS 50000
+#endif
+
+// Weight of a new latency sample in the moving average is 1/2^IOPOLL_EWMA_SHIFT
+#define IOPOLL_EWMA_SHIFT 3
+
+struct guest;
+
+// Processes completions, returns true once the operation guest waits on has completed
+typedef bool (*iopoll_fn)(struct guest* guest, void* cookie);
+
+struct iopoll_stats
+{
+    uint64_t polls;                             // iopoll_wait calls that polled
+    uint64_t hits;                              // Completed while polling
+    uint64_t misses;                            // Window ran out
+    uint64_t poll_ticks;                        // Time spent polling
+    uint64_t window_ns;                         // Current poll window
+    uint64_t latency_ns;                        // Average completion latency
+};
+
+// Per guest polling state, kept in struct guest. All times in counter ticks
+struct iopoll_state
+{
+    uint64_t max;                               // 0 when polling is disabled
+    uint64_t window;
+    uint64_t latency;                           // Moving average, 0 until the first sample
+    uint64_t started;                           // Counter value when the guest started waiting, 0 if it is not
+    struct iopoll_stats stats;
+};
+
+// Enables polling for guest with windows up to max_ns (0 disables it)
+void iopoll_enable(struct guest* guest, uint64_t max_ns);
+
+// Polls until poll returns true or the guest's window passes. Returns true if the operation completed
+bool iopoll_wait(struct guest* guest, iopoll_fn poll, void* cookie);
+
+// Records the completion of the operation guest waits on and adapts its window
+void iopoll_complete(struct guest* guest);
+
+void iopoll_get_stats(struct guest* guest, struct iopoll_stats* stats);
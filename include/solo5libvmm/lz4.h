@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Decompresses an LZ4 block (raw block format, no frame header) from src into dst
+/*
+    src - Pointer to compressed block
+    src_size - Size of compressed block in bytes, the whole block must be consumed for decompression to succeed
+    dst - Pointer to output buffer, written to directly with no intermediate buffering
+    dst_capacity - Maximum number of bytes that may be written to dst, error if the block would decompress past it
+    out_size - Number of bytes written to dst on success
+*/
+bool lz4_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* out_size);
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Emulated MMIO devices
+/*
+    The VMM registers guest physical address ranges inside the MMIO window (above the hypercall and extension hypercall addresses), guest
+    loads and stores that fault on them are decoded by fault_handle and turned into read/write callbacks, reads complete by writing the
+    destination register.
+    The guest is resumed afterwards unless the callback stopped it, fault_handle then reports HVT_HYPERCALL_NONE. Only accesses the CPU
+    provides a syndrome for (single general purpose register loads/stores) can be emulated, guests must use plain ldr/str on devices.
+*/
+
+#ifndef MMIO_MAX_REGIONS
+#define MMIO_MAX_REGIONS 16
+#endif
+
+struct guest;
+
+// offset is relative to the region base, size is 1, 2, 4 or 8 bytes
+typedef uint64_t (*mmio_read_fn)(struct guest* guest, uint64_t offset, size_t size, void* cookie);
+typedef void (*mmio_write_fn)(struct guest* guest, uint64_t offset, size_t size, uint64_t value, void* cookie);
+
+struct mmio_stats
+{
+    uint64_t reads;
+    uint64_t writes;
+};
+
+struct mmio_region
+{
+    uint64_t base;
+    uint64_t size;
+    mmio_read_fn read;
+    mmio_write_fn write;
+    void* cookie;
+};
+
+// Per guest MMIO state, kept in struct guest. Regions are kept sorted by base and never overlap, so lookup is a binary search
+struct mmio_state
+{
+    struct mmio_region regions[MMIO_MAX_REGIONS];
+    size_t num_regions;
+    struct mmio_stats stats;
+};
+
+// Registers an emulated device over [base, base + size), either callback may be NULL (reads return 0, writes are ignored). Fails if the
+// range overlaps another region or the hypercall addresses, lies outside the MMIO window, or the table is full
+bool mmio_register(struct guest* guest, uint64_t base, uint64_t size, mmio_read_fn read, mmio_write_fn write, void* cookie);
+
+void mmio_unregister(struct guest* guest, uint64_t base);
+
+// Dispatches an access to the region containing it, value is read into or written from. Returns false if no region covers the access
+bool mmio_access(struct guest* guest, uint64_t addr, size_t size, bool is_write, uint64_t* value);
+
+void mmio_get_stats(struct guest* guest, struct mmio_stats* stats);
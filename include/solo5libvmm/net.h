@@ -0,0 +1,187 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/timer.h>
+
+// Network receive queues
+/*
+    The VMM pushes received packets for a guest's net handle (MFT entry index) with net_rx_push(), the library queues references to them
+    and copies them into the guest on NET_READ (net_read_handle(), called by the VMM) or on the batched NET_READV extension hypercall
+    (handled inside fault_handle), handing each buffer back through the release callback once copied or dropped.
+
+    Arrivals are coalesced before the guest is told: the handle is marked ready for POLL (poll_set_ready) only once coalesce_packets
+    packets are queued or coalesce_ns has passed since the first of them, whichever comes first, and stays ready until the queue is empty.
+    Setting coalesce_packets to 1 signals every packet straight away.
+*/
+
+// Network transmit
+/*
+    net_tx_init() connects a net handle to the driver's transmit function. NET_WRITE (net_write_handle(), called by the VMM) sends one
+    frame of up to mtu bytes of payload, the NET_WRITE_LSO extension hypercall lets the guest hand over up to NET_LSO_MAX_SIZE bytes at once
+    which the library splits into MTU sized frames with correct headers (TCP segmentation or IPv4 fragmentation for UDP). The MTU can be
+    raised up to NET_MAX_MTU for jumbo frames, guest_setup advertises it in the guest's MFT entry for the handle.
+
+    Checksum offload is set per handle with net_set_offload() and advertised in the same MFT entry (struct mft_net_ext in hvt_ext.h): with
+    NET_OFFLOAD_CSUM_TX the library fills IPv4, TCP and UDP checksums of NET_WRITE frames, with NET_OFFLOAD_CSUM_RX it verifies them
+    before frames are delivered by NET_READ/NET_READV and drops bad ones, so the guest can skip both. NET_WRITE_LSO always fills checksums.
+*/
+
+struct guest;
+
+#define NET_OFFLOAD_CSUM_TX MFT_NET_OFFLOAD_CSUM_TX
+#define NET_OFFLOAD_CSUM_RX MFT_NET_OFFLOAD_CSUM_RX
+
+#ifndef NET_MAX_MTU
+#define NET_MAX_MTU 9000
+#endif
+
+// MTU advertised for handles without a port set up by net_tx_init
+#ifndef NET_DEFAULT_MTU
+#define NET_DEFAULT_MTU 1500
+#endif
+
+#define NET_ETH_HDR_SIZE 14
+#define NET_LSO_MAX_SIZE (NET_ETH_HDR_SIZE + 65535)
+
+#ifndef NET_MAX_QUEUES
+#define NET_MAX_QUEUES 2
+#endif
+
+#ifndef NET_RX_MAX_DEPTH
+#define NET_RX_MAX_DEPTH 128
+#endif
+
+enum net_overflow
+{
+    NET_OVERFLOW_DROP_NEW,                      // Full queue rejects arriving packets, receiver keeps the oldest data
+    NET_OVERFLOW_DROP_OLD                       // Full queue drops its oldest packet to make room
+};
+
+struct net_rx_config
+{
+    size_t depth;                               // Queued packets, at most NET_RX_MAX_DEPTH
+    enum net_overflow overflow;
+    uint32_t coalesce_packets;                  // Packets that make the handle ready straight away, 0 is treated as 1
+    uint64_t coalesce_ns;                       // Longest time a packet waits before the handle is made ready
+};
+
+// Gives a packet buffer back to the driver, cookie is the one passed to net_rx_push
+typedef void (*net_rx_release_fn)(struct guest* guest, uint64_t handle, void* cookie);
+
+struct net_rx_stats
+{
+    uint64_t packets;                           // Packets queued
+    uint64_t delivered;                         // Packets copied into the guest
+    uint64_t dropped;                           // Packets dropped by the overflow policy
+    uint64_t truncated;                         // Packets larger than the guest buffer, dropped
+    uint64_t csum_errors;                       // Packets with bad checksums, dropped when NET_OFFLOAD_CSUM_RX is set
+    uint64_t reads;                             // NET_READ and NET_READV hypercalls
+    uint64_t signals;                           // Times the handle was made ready
+};
+
+// Sends one Ethernet frame, data is only valid during the call
+typedef void (*net_tx_fn)(struct guest* guest, uint64_t handle, const void* data, size_t len, void* cookie);
+
+struct net_tx_stats
+{
+    uint64_t writes;                            // NET_WRITE and NET_WRITE_LSO hypercalls
+    uint64_t frames;                            // Frames sent
+    uint64_t bytes;                             // Bytes sent, including Ethernet headers
+    uint64_t offloaded;                         // NET_WRITE_LSO hypercalls that needed more than one frame
+    uint64_t errors;                            // Rejected writes
+};
+
+struct net_rx_packet
+{
+    const uint8_t* data;
+    size_t len;
+    net_rx_release_fn release;
+    void* cookie;
+};
+
+struct net_rx_queue
+{
+    struct guest* guest;                        // Set by net_rx_init, for the coalescing timer
+    bool used;
+    uint64_t handle;
+    struct net_rx_config config;
+    net_rx_release_fn release;
+    struct net_rx_packet packets[NET_RX_MAX_DEPTH];
+    size_t head;
+    size_t count;
+    bool signalled;                             // Handle is marked ready for POLL
+    struct timer_event coalesce;
+    struct net_rx_stats stats;
+};
+
+struct net_tx_port
+{
+    bool used;
+    uint64_t handle;
+    uint16_t mtu;
+    net_tx_fn tx;
+    void* cookie;
+    struct net_tx_stats stats;
+};
+
+// Per guest queues and ports, kept in struct guest
+struct net_state
+{
+    struct net_rx_queue queues[NET_MAX_QUEUES];
+    struct net_tx_port ports[NET_MAX_QUEUES];
+    uint32_t offload[MFT_MAX_ENTRIES];          // NET_OFFLOAD_ flags by handle
+};
+
+bool net_rx_init(struct guest* guest, uint64_t handle, const struct net_rx_config* config, net_rx_release_fn release);
+
+// Drops all queued packets and forgets the queue
+void net_rx_deinit(struct guest* guest, uint64_t handle);
+
+// Queues a received packet, data must stay valid until released. Returns false if the packet was dropped (and released), or if handle
+// has no queue, the packet then stays with the caller as there is no release callback to hand it to
+bool net_rx_push(struct guest* guest, uint64_t handle, const void* data, size_t len, void* cookie);
+
+// Like net_rx_push, but the packet is handed back through release instead of the queue's callback (used by the virtual switch).
+// Packets for handles without a queue are released straight away
+bool net_rx_push_with(struct guest* guest, uint64_t handle, const void* data, size_t len, net_rx_release_fn release, void* cookie);
+
+// Copies a frame straight into a NET_READ of guest on handle that the VMM holds in the pending table (see pending.h) and completes it,
+// used by the virtual switch. Returns false with nothing copied if no read is pending or packets are queued ahead of the frame, true if
+// the frame was delivered or dropped (bad checksum, larger than the read buffer). The read's tag is stale afterwards, VMMs filling reads
+// from a driver must look the tag up with pending_get before writing the buffer
+bool net_rx_direct(struct guest* guest, uint64_t handle, const void* data, size_t len);
+
+// Handles a NET_READ hypercall of guest, guest must have been stopped by fault_handle, it is resumed before returning
+void net_read_handle(struct guest* guest, struct hvt_hc_net_read* hc);
+
+// Handles a NET_READV extension hypercall, called by fault_handle
+void net_readv_handle(struct guest* guest, struct hvt_hc_net_readv* hc);
+
+size_t net_rx_pending(struct guest* guest, uint64_t handle);
+
+// Drops all queued packets of guest, used by guest_clear and guest_deinit
+void net_rx_flush(struct guest* guest);
+
+void net_rx_get_stats(struct guest* guest, uint64_t handle, struct net_rx_stats* stats);
+
+// mtu is the largest IP packet, at most NET_MAX_MTU
+bool net_tx_init(struct guest* guest, uint64_t handle, uint16_t mtu, net_tx_fn tx, void* cookie);
+
+void net_tx_deinit(struct guest* guest, uint64_t handle);
+
+// Handles a NET_WRITE hypercall of guest, guest must have been stopped by fault_handle, it is resumed before returning
+void net_write_handle(struct guest* guest, struct hvt_hc_net_write* hc);
+
+// Handles a NET_WRITE_LSO extension hypercall, called by fault_handle
+void net_write_lso_handle(struct guest* guest, struct hvt_hc_net_write_lso* hc);
+
+void net_tx_get_stats(struct guest* guest, uint64_t handle, struct net_tx_stats* stats);
+
+bool net_set_offload(struct guest* guest, uint64_t handle, uint32_t flags);
+
+// Fills MTU and offload flags of the guest's net MFT entries, called by guest_setup
+void net_setup(struct guest* guest);
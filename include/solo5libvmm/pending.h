@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+
+// Pending hypercall table
+/*
+    Tracks hypercalls the VMM completes asynchronously (BLOCK_READ, BLOCK_WRITE, NET_READ, NET_WRITE), e.g. after forwarding them to a
+    driver PD and waiting for its notification. pending_add() records the hypercall reported by fault_handle with its decoded arguments and
+    returns a tag to hand to the driver, pending_complete() looks the tag up in O(1), writes ret (and len for NET_READ) into the guest's
+    hypercall struct and resumes the guest. Tags carry a generation so completions for operations that were cancelled (guest_clear) or
+    already completed are rejected.
+*/
+
+// Operations in flight across all guests, at most 2^PENDING_INDEX_BITS
+#ifndef PENDING_MAX_OPS
+#define PENDING_MAX_OPS 256
+#endif
+
+#define PENDING_INDEX_BITS 16
+#define PENDING_TAG_INVALID 0
+
+typedef uint32_t pending_tag_t;
+
+struct pending_op
+{
+    struct guest* guest;
+    enum hvt_hypercall hc;
+    void* hc_data;                              // Hypercall struct in guest memory
+    uint64_t handle;
+    uint64_t offset;                            // Block offset, 0 for net hypercalls
+    uint8_t* data;                              // VMM pointer to the guest buffer
+    size_t len;
+    uint64_t since;                             // Counter value when added
+};
+
+struct pending_stats
+{
+    uint64_t added;
+    uint64_t completed;
+    uint64_t stale;                             // Completions with unknown or reused tags
+    uint64_t full;                              // pending_add calls that found the table full
+    uint64_t cancelled;
+    uint64_t latency_ticks;                     // Sum of add to complete times
+    size_t max_pending;
+};
+
+// Records a hypercall reported by fault_handle. Returns PENDING_TAG_INVALID if the hypercall is not one of the supported ones, its
+// buffer is not inside guest memory or the table is full
+pending_tag_t pending_add(struct guest* guest, enum hvt_hypercall hc, void* hc_data);
+
+// Returns the operation of tag or NULL if the tag is stale
+const struct pending_op* pending_get(pending_tag_t tag);
+
+// Returns the tag of the oldest operation of guest for hc on handle, or PENDING_TAG_INVALID if there is none
+pending_tag_t pending_find(struct guest* guest, enum hvt_hypercall hc, uint64_t handle);
+
+// Writes the result into the guest's hypercall struct and resumes the guest, len is the received length for NET_READ and ignored
+// otherwise. Returns false if the tag is stale
+bool pending_complete(pending_tag_t tag, int ret, size_t len);
+
+// Drops all operations of guest without completing them, used by guest_clear and guest_deinit
+void pending_cancel(struct guest* guest);
+
+size_t pending_count(struct guest* guest);
+
+void pending_get_stats(struct pending_stats* stats);
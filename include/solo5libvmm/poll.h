@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/timer.h>
+
+// HVT POLL support
+/*
+    The VMM keeps each guest's ready set up to date with poll_set_ready()/poll_clear_ready() as its devices gain or drain data (bit n is
+    MFT entry n). On a POLL hypercall poll_handle() completes immediately if any handle is ready, otherwise the guest stays stopped until a
+    handle becomes ready or timeout_nsecs passes (tracked in the timer queue), whichever is first. Completion writes ready_set/ret and
+    wakes the guest through the scheduler if it owns the guest, otherwise with guest_resume.
+*/
+
+struct poll_stats
+{
+    uint64_t polls;             // POLL hypercalls handled
+    uint64_t immediate;         // Completed without waiting
+    uint64_t woken;             // Completed by a handle becoming ready
+    uint64_t timeouts;          // Completed by timeout
+};
+
+struct guest;
+
+// Per guest poll state, kept in struct guest
+struct poll_state
+{
+    uint64_t ready_set;
+    struct hvt_hc_poll* pending;
+    struct timer_event timeout;
+    struct poll_stats stats;
+};
+
+// Prepares the poll state of guest, called by guest_init
+void poll_init(struct guest* guest);
+
+// Handles a POLL hypercall of guest, guest must have been stopped by fault_handle
+void poll_handle(struct guest* guest, struct hvt_hc_poll* hc);
+
+// Marks handle as having data, completes a pending POLL
+void poll_set_ready(struct guest* guest, uint64_t handle);
+
+void poll_clear_ready(struct guest* guest, uint64_t handle);
+
+uint64_t poll_ready_set(struct guest* guest);
+
+// Returns true if guest is stopped in a POLL hypercall
+bool poll_pending(struct guest* guest);
+
+// Drops a pending POLL without completing it, used by guest_clear and guest_deinit
+void poll_cancel(struct guest* guest);
+
+void poll_get_stats(struct guest* guest, struct poll_stats* stats);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/timer.h>
+
+// Per guest I/O rate limiting
+/*
+    Token buckets (bytes/s and operations/s, each with a burst) per guest device, configured by MFT entry name with ratelimit_set() and
+    bound to handles by guest_setup. fault_handle charges NET_WRITE, NET_WRITE_LSO, BLOCK_READ and BLOCK_WRITE hypercalls against their
+    device's buckets (block cache read hits are free, they never reach a shared driver, writes are charged even when a write-back cache
+    absorbs them as they are written back to the driver later), a NET_WRITE_LSO counts as one operation however many frames it is split
+    into. A hypercall arriving while a bucket is in debt is deferred: the guest stays stopped without the VMM seeing the hypercall until
+    the buckets have refilled, then its pc is wound back and it is resumed so the hypercall is issued again. Buckets may go into debt by
+    one request, so requests larger than the burst still get through.
+*/
+
+#ifndef RATELIMIT_MAX_LIMITS
+#define RATELIMIT_MAX_LIMITS 8
+#endif
+
+// Zero rates are unlimited, zero bursts default to one second worth of the rate
+struct ratelimit_config
+{
+    uint64_t bytes_per_sec;
+    uint64_t bytes_burst;
+    uint64_t ops_per_sec;
+    uint64_t ops_burst;
+};
+
+struct ratelimit_stats
+{
+    uint64_t admitted;                          // Hypercalls charged and passed on
+    uint64_t deferred;                          // Hypercalls held back
+    uint64_t deferred_ticks;                    // Time guests spent held back
+};
+
+struct guest;
+
+// Tokens may go negative, a bucket in debt admits nothing until it has refilled to 0
+struct ratelimit_bucket
+{
+    uint64_t rate;                              // Tokens per second, 0 if unlimited
+    int64_t burst;
+    int64_t tokens;
+};
+
+struct ratelimit_limit
+{
+    const char* name;
+    struct ratelimit_config config;
+    bool bound;                                 // Set by ratelimit_setup if the MFT has an entry called name
+    uint64_t handle;
+    struct ratelimit_bucket bytes;
+    struct ratelimit_bucket ops;
+};
+
+// Per guest rate limiting state, kept in struct guest
+struct ratelimit_state
+{
+    struct ratelimit_limit limits[RATELIMIT_MAX_LIMITS];
+    size_t num_limits;
+    uint64_t last_refill;
+    struct timer_event retry_event;
+    uint64_t deferred_since;                    // 0 unless a hypercall is deferred
+    struct ratelimit_stats stats;
+};
+
+// Prepares the rate limiting state of guest, called by guest_init
+void ratelimit_init(struct guest* guest);
+
+// Limits the guest's device called name, call before guest_setup. name must stay valid while the limit exists
+bool ratelimit_set(struct guest* guest, const char* name, const struct ratelimit_config* config);
+
+void ratelimit_clear(struct guest* guest, const char* name);
+
+// Binds limits to MFT handles and fills the buckets, called by guest_setup
+void ratelimit_setup(struct guest* guest);
+
+// Charges a hypercall reported by fault_handle, called by fault_handle. Returns false if it was deferred, the guest stays stopped and is
+// resumed to retry it later
+bool ratelimit_admit(struct guest* guest, enum hvt_hypercall hc, void* hc_data);
+
+// Drops a deferred hypercall without resuming the guest, used by guest_clear and guest_deinit
+void ratelimit_cancel(struct guest* guest);
+
+void ratelimit_get_stats(struct guest* guest, struct ratelimit_stats* stats);
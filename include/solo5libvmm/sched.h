@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Credit scheduler for multiple guests sharing the VMM's core
+/*
+    Guests added to the scheduler must only be started/resumed through it: call sched_wake() instead of guest_resume() when a guest becomes
+    runnable (e.g. its hypercall completed), or sched_resume() which picks either, and sched_block() when a guest is left stopped waiting
+    on a hypercall. Only one guest runs at a
+    time, time slices are deadlines in the timer queue (see timer.h) which runs on the current guest's virtual timer.
+
+    Each guest earns credit in proportion to its weight every accounting period and burns credit while running. Guests woken by an I/O
+    completion are boosted ahead of all others as long as they have credit left, guests with credit run before guests without.
+*/
+
+// Number of time slices in one credit accounting period
+#define SCHED_SLICES_PER_PERIOD 3
+
+#define SCHED_DEFAULT_WEIGHT 256
+
+enum sched_prio
+{
+    SCHED_PRIO_BOOST,
+    SCHED_PRIO_UNDER,
+    SCHED_PRIO_OVER,
+    SCHED_PRIO_COUNT
+};
+
+struct sched_stats
+{
+    uint64_t run_ticks;         // Counter ticks spent running
+    uint64_t slices;            // Times scheduled in
+    uint64_t preemptions;       // Times descheduled while still runnable
+    uint64_t boosts;            // Wakeups that were boosted for pending I/O
+    int64_t credit;             // Current credit in counter ticks
+};
+
+struct guest;
+
+// Per guest scheduler state, kept in struct guest and only touched through the functions below
+struct sched_entity
+{
+    struct guest* guest;        // Set while added
+    uint32_t weight;
+    int64_t credit;
+    enum sched_prio prio;
+    bool runnable;
+    bool queued;
+    uint64_t run_start;
+    struct sched_entity* next;
+    struct sched_entity* prev;
+    struct sched_stats stats;
+};
+
+// Sets slice length, must be called before any other sched_ function
+void sched_init(uint64_t slice_ns);
+
+bool sched_add(struct guest* guest, uint32_t weight);
+
+// Takes guest off the scheduler, runs the next guest if it was the current one. Also done by guest_deinit
+void sched_remove(struct guest* guest);
+void sched_set_weight(struct guest* guest, uint32_t weight);
+
+// Returns true if guest is managed by the scheduler
+bool sched_owns(struct guest* guest);
+
+// Makes guest runnable, io_completion marks wakeups due to a completed I/O hypercall which are boosted
+void sched_wake(struct guest* guest, bool io_completion);
+
+// Wakes guest through the scheduler if it manages it, otherwise resumes it with guest_resume. For code that may run guests either way
+void sched_resume(struct guest* guest, bool io_completion);
+
+// Guest is stopped waiting on something (e.g. an asynchronous hypercall), runs the next guest if it was the current one
+void sched_block(struct guest* guest);
+
+// Guest gives up the rest of its slice but stays runnable, resumes it straight away if nobody else is waiting
+void sched_yield(struct guest* guest);
+
+// Current time slice expired, called from the timer queue, the current guest keeps running if nobody else is runnable
+void sched_tick(void);
+
+// Returns running guest or NULL if all guests are blocked
+struct guest* sched_current(void);
+
+void sched_get_stats(struct guest* guest, struct sched_stats* stats);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Shared memory windows
+/*
+    Extra guest physical ranges backed by memory regions shared with other PDs (e.g. a network driver's packet buffer pool). The memory
+    region must be mapped into the guest at gpa by the system description (and into the VMM at vaddr), the library maps it in the guest's
+    page tables as Normal cacheable memory, advertises it through MFT_DEV_SHM_BASIC manifest entries of the same name (see hvt_ext.h) and
+    lets guest_ptr() resolve addresses inside it, so hypercalls can pass buffers that live in the window without any copies.
+    Windows are 2MB granular and must lie in [AARCH64_SHM_BASE, AARCH64_SHM_BASE + AARCH64_SHM_SZ).
+*/
+
+#ifndef SHM_MAX_WINDOWS
+#define SHM_MAX_WINDOWS 8
+#endif
+
+struct guest;
+
+struct shm_window
+{
+    const char* name;
+    uint64_t gpa;
+    uint64_t size;
+    uint8_t* vaddr;
+};
+
+// Per guest windows, kept in struct guest
+struct shm_state
+{
+    struct shm_window windows[SHM_MAX_WINDOWS];
+    size_t num_windows;
+};
+
+// Declares a window of guest, call between guest_init and guest_setup. name must stay valid while the window exists
+bool shm_add_window(struct guest* guest, const char* name, uint64_t gpa, uint64_t size, void* vaddr);
+
+void shm_remove_window(struct guest* guest, const char* name);
+
+// Maps windows and attaches their MFT entries, called by guest_setup after the page tables and MFT are in place
+void shm_setup(struct guest* guest);
+
+// Returns VMM pointer to size bytes at guest physical address gpa if the range lies inside one window, otherwise NULL
+void* shm_ptr(struct guest* guest, uint64_t gpa, size_t size);
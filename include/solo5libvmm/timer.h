@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Deadline queue shared by all guests of a VMM
+/*
+    Events are kept in a binary min-heap keyed on absolute generic counter deadlines. The earliest deadline is programmed into the virtual
+    timer of a running guest (the scheduler's current guest if there is one), expiry is delivered as a VPPI event fault which fault_handle
+    turns into timer_expire(). Guest virtual timers only fire while the guest runs, so if all guests are stopped the VMM must use its own
+    timer source: program it with timer_next_deadline() and call timer_expire() when it fires. The queue assumes guests leave their virtual
+    timer unused (true for solo5), if a guest does arm it while the queue does not, its VPPI events are forwarded to it as a virtual IRQ.
+*/
+
+#ifndef TIMER_MAX_EVENTS
+#define TIMER_MAX_EVENTS 256
+#endif
+
+#define TIMER_NO_DEADLINE UINT64_MAX
+
+typedef void (*timer_fn)(void* arg);
+
+// Caller owned event, must stay valid while armed
+struct timer_event
+{
+    uint64_t deadline;
+    timer_fn fn;
+    void* arg;
+    size_t index;           // Position in heap while armed
+    bool armed;
+};
+
+void timer_event_init(struct timer_event* event, timer_fn fn, void* arg);
+
+// Arms event at absolute counter value deadline, re-arms if already armed. Returns false if queue is full
+bool timer_add(struct timer_event* event, uint64_t deadline);
+
+void timer_cancel(struct timer_event* event);
+
+// Returns earliest armed deadline or TIMER_NO_DEADLINE
+uint64_t timer_next_deadline(void);
+
+// Runs callbacks of all expired events, then reprograms the virtual timer. Callbacks may add and cancel events
+void timer_expire(void);
+
+// Returns true if the timer queue currently has vcpu_id's virtual timer programmed, otherwise the guest owns its own timer
+bool timer_vcpu_armed(size_t vcpu_id);
+
+// Moves/reprograms the virtual timer onto a running guest, called by the library whenever guests are resumed or stopped
+void timer_program(void);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Virtual switch
+/*
+    Learning L2 switch between the net handles of guests driven by the same VMM PD, so guest-to-guest traffic never goes through a driver.
+    Ports are added with vswitch_add_port(), a port needs a transmit port (net_tx_init, its driver is the uplink) and a receive queue
+    (net_rx_init). Every frame a port sends (NET_WRITE, and each frame NET_WRITE_LSO produces) passes through vswitch_forward(): frames for
+    a MAC of another port never reach the driver. If the receiving port has nothing queued and the VMM holds a NET_READ of it in the
+    pending table, the frame is copied once, straight from the sender's memory into that read (net_rx_direct). Otherwise it is copied into
+    a switch buffer queued on the port and copied again into the guest when it reads. Broadcast and multicast frames go to every other port
+    the same way and are still sent to the uplink, unknown unicast only goes to the uplink.
+
+    Each port is given its MAC by the VMM, guest_setup writes it into the port's MFT entry (vswitch_setup) so the guest sends with it. Port
+    MACs are never aged or moved, other MACs (e.g. of guests bridging further hosts) are learned from the source addresses of sent frames
+    and age out after VSWITCH_MAC_AGE_NS. Switch buffers live in memory the VMM hands over once with vswitch_init(), they are
+    reference counted and handed back once every receiver has read or dropped the frame, frames larger than VSWITCH_BUF_SIZE only go to
+    the uplink.
+*/
+
+#ifndef VSWITCH_MAX_PORTS
+#define VSWITCH_MAX_PORTS 16
+#endif
+
+#ifndef VSWITCH_MAC_ENTRIES
+#define VSWITCH_MAC_ENTRIES 64
+#endif
+
+#ifndef VSWITCH_MAC_AGE_NS
+#define VSWITCH_MAC_AGE_NS (300 * 1000000000ULL)
+#endif
+
+#ifndef VSWITCH_BUF_SIZE
+#define VSWITCH_BUF_SIZE 2048
+#endif
+
+// Storage one switch buffer takes, a frame of VSWITCH_BUF_SIZE and its reference count
+#define VSWITCH_BUF_STORAGE ((VSWITCH_BUF_SIZE + 7) / 8 * 8 + 16)
+
+struct vswitch_stats
+{
+    uint64_t switched;                          // Unicast frames delivered to another port
+    uint64_t flooded;                           // Broadcast/multicast frames delivered to other ports
+    uint64_t uplink;                            // Frames sent to the uplink
+    uint64_t bytes;                             // Bytes copied out of senders
+    uint64_t direct;                            // Deliveries copied straight into a pending NET_READ, no switch buffer
+    uint64_t dropped;                           // Frames not queued on a port: no switch buffer, hairpin or receive queue full
+    uint64_t too_big;                           // Frames larger than VSWITCH_BUF_SIZE, sent to the uplink only
+    uint64_t learned;                           // MAC table entries learned or moved to another port
+    uint64_t buffers;                           // Switch buffers in the storage given to vswitch_init
+};
+
+struct guest;
+
+// Hands the switch its buffers, 8-byte aligned, shared by all ports. size / VSWITCH_BUF_STORAGE buffers are used. Call before adding
+// ports, fails while frames are queued
+bool vswitch_init(void* storage, size_t size);
+
+// Connects a net handle of guest to the switch, mac is the port's unicast MAC and must not belong to another port
+bool vswitch_add_port(struct guest* guest, uint64_t handle, const uint8_t* mac);
+
+// Disconnects the port and forgets its MACs, frames already queued on it stay valid until read or flushed
+void vswitch_remove_port(struct guest* guest, uint64_t handle);
+
+// Disconnects all ports of guest, called by guest_deinit
+void vswitch_release(struct guest* guest);
+
+// Switches a frame sent by a port, data is only valid during the call. Returns true if the frame was consumed and must not be sent to
+// the uplink, called by the net transmit path
+bool vswitch_forward(struct guest* guest, uint64_t handle, const uint8_t* data, size_t len);
+
+// Writes the MACs of the guest's ports into its MFT entries, called by guest_setup
+void vswitch_setup(struct guest* guest);
+
+void vswitch_get_stats(struct vswitch_stats* stats);
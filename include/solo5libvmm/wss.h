@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/timer.h>
+
+// Working set estimation
+/*
+    Samples which parts of guest RAM a guest touches, so its mem_size can be sized to what it actually uses. The stage-1 tables built by
+    setup_memory_mapping() map the first 2MB with 4K pages and the rest of RAM with 2MB blocks. Once enabled the guest runs with hardware
+    Access flag updates (TCR_EL1.HA), every window_ns the Access flags are read and cleared, giving the 4K pages and 2MB blocks touched in
+    that window. The TLB may keep translations whose flag was cleared, so sampled entries are made non-global and each window moves the
+    guest to a new ASID, forcing fresh table walks without a TLB invalidate the VMM could not issue. Only 8-bit ASIDs are used as some
+    cores do not implement 16 bits, they are reused every 255 windows (counted in asid_wraps) and a translation surviving in the TLB that
+    long hides accesses through it. Enabling sampling on a running guest leaves its global translations cached until they are evicted, the
+    first windows may undercount.
+
+    Besides the windowed ages every page and block touched since boot is remembered, together with the buffers the guest handed to the
+    VMM (guest_ptr), so guest_cutover can zero only what the old image touched. Reused ASIDs do not lose anything there, a stale TLB
+    entry was walked and recorded in an earlier window. This only holds when sampling ran from the guest's boot on.
+
+    Hardware Access flag updates need FEAT_HAFDBS (Armv8.1, e.g. Cortex-A55/A76 and later). On cores without it the guest takes Access
+    flag faults it cannot handle, only enable sampling where the feature is known to be present.
+*/
+
+// Windows of history kept, bytes touched per window and the idle age histogram both cover this many windows
+#ifndef WSS_HISTORY
+#define WSS_HISTORY 16
+#endif
+
+// First 2MB of RAM is mapped with pages, the rest up to the MMIO window with blocks (block 0 is the page mapped one)
+#define WSS_PAGES (AARCH64_GUEST_BLOCK_SIZE / PAGE_SIZE)
+#define WSS_BLOCKS (AARCH64_MMIO_BASE / PMD_SIZE)
+
+struct wss_stats
+{
+    uint64_t windows;                           // Windows sampled since boot
+    uint64_t mem_size;                          // Guest RAM tracked, in bytes
+    uint64_t peak_bytes;                        // Most bytes touched in one window
+    uint64_t asid_wraps;                        // Times the guest's 255 ASIDs were used up and reused, windows after one may undercount
+    uint64_t history[WSS_HISTORY];              // Bytes touched per window, newest first
+    uint64_t idle_bytes[WSS_HISTORY + 1];       // Bytes by windows since last touched: [0] in the last window, [n] n windows before it,
+                                                // [WSS_HISTORY] longer ago or never
+};
+
+struct guest;
+
+// Per guest sampling state, kept in struct guest
+struct wss_state
+{
+    bool enabled;
+    uint64_t window_ns;
+    uint16_t asid;                              // Current ASID, 1 to 255 while sampling
+    struct timer_event window_event;
+    uint8_t page_age[WSS_PAGES];                // Windows since last touched, WSS_HISTORY if longer ago or never
+    uint8_t block_age[WSS_BLOCKS];
+    bool whole_boot;                            // Sampling started with the guest's boot, touched_* cover everything since
+    uint64_t touched_pages[WSS_PAGES / 64];     // Touched since boot, bit per page/block
+    uint64_t touched_blocks[WSS_BLOCKS / 64];
+    struct wss_stats stats;
+};
+
+// Prepares the sampling state of guest, called by guest_init
+void wss_init(struct guest* guest);
+
+// Starts sampling guest every window_ns, takes effect at the next guest_setup if the guest is not booted yet
+bool wss_enable(struct guest* guest, uint64_t window_ns);
+
+// Stops sampling and restores the guest's Access flags
+void wss_disable(struct guest* guest);
+
+// Prepares the tables and registers of a freshly set up guest, called by guest_setup
+void wss_setup(struct guest* guest);
+
+// Stops the window timer without touching guest memory, used by guest_clear and guest_deinit
+void wss_cancel(struct guest* guest);
+
+// Records guest RAM the VMM is about to access on the guest's behalf as touched, called by guest_ptr while sampling
+void wss_touch(struct guest* guest, uint64_t gpa, size_t size);
+
+// Zeroes the guest RAM from start up that the stopped guest touched since it booted. Returns false without clearing anything if
+// sampling did not run for the whole boot, the caller then has to clear all of it
+bool wss_clear_touched(struct guest* guest, uint64_t start);
+
+void wss_get_stats(struct guest* guest, struct wss_stats* stats);
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Zero detection
+/*
+    Checks buffers for being all zero bytes, e.g. block write payloads. Uses NEON when built for a target that has it, bails out at the
+    first 256 byte stretch that is not zero.
+*/
+
+bool zero_detect(const void* data, size_t len);
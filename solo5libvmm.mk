@@ -1,4 +1,4 @@
-S5L_OBJS := guest.o elf.o fault.o vcpu.o 
+S5L_OBJS := guest.o guest_pool.o blk_cache.o blk_queue.o console.o boot_cache.o csum.o elf.o lz4.o mmio.o net.o pending.o ratelimit.o sched.o shm.o timer.o poll.o idle.o iopoll.o fault.o vcpu.o vgic.o vswitch.o wss.o zero.o 
 S5L_OBJS_BUILD := $(addprefix solo5libvmm/, $(S5L_OBJS))
 
 $(S5L_OBJS_BUILD): |solo5libvmm
@@ -14,4 +14,20 @@ solo5libvmm/%.o: $(SOLO5LIBVMM)/src/aarch64/%.c
 	$(CC) ${CFLAGS} -c -o $@ $<
 
 solo5libvmm:
-	mkdir -p $@
\ No newline at end of file
+	mkdir -p $@
+
+HOSTCC ?= cc
+
+s5lpack: $(SOLO5LIBVMM)/tools/s5lpack.c
+	$(HOSTCC) -O2 -I$(SOLO5LIBVMM)/include -o $@ $<
+
+io_ring_bench: $(SOLO5LIBVMM)/tools/io_ring_bench.c $(SOLO5LIBVMM)/include/solo5libvmm/io_ring.h
+	$(HOSTCC) -O2 -pthread -I$(SOLO5LIBVMM)/include -o $@ $<
+
+csum_bench: $(SOLO5LIBVMM)/tools/csum_bench.c $(SOLO5LIBVMM)/src/csum.c
+	$(HOSTCC) -O2 -I$(SOLO5LIBVMM)/include -DCSUM_NO_NEON -Dcsum_partial=csum_partial_scalar -c -o $@_scalar.o $(SOLO5LIBVMM)/src/csum.c
+	$(HOSTCC) -O2 -I$(SOLO5LIBVMM)/include -o $@ $^ $@_scalar.o
+	rm -f $@_scalar.o
+
+vswitch_bench: $(SOLO5LIBVMM)/tools/vswitch_bench.c $(SOLO5LIBVMM)/src/vswitch.c
+	$(HOSTCC) -O2 -I$(SOLO5LIBVMM)/include -o $@ $^
\ No newline at end of file
@@ -1,5 +1,19 @@
 #include <microkit.h>
 #include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/aarch64/vgic.h>
+#include <solo5libvmm/blk_cache.h>
+#include <solo5libvmm/blk_queue.h>
+#include <solo5libvmm/console.h>
+#include <solo5libvmm/fault.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/guest_pool.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/mmio.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/ratelimit.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
 #include <solo5libvmm/solo5/hvt_abi.h>
 #include <solo5libvmm/util.h>
 #include <stdatomic.h>
@@ -103,6 +117,13 @@ static seL4_Word id_to_reg_val(seL4_Word reg_id, seL4_UserContext* regs)
     }
 }
 
+static void set_reg_val(seL4_Word reg_id, seL4_UserContext* regs, uint64_t value)
+{
+    // x0-x30 are laid out consecutively in seL4_UserContext, writes to XZR are discarded
+    assert(reg_id <= 31);
+    if (reg_id < 31) (&regs->x0)[reg_id] = value;
+}
+
 static inline void advance_vcpu(size_t vcpu_id, seL4_UserContext* regs)
 {
     regs->pc += 4;
@@ -110,8 +131,64 @@ static inline void advance_vcpu(size_t vcpu_id, seL4_UserContext* regs)
     assert(err == seL4_NoError);
 }
 
-static bool fault_handle_vm_exception(size_t vcpu_id, uint8_t* mem, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault)
+static size_t hypercall_arg_size(enum hvt_hypercall hc)
+{
+    switch (hc)
+    {
+        case HVT_HYPERCALL_WALLTIME:
+            return sizeof(struct hvt_hc_walltime);
+        case HVT_HYPERCALL_PUTS:
+            return sizeof(struct hvt_hc_puts);
+        case HVT_HYPERCALL_POLL:
+            return sizeof(struct hvt_hc_poll);
+        case HVT_HYPERCALL_BLOCK_WRITE:
+            return sizeof(struct hvt_hc_block_write);
+        case HVT_HYPERCALL_BLOCK_READ:
+            return sizeof(struct hvt_hc_block_read);
+        case HVT_HYPERCALL_NET_WRITE:
+            return sizeof(struct hvt_hc_net_write);
+        case HVT_HYPERCALL_NET_READ:
+            return sizeof(struct hvt_hc_net_read);
+        case HVT_HYPERCALL_HALT:
+            return sizeof(struct hvt_hc_halt);
+        default:
+            return 0;
+    }
+}
+
+static size_t ext_hypercall_arg_size(uint64_t hc)
 {
+    switch (hc)
+    {
+        case HVT_EXT_HYPERCALL_NET_READV:
+            return sizeof(struct hvt_hc_net_readv);
+        case HVT_EXT_HYPERCALL_NET_WRITE_LSO:
+            return sizeof(struct hvt_hc_net_write_lso);
+        default:
+            return 0;
+    }
+}
+
+static void ext_hypercall_handle(struct guest* guest, uint64_t hc, void* hc_data)
+{
+    switch (hc)
+    {
+        case HVT_EXT_HYPERCALL_NET_READV:
+            net_readv_handle(guest, hc_data);
+            break;
+        case HVT_EXT_HYPERCALL_NET_WRITE_LSO:
+            net_write_lso_handle(guest, hc_data);
+            break;
+        default:
+            break;
+    }
+}
+
+static bool fault_handle_vm_exception(struct guest* guest, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault)
+{
+    size_t vcpu_id = guest->vcpu_id;
+    uint8_t* mem = guest->mem;
+
     uint64_t addr = (uint64_t)microkit_mr_get(seL4_VMFault_Addr);
     uint64_t fsr = (uint64_t)microkit_mr_get(seL4_VMFault_FSR);
     seL4_Word ip = microkit_mr_get(seL4_VMFault_IP);
@@ -129,27 +206,117 @@ static bool fault_handle_vm_exception(size_t vcpu_id, uint8_t* mem, enum hvt_hyp
     enum hvt_hypercall hc = HVT_HYPERCALL_NR(addr);
 
     // Check if we actually got a hypercall
-    if (isv && il && write && hc >= 1 && hc <= HVT_HYPERCALL_MAX)
+    void* hc_data = NULL;
+    if (isv && il && write && hc >= 1 && hc < HVT_HYPERCALL_MAX) hc_data = guest_ptr(guest, reg_data, hypercall_arg_size(hc));
+
+    if (hc_data)
     {
         // User hypercalls are not expected to be synchronous, for example the hypercall may write to a disk driver and wait for a result and resume through the
         // notified() method
         microkit_vcpu_stop(vcpu_id);
+        guest_account(guest, GUEST_STATE_BLOCKED, hc);
 
         // Since we are not doing a proper vmexit, we don't have the typical memory coherency guarnetees and need a memory barrier
         atomic_thread_fence(memory_order_acquire);
 
+        // Pooled guests warming up are parked on their readiness hypercall without advancing pc, it is issued again once handed out
+        if (guest_pool_hold(guest, hc))
+        {
+            *hypercall_id = HVT_HYPERCALL_NONE;
+            *hypercall_data = NULL;
+            return true;
+        }
+
         *hypercall_id = hc;
-        *hypercall_data = (void*)(mem + reg_data);
+        *hypercall_data = hc_data;
         if (regs_at_fault) *regs_at_fault = regs;
+        guest->stats.hypercalls[hc]++;
 
         advance_vcpu(vcpu_id, &regs);
         // registered_hypercall();
 
+        // Console output is buffered by the library
+        if (hc == HVT_HYPERCALL_PUTS && console_attached(guest))
+        {
+            *hypercall_id = HVT_HYPERCALL_NONE;
+            *hypercall_data = NULL;
+            console_puts(guest, hc_data);
+        }
+
+        // Block cache read hits complete here and resume the guest, they never reach a shared driver and are not rate limited. Writes are
+        // admitted before the cache sees them, ones absorbed in write-back mode still reach the driver when written back. Hypercalls over
+        // their guest's rate limit are held back until the guest retries them, block misses of mapped handles go to the request queue
+        // which resumes the guest later
+        bool cached = hc == HVT_HYPERCALL_BLOCK_READ && blk_cache_read(guest, hc_data);
+        if (cached || !ratelimit_admit(guest, hc, hc_data) || (hc == HVT_HYPERCALL_BLOCK_WRITE && blk_cache_write(guest, hc_data))
+            || blk_queue_submit(guest, hc, hc_data))
+        {
+            *hypercall_id = HVT_HYPERCALL_NONE;
+            *hypercall_data = NULL;
+        }
+
+        if (hc == HVT_HYPERCALL_POLL || hc == HVT_HYPERCALL_HALT) blk_cache_barrier(guest);
+
+        return true;
+    }
+
+    // Extension hypercalls are synchronous, the guest continues straight after
+    void* ext_data = NULL;
+    if (isv && il && write && (uint64_t)hc >= HVT_EXT_HYPERCALL_BASE && (uint64_t)hc < HVT_EXT_HYPERCALL_MAX)
+        ext_data = guest_ptr(guest, reg_data, ext_hypercall_arg_size(hc));
+
+    if (ext_data)
+    {
+        atomic_thread_fence(memory_order_acquire);
+        guest->stats.ext_hypercalls[hc - HVT_EXT_HYPERCALL_BASE]++;
+        advance_vcpu(vcpu_id, &regs);
+
+        *hypercall_id = HVT_HYPERCALL_NONE;
+        *hypercall_data = NULL;
+
+        // Held back like the hypercalls above, stays stopped until the rate limiter winds pc back and resumes it
+        if (!ratelimit_admit(guest, hc, ext_data))
+        {
+            microkit_vcpu_stop(vcpu_id);
+            guest_account(guest, GUEST_STATE_BLOCKED, HVT_HYPERCALL_NONE);
+            return true;
+        }
+
+        ext_hypercall_handle(guest, hc, ext_data);
+        if (guest->acct.state == GUEST_STATE_RUNNING) guest_resume(guest);
         return true;
     }
 
+    // Emulated device access
+    if (isv && !is_prefetch)
+    {
+        size_t size = 1UL << ((fsr >> 22) & 3);
+        uint64_t value = write ? reg_data : 0;
+        if (write && size < 8) value &= (1UL << (size * 8)) - 1;
+
+        if (mmio_access(guest, addr, size, write, &value))
+        {
+            if (!write)
+            {
+                // Sign extend if SSE, then truncate to W register if not SF
+                if (((fsr >> 21) & 1) && size < 8 && (value & (1UL << (size * 8 - 1)))) value |= ~((1UL << (size * 8)) - 1);
+                if (!((fsr >> 15) & 1)) value &= 0xffffffffUL;
+                set_reg_val(src_reg, &regs, value);
+            }
+            regs.pc += 4;
+            err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + vcpu_id, seL4_False, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word), &regs);
+            assert(err == seL4_NoError);
+
+            *hypercall_id = HVT_HYPERCALL_NONE;
+            *hypercall_data = NULL;
+            if (guest->acct.state == GUEST_STATE_RUNNING) guest_resume(guest);
+            return true;
+        }
+    }
+
     LOG_VMM("Unexpected memory fault on address: 0x%lx, FSR: 0x%lx, IP: 0x%lx, is_prefetch: %s\n", addr, fsr, ip, is_prefetch ? "true" : "false");
-    LOG_VMM("instr: 0x%lx 0x%lx 0x%lx 0x%lx\n", *(mem + ip), *(mem + ip + 1), *(mem + ip + 2), *(mem + ip + 3));
+    uint8_t* instr = guest_ptr(guest, ip, 4);
+    if (instr) LOG_VMM("instr: 0x%lx 0x%lx 0x%lx 0x%lx\n", instr[0], instr[1], instr[2], instr[3]);
     LOG_VMM("fsr: %ld\n", fsr);
     LOG_VMM("valid isv: %ld\n", isv);
     LOG_VMM("valid il: %ld\n", il);
@@ -162,8 +329,9 @@ static bool fault_handle_vm_exception(size_t vcpu_id, uint8_t* mem, enum hvt_hyp
     return false;
 }
 
-static bool fault_handle_user_exception(size_t vcpu_id)
+static bool fault_handle_user_exception(struct guest* guest)
 {
+    size_t vcpu_id = guest->vcpu_id;
     seL4_Word fault_ip = microkit_mr_get(seL4_UserException_FaultIP);
     seL4_Word number = microkit_mr_get(seL4_UserException_Number);
     seL4_Word code = microkit_mr_get(seL4_UserException_Code);
@@ -171,28 +339,142 @@ static bool fault_handle_user_exception(size_t vcpu_id)
     LOG_VMM("User exception fault - invalid instruction/result at IP: 0x%lx, number: 0x%lx, code: 0x%lx\n", fault_ip, number, code);
     LOG_VMM("Stopping VCPU (ID 0x%lx)", vcpu_id);
     microkit_vcpu_stop(vcpu_id);
+    guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
     vcpu_print_tcb_regs(vcpu_id);
     vcpu_print_sys_regs(vcpu_id);
 
     return false;
 }
 
-bool fault_handle(
-    size_t vcpu_id, microkit_msginfo msginfo, uint8_t* mem, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault)
+static void ack_vppi(struct guest* guest, uint16_t irq, void* cookie)
 {
-    seL4_Word label = microkit_msginfo_get_label(msginfo);
+    (void)cookie;
+    microkit_vcpu_arm_ack_vppi(guest->vcpu_id, irq);
+}
 
+static bool fault_handle_vppi_event(struct guest* guest, enum hvt_hypercall* hypercall_id, void** hypercall_data)
+{
+    seL4_Word irq = microkit_mr_get(seL4_VPPIEvent_IRQ);
+
+    // Guest armed its own virtual timer, forward it, VPPI stays masked until the guest EOIs it
+    if (irq == AARCH64_VTIMER_IRQ && !timer_vcpu_armed(guest->vcpu_id))
+    {
+        *hypercall_id = HVT_HYPERCALL_NONE;
+        *hypercall_data = NULL;
+
+        uint64_t ctl = microkit_vcpu_arm_read_reg(guest->vcpu_id, seL4_VCPUReg_CNTV_CTL);
+        if ((ctl & CNTV_CTL_ENABLE) && !(ctl & CNTV_CTL_IMASK))
+        {
+            vgic_register_irq(guest, irq, VGIC_DEFAULT_PRIORITY, ack_vppi, NULL);
+            vgic_inject_irq(guest, irq);
+        }
+        else
+            // Stale event from a timer queue deadline that has since moved
+            microkit_vcpu_arm_ack_vppi(guest->vcpu_id, irq);
+
+        if (guest->acct.state == GUEST_STATE_RUNNING) guest_resume(guest);
+        return true;
+    }
+
+    // Virtual timer is owned by the timer queue, solo5 guests do not use it
+    if (irq == AARCH64_VTIMER_IRQ)
+    {
+        vcpu_vtimer_disarm(guest->vcpu_id);
+        microkit_vcpu_arm_ack_vppi(guest->vcpu_id, irq);
+
+        *hypercall_id = HVT_HYPERCALL_NONE;
+        *hypercall_data = NULL;
+        timer_expire();
+
+        // Guest only faulted to deliver the timer, continue it unless an expired event stopped it
+        if (guest->acct.state == GUEST_STATE_RUNNING) guest_resume(guest);
+        return true;
+    }
+
+    LOG_VMM("Unexpected VPPI event at VCPU (ID 0x%lx), irq: %ld\n", guest->vcpu_id, irq);
+    microkit_vcpu_stop(guest->vcpu_id);
+    guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
+    vcpu_print_tcb_regs(guest->vcpu_id);
+    vcpu_print_sys_regs(guest->vcpu_id);
+    return false;
+}
+
+static bool fault_handle_vcpu_fault(struct guest* guest, enum hvt_hypercall* hypercall_id, void** hypercall_data)
+{
+    seL4_Word hsr = microkit_mr_get(seL4_VCPUFault_HSR);
+    seL4_Word ec = (hsr >> HSR_EC_SHIFT) & HSR_EC_MASK;
+
+    if (ec == HSR_EC_WFX)
+    {
+        seL4_UserContext regs;
+        seL4_Error err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + guest->vcpu_id, false, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word), &regs);
+        assert(err == seL4_NoError);
+        advance_vcpu(guest->vcpu_id, &regs);
+
+        *hypercall_id = HVT_HYPERCALL_NONE;
+        *hypercall_data = NULL;
+        idle_handle_wfx(guest, hsr & HSR_WFX_TI_WFE);
+        return true;
+    }
+
+    LOG_VMM("Unexpected VCPU fault at VCPU (ID 0x%lx), HSR: 0x%lx, EC: 0x%lx\n", guest->vcpu_id, hsr, ec);
+    microkit_vcpu_stop(guest->vcpu_id);
+    guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
+    vcpu_print_tcb_regs(guest->vcpu_id);
+    vcpu_print_sys_regs(guest->vcpu_id);
+    return false;
+}
+
+static bool fault_handle_vgic_maintenance(struct guest* guest, enum hvt_hypercall* hypercall_id, void** hypercall_data)
+{
+    vgic_handle_maintenance(guest);
+
+    *hypercall_id = HVT_HYPERCALL_NONE;
+    *hypercall_data = NULL;
+    if (guest->acct.state == GUEST_STATE_RUNNING) guest_resume(guest);
+    return true;
+}
+
+static bool fault_handle_label(
+    struct guest* guest, seL4_Word label, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault)
+{
     switch (label)
     {
         case seL4_Fault_VMFault:
-            return fault_handle_vm_exception(vcpu_id, mem, hypercall_id, hypercall_data, regs_at_fault);
+            return fault_handle_vm_exception(guest, hypercall_id, hypercall_data, regs_at_fault);
         case seL4_Fault_UserException:
-            return fault_handle_user_exception(vcpu_id);
+            return fault_handle_user_exception(guest);
+        case seL4_Fault_VPPIEvent:
+            return fault_handle_vppi_event(guest, hypercall_id, hypercall_data);
+        case seL4_Fault_VCPUFault:
+            return fault_handle_vcpu_fault(guest, hypercall_id, hypercall_data);
+        case seL4_Fault_VGICMaintenance:
+            return fault_handle_vgic_maintenance(guest, hypercall_id, hypercall_data);
         default:
-            LOG_VMM("Unexpected fault at VCPU (ID 0x%lx): %s / 0x%lx\n", vcpu_id, fault_to_string(label), label);
-            microkit_vcpu_stop(vcpu_id);
-            vcpu_print_tcb_regs(vcpu_id);
-            vcpu_print_sys_regs(vcpu_id);
+            LOG_VMM("Unexpected fault at VCPU (ID 0x%lx): %s / 0x%lx\n", guest->vcpu_id, fault_to_string(label), label);
+            microkit_vcpu_stop(guest->vcpu_id);
+            guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
+            vcpu_print_tcb_regs(guest->vcpu_id);
+            vcpu_print_sys_regs(guest->vcpu_id);
             return false;
     }
+}
+
+bool fault_handle(struct guest* guest, microkit_msginfo msginfo, enum hvt_hypercall* hypercall_id, void** hypercall_data, seL4_UserContext* regs_at_fault)
+{
+    seL4_Word label = microkit_msginfo_get_label(msginfo);
+
+    guest->stats.exits++;
+    if (label < GUEST_FAULT_LABELS) guest->stats.exits_by_fault[label]++;
+    // Guest is out anyway, a cheap moment to pick up its console output
+    console_exit(guest);
+    bool handled = fault_handle_label(guest, label, hypercall_id, hypercall_data, regs_at_fault);
+    if (!handled)
+    {
+        guest->stats.unhandled++;
+        // Guest was stopped, let the other guests have the core
+        if (sched_owns(guest)) sched_block(guest);
+    }
+
+    return handled;
 }
\ No newline at end of file
@@ -15,6 +15,38 @@ uint64_t aarch64_get_counter_frequency(void)
     return frq;
 }
 
+uint64_t aarch64_get_counter(void)
+{
+    uint64_t cnt;
+
+    __asm__ __volatile__("isb; mrs %0, cntvct_el0" : "=r" (cnt):: "memory");
+
+    return cnt;
+}
+
+uint64_t aarch64_ns_to_ticks(uint64_t ns)
+{
+    return (uint64_t)(((__uint128_t)ns * aarch64_get_counter_frequency()) / 1000000000ULL);
+}
+
+uint64_t aarch64_ticks_to_ns(uint64_t ticks)
+{
+    return (uint64_t)(((__uint128_t)ticks * 1000000000ULL) / aarch64_get_counter_frequency());
+}
+
+void vcpu_vtimer_arm(size_t vcpu_id, uint64_t ticks)
+{
+    // CNTV_CVAL is compared against the guests virtual count, which is the physical count minus the VCpu's CNTVOFF
+    uint64_t voff = microkit_vcpu_arm_read_reg(vcpu_id, seL4_VCPUReg_CNTVOFF);
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_CNTV_CVAL, aarch64_get_counter() - voff + ticks);
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_CNTV_CTL, CNTV_CTL_ENABLE);
+}
+
+void vcpu_vtimer_disarm(size_t vcpu_id)
+{
+    microkit_vcpu_arm_write_reg(vcpu_id, seL4_VCPUReg_CNTV_CTL, CNTV_CTL_IMASK);
+}
+
 void setup_system_registers(size_t vcpu_id, uint64_t sp)
 {
     // Enable Float and SIMD
@@ -99,6 +131,7 @@ void setup_memory_mapping(uint8_t* mem, uint64_t mem_size)
     memset(pud, 0, AARCH64_PUD_PGT_SIZE);
     memset(pmd, 0, AARCH64_PMD_PGT_SIZE);
     memset(pte, 0, AARCH64_PTE_PGT_SIZE);
+    memset(mem + AARCH64_SHM_PMD_PGT_BASE, 0, AARCH64_SHM_PMD_PGT_SIZE);
 
     /* Map first 2MB block in pte table */
     for (paddr = 0; paddr < AARCH64_GUEST_BLOCK_SIZE;
@@ -113,9 +146,12 @@ void setup_memory_mapping(uint8_t* mem, uint64_t mem_size)
         /*
          * Map the remainder of the pages below AARCH64_GUEST_MIN_BASE
          * as read-only; these are used for input from hvt to the guest
-         * only, with the rest reserved for future use.
+         * only, with the rest reserved for future use. The console ring
+         * is the exception, the guest writes its log output there.
          */
-        if (paddr < AARCH64_GUEST_MIN_BASE)
+        if (paddr >= AARCH64_CONSOLE_RING && paddr < AARCH64_CONSOLE_RING + AARCH64_CONSOLE_RING_SZ)
+            *pte = paddr | PROT_PAGE_NORMAL;
+        else if (paddr < AARCH64_GUEST_MIN_BASE)
             *pte = paddr | PROT_PAGE_NORMAL_RO;
         else
             *pte = paddr | PROT_PAGE_NORMAL_EXEC;
@@ -142,10 +178,28 @@ void setup_memory_mapping(uint8_t* mem, uint64_t mem_size)
     for (paddr = AARCH64_MMIO_BASE; paddr < AARCH64_MMIO_BASE + AARCH64_MMIO_SZ; paddr += PUD_SIZE, pud++)
         *pud = paddr | PROT_SECT_DEVICE_nGnRE;
 
+    /*
+     * Shared memory windows live in the 1GB after MMIO, mapped with 2MB
+     * granularity by setup_shm_mapping, the rest of the window faults.
+     */
+    assert(pud == (uint64_t *)(mem + AARCH64_PUD_PGT_BASE) + (AARCH64_SHM_BASE >> PUD_SHIFT));
+    *pud = AARCH64_SHM_PMD_PGT_BASE | PGT_DESC_TYPE_TABLE;
+
     /* Link pud table to pgd[0] */
     *pgd = AARCH64_PUD_PGT_BASE | PGT_DESC_TYPE_TABLE;
 }
 
+void setup_shm_mapping(uint8_t* mem, uint64_t gpa, uint64_t size)
+{
+    uint64_t *pmd = (uint64_t *)(mem + AARCH64_SHM_PMD_PGT_BASE);
+
+    assert((gpa & (PMD_SIZE - 1)) == 0 && (size & (PMD_SIZE - 1)) == 0);
+    assert(gpa >= AARCH64_SHM_BASE && gpa + size <= AARCH64_SHM_BASE + AARCH64_SHM_SZ);
+
+    for (uint64_t paddr = gpa; paddr < gpa + size; paddr += PMD_SIZE)
+        pmd[(paddr - AARCH64_SHM_BASE) >> PMD_SHIFT] = paddr | PROT_SECT_NORMAL;
+}
+
 void vcpu_print_tcb_regs(size_t vcpu_id) 
 {
     seL4_UserContext regs;
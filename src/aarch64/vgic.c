@@ -0,0 +1,164 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vgic.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LR_FREE 0xffff
+
+_Static_assert(VGIC_NUM_LR <= 8, "List register bits must fit lr_fresh");
+
+static struct vgic_state* state_of(struct guest* guest)
+{
+    return &guest->vgic;
+}
+
+static struct vgic_handler* find_handler(struct vgic_state* state, uint16_t irq)
+{
+    for (size_t i = 0; i < state->num_handlers; i++)
+        if (state->handlers[i].irq == irq) return &state->handlers[i];
+    return NULL;
+}
+
+static void write_lr(struct guest* guest, size_t index, uint16_t irq)
+{
+    struct vgic_state* state = state_of(guest);
+    struct vgic_handler* handler = find_handler(state, irq);
+    uint8_t priority = handler ? handler->priority : VGIC_DEFAULT_PRIORITY;
+
+    state->lr[index] = irq;
+    state->lr_fresh |= 1 << index;
+    state->stats.injected++;
+    microkit_vcpu_arm_inject_irq(guest->vcpu_id, irq, priority, VGIC_GROUP, index);
+}
+
+static bool is_pending(struct vgic_state* state, uint16_t irq)
+{
+    for (size_t i = 0; i < VGIC_NUM_LR; i++)
+        if (state->lr[i] == irq) return true;
+    for (size_t i = 0; i < state->pending_count; i++)
+        if (state->pending[(state->pending_head + i) % VGIC_PENDING_MAX] == irq) return true;
+    return false;
+}
+
+bool vgic_register_irq(struct guest* guest, uint16_t irq, uint8_t priority, vgic_ack_fn ack, void* cookie)
+{
+    struct vgic_state* state = state_of(guest);
+    struct vgic_handler* handler = find_handler(state, irq);
+
+    if (!handler)
+    {
+        if (state->num_handlers == VGIC_MAX_HANDLERS)
+        {
+            LOG_VMM("Too many virtual IRQs registered (max=%ld)\n", VGIC_MAX_HANDLERS);
+            return false;
+        }
+        handler = &state->handlers[state->num_handlers++];
+    }
+
+    handler->irq = irq;
+    handler->priority = priority;
+    handler->ack = ack;
+    handler->cookie = cookie;
+    return true;
+}
+
+bool vgic_inject_irq(struct guest* guest, uint16_t irq)
+{
+    struct vgic_state* state = state_of(guest);
+
+    // Raising an IRQ the guest has not taken yet is a no-op, it is delivered once
+    if (is_pending(state, irq))
+    {
+        state->stats.coalesced++;
+        return true;
+    }
+
+    for (size_t i = 0; i < VGIC_NUM_LR; i++)
+    {
+        if (state->lr[i] == LR_FREE)
+        {
+            write_lr(guest, i, irq);
+            idle_wake(guest);
+            return true;
+        }
+    }
+
+    if (state->pending_count == VGIC_PENDING_MAX)
+    {
+        state->stats.dropped++;
+        LOG_VMM("VGIC pending queue full, dropping IRQ %d for VCPU (ID 0x%lx)\n", irq, guest->vcpu_id);
+        return false;
+    }
+
+    state->pending[(state->pending_head + state->pending_count) % VGIC_PENDING_MAX] = irq;
+    state->pending_count++;
+    state->stats.queued++;
+    idle_wake(guest);
+    return true;
+}
+
+bool vgic_irq_pending(struct guest* guest)
+{
+    struct vgic_state* state = state_of(guest);
+
+    return state->pending_count || state->lr_fresh;
+}
+
+void vgic_resume(struct guest* guest)
+{
+    state_of(guest)->lr_fresh = 0;
+}
+
+void vgic_handle_maintenance(struct guest* guest)
+{
+    struct vgic_state* state = state_of(guest);
+    seL4_Word index = microkit_mr_get(seL4_VGICMaintenance_IDX);
+
+    state->stats.maintenance++;
+
+    // seL4 reports -1 if the maintenance interrupt was not for a specific list register
+    if (index >= VGIC_NUM_LR) return;
+
+    uint16_t irq = state->lr[index];
+    state->lr[index] = LR_FREE;
+    state->lr_fresh &= ~(1 << index);
+
+    if (irq != LR_FREE)
+    {
+        struct vgic_handler* handler = find_handler(state, irq);
+        if (handler && handler->ack) handler->ack(guest, irq, handler->cookie);
+    }
+
+    // Ack callback may have re-injected into the freed register
+    if (state->pending_count && state->lr[index] == LR_FREE)
+    {
+        uint16_t next = state->pending[state->pending_head];
+        state->pending_head = (state->pending_head + 1) % VGIC_PENDING_MAX;
+        state->pending_count--;
+        write_lr(guest, index, next);
+    }
+}
+
+void vgic_reset(struct guest* guest)
+{
+    struct vgic_state* state = state_of(guest);
+
+    for (size_t i = 0; i < VGIC_NUM_LR; i++) state->lr[i] = LR_FREE;
+    state->lr_fresh = 0;
+    state->pending_head = 0;
+    state->pending_count = 0;
+
+    // Handlers belong to the image that registered them, e.g. the ack of its virtual timer
+    state->num_handlers = 0;
+    memset(state->handlers, 0, sizeof(state->handlers));
+}
+
+void vgic_get_stats(struct guest* guest, struct vgic_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
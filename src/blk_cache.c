@@ -0,0 +1,424 @@
+#include <microkit.h>
+#include <solo5libvmm/blk_cache.h>
+#include <solo5libvmm/blk_queue.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+_Static_assert((BLK_CACHE_SETS & (BLK_CACHE_SETS - 1)) == 0, "Block cache set count must be a power of 2");
+_Static_assert(BLK_CACHE_MAX_DEVICES <= 256, "Block cache device index must fit a line tag");
+
+struct blk_cache_device
+{
+    bool used;
+    struct guest* guest;
+    uint64_t handle;
+    uint64_t blocks;                    // Device capacity in blocks
+    size_t block_size;
+    unsigned shift;                     // log2 of block_size
+    struct blk_cache_config config;
+    blk_cache_write_fn write;
+    void* cookie;
+    uint64_t next_block;                // Block following the last read, for sequential stream detection
+    size_t run;                         // Consecutive sequential reads
+    size_t dirty;                       // Dirty lines, lets flushes of clean devices return straight away
+    struct blk_cache_stats stats;
+};
+
+struct blk_cache_line
+{
+    bool valid;
+    bool dirty;
+    uint8_t device;
+    uint64_t block;
+    uint64_t last_used;
+};
+
+static struct blk_cache_device devices[BLK_CACHE_MAX_DEVICES];
+static uint64_t use_clock;
+
+// Caller storage from blk_cache_init: block data of every line, then the line headers. Set n is lines[n * BLK_CACHE_WAYS] onwards
+static uint8_t* line_data;
+static struct blk_cache_line* lines;
+static size_t num_sets;
+
+static struct blk_cache_device* device_of(struct guest* guest, uint64_t handle)
+{
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+        if (devices[i].used && devices[i].guest == guest && devices[i].handle == handle) return &devices[i];
+    return NULL;
+}
+
+static uint8_t index_of(struct blk_cache_device* dev)
+{
+    return (uint8_t)(dev - devices);
+}
+
+// Consecutive blocks of a device land in consecutive sets, devices start at different sets
+static size_t set_of(struct blk_cache_device* dev, uint64_t block)
+{
+    return (size_t)((block + index_of(dev) * 0x9e3779b9ULL) & (num_sets - 1));
+}
+
+static inline struct blk_cache_line* set_lines(size_t set)
+{
+    return &lines[set * BLK_CACHE_WAYS];
+}
+
+static uint8_t* data_of(struct blk_cache_line* line)
+{
+    return line_data + (size_t)(line - lines) * BLK_CACHE_BLOCK_SIZE;
+}
+
+static struct blk_cache_line* find(struct blk_cache_device* dev, uint64_t block)
+{
+    struct blk_cache_line* set = set_lines(set_of(dev, block));
+
+    for (size_t way = 0; way < BLK_CACHE_WAYS; way++)
+        if (set[way].valid && set[way].block == block && set[way].device == index_of(dev)) return &set[way];
+    return NULL;
+}
+
+static void touch(struct blk_cache_line* line)
+{
+    line->last_used = ++use_clock;
+}
+
+static bool write_back(struct blk_cache_line* line)
+{
+    struct blk_cache_device* dev = &devices[line->device];
+
+    if (!dev->write(dev->guest, dev->handle, line->block << dev->shift, data_of(line), dev->block_size, dev->cookie))
+    {
+        dev->stats.errors++;
+        return false;
+    }
+    line->dirty = false;
+    dev->dirty--;
+    dev->stats.writebacks++;
+    return true;
+}
+
+static void invalidate(struct blk_cache_line* line)
+{
+    if (line->dirty) devices[line->device].dirty--;
+    line->valid = false;
+    line->dirty = false;
+}
+
+// Frees a line in the set of block, preferring empty lines, then the least recently used clean line, then the least recently used
+// dirty line once it is written back. Returns NULL if no line could be freed
+static struct blk_cache_line* allocate(struct blk_cache_device* dev, uint64_t block)
+{
+    struct blk_cache_line* set = set_lines(set_of(dev, block));
+    struct blk_cache_line* clean = NULL;
+    struct blk_cache_line* dirty = NULL;
+
+    for (size_t way = 0; way < BLK_CACHE_WAYS; way++)
+    {
+        struct blk_cache_line* line = &set[way];
+        if (!line->valid) return line;
+
+        struct blk_cache_line** lru = line->dirty ? &dirty : &clean;
+        if (!*lru || line->last_used < (*lru)->last_used) *lru = line;
+    }
+
+    struct blk_cache_line* victim = clean ? clean : dirty;
+    if (victim->dirty && !write_back(victim)) return NULL;
+
+    devices[victim->device].stats.evictions++;
+    victim->valid = false;
+    return victim;
+}
+
+static void insert(struct blk_cache_device* dev, struct blk_cache_line* line, uint64_t block, const uint8_t* data, bool dirty)
+{
+    // Rewriting a dirty block keeps it dirty
+    bool was_dirty = line->valid && line->dirty;
+
+    memcpy(data_of(line), data, dev->block_size);
+    if (dirty && !was_dirty) dev->dirty++;
+    line->valid = true;
+    line->dirty = dirty || was_dirty;
+    line->device = index_of(dev);
+    line->block = block;
+    touch(line);
+}
+
+// Requests must cover whole blocks inside the device, anything else goes to the driver which reports the error
+static bool valid_range(struct blk_cache_device* dev, uint64_t offset, size_t len)
+{
+    uint64_t mask = dev->block_size - 1;
+    return len > 0 && !(offset & mask) && !(len & mask) && (offset >> dev->shift) < dev->blocks
+        && (len >> dev->shift) <= dev->blocks - (offset >> dev->shift);
+}
+
+bool blk_cache_init(void* storage, size_t size)
+{
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+    {
+        if (devices[i].used)
+        {
+            LOG_VMM("Block cache storage cannot change while devices are attached\n");
+            return false;
+        }
+    }
+
+    const size_t set_size = BLK_CACHE_WAYS * (BLK_CACHE_BLOCK_SIZE + sizeof(struct blk_cache_line));
+    size_t sets = BLK_CACHE_SETS;
+    while (sets > 0 && sets * set_size > size)
+        sets /= 2;
+    if (!storage || sets == 0)
+    {
+        LOG_VMM("Block cache storage too small for one set (size=%ld required=%ld)\n", size, set_size);
+        return false;
+    }
+
+    line_data = storage;
+    lines = (struct blk_cache_line*)(line_data + sets * BLK_CACHE_WAYS * BLK_CACHE_BLOCK_SIZE);
+    num_sets = sets;
+    memset(lines, 0, sets * BLK_CACHE_WAYS * sizeof(struct blk_cache_line));
+    return true;
+}
+
+bool blk_cache_attach(struct guest* guest, uint64_t handle, const struct mft_block_basic* geometry, const struct blk_cache_config* config,
+    blk_cache_write_fn write, void* cookie)
+{
+    size_t block_size = geometry->block_size;
+
+    if (num_sets == 0)
+    {
+        LOG_VMM("Block cache has no storage, see blk_cache_init\n");
+        return false;
+    }
+    if (handle >= MFT_MAX_ENTRIES || device_of(guest, handle))
+    {
+        LOG_VMM("Invalid or duplicate block handle (handle=%ld)\n", handle);
+        return false;
+    }
+    if (block_size == 0 || (block_size & (block_size - 1)) || block_size > BLK_CACHE_BLOCK_SIZE || geometry->capacity < block_size)
+    {
+        LOG_VMM("Block device not cacheable (block_size=%ld capacity=%ld max_block_size=%ld)\n", block_size, geometry->capacity,
+            BLK_CACHE_BLOCK_SIZE);
+        return false;
+    }
+    if (config->write_back && !write)
+    {
+        LOG_VMM("Write-back block cache needs a write callback\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+    {
+        struct blk_cache_device* dev = &devices[i];
+        if (dev->used) continue;
+
+        memset(dev, 0, sizeof(struct blk_cache_device));
+        dev->used = true;
+        dev->guest = guest;
+        dev->handle = handle;
+        dev->block_size = block_size;
+        dev->shift = (unsigned)__builtin_ctzl(block_size);
+        dev->blocks = geometry->capacity >> dev->shift;
+        dev->config = *config;
+        dev->write = write;
+        dev->cookie = cookie;
+        return true;
+    }
+
+    LOG_VMM("Too many cached block devices (max=%ld)\n", BLK_CACHE_MAX_DEVICES);
+    return false;
+}
+
+void blk_cache_detach(struct guest* guest, uint64_t handle)
+{
+    struct blk_cache_device* dev = device_of(guest, handle);
+    if (!dev) return;
+
+    if (!blk_cache_flush(guest, handle)) LOG_VMM("Dropping %ld dirty blocks of detached block device (handle=%ld)\n", dev->dirty, handle);
+
+    for (size_t i = 0; i < num_sets * BLK_CACHE_WAYS; i++)
+        if (lines[i].valid && lines[i].device == index_of(dev)) invalidate(&lines[i]);
+    dev->used = false;
+}
+
+bool blk_cache_read(struct guest* guest, struct hvt_hc_block_read* hc)
+{
+    struct blk_cache_device* dev = device_of(guest, hc->handle);
+    if (!dev || !valid_range(dev, hc->offset, hc->len)) return false;
+
+    uint8_t* dst = guest_ptr(guest, hc->data, hc->len);
+    if (!dst) return false;
+
+    uint64_t first = hc->offset >> dev->shift;
+    uint64_t count = hc->len >> dev->shift;
+    dev->run = first == dev->next_block ? dev->run + 1 : 1;
+    dev->next_block = first + count;
+
+    // Blocks copied before a miss are overwritten when the VMM completes the read
+    for (uint64_t i = 0; i < count; i++)
+    {
+        struct blk_cache_line* line = find(dev, first + i);
+        if (!line)
+        {
+            dev->stats.read_misses++;
+            return false;
+        }
+        memcpy(dst + (i << dev->shift), data_of(line), dev->block_size);
+        touch(line);
+    }
+
+    dev->stats.read_hits++;
+    hc->ret = HVT_RESULT_OK;
+    sched_resume(guest, false);
+    return true;
+}
+
+bool blk_cache_write(struct guest* guest, struct hvt_hc_block_write* hc)
+{
+    struct blk_cache_device* dev = device_of(guest, hc->handle);
+    if (!dev || !valid_range(dev, hc->offset, hc->len)) return false;
+
+    const uint8_t* src = guest_ptr(guest, hc->data, hc->len);
+    if (!src) return false;
+
+    uint64_t first = hc->offset >> dev->shift;
+    uint64_t count = hc->len >> dev->shift;
+    uint64_t i = 0;
+
+    if (dev->config.write_back)
+    {
+        for (; i < count; i++)
+        {
+            struct blk_cache_line* line = find(dev, first + i);
+            if (!line) line = allocate(dev, first + i);
+            if (!line) break;
+            insert(dev, line, first + i, src + (i << dev->shift), true);
+        }
+
+        if (i == count)
+        {
+            // Never reaches blk_queue_submit, its zero map must still learn the range holds data
+            blk_queue_absorbed(guest, hc->handle, hc->offset, hc->len);
+            dev->stats.write_hits++;
+            hc->ret = HVT_RESULT_OK;
+            sched_resume(guest, false);
+            return true;
+        }
+    }
+
+    // Write goes to the driver, blocks it covers that were not updated above would turn stale
+    for (; i < count; i++)
+    {
+        struct blk_cache_line* line = find(dev, first + i);
+        if (line) invalidate(line);
+    }
+    dev->stats.write_misses++;
+    return false;
+}
+
+size_t blk_cache_fetch_len(struct guest* guest, const struct hvt_hc_block_read* hc)
+{
+    struct blk_cache_device* dev = device_of(guest, hc->handle);
+    if (!dev || dev->config.readahead == 0 || dev->run < BLK_CACHE_SEQ_THRESHOLD || !valid_range(dev, hc->offset, hc->len)) return hc->len;
+
+    uint64_t end = (hc->offset + hc->len) >> dev->shift;
+    uint64_t extra = 0;
+
+    // Stop at the device end or the first block that is already cached
+    while (extra < dev->config.readahead && end + extra < dev->blocks && !find(dev, end + extra))
+        extra++;
+
+    dev->stats.readahead += extra;
+    return hc->len + (extra << dev->shift);
+}
+
+void blk_cache_fill(struct guest* guest, uint64_t handle, uint64_t offset, const void* data, size_t len)
+{
+    struct blk_cache_device* dev = device_of(guest, handle);
+    if (!dev || !valid_range(dev, offset, len)) return;
+
+    uint64_t first = offset >> dev->shift;
+    uint64_t count = len >> dev->shift;
+
+    for (uint64_t i = 0; i < count; i++)
+    {
+        if (find(dev, first + i)) continue;
+
+        struct blk_cache_line* line = allocate(dev, first + i);
+        if (!line) continue;
+        insert(dev, line, first + i, (const uint8_t*)data + (i << dev->shift), false);
+        dev->stats.filled++;
+    }
+}
+
+bool blk_cache_flush(struct guest* guest, uint64_t handle)
+{
+    struct blk_cache_device* dev = device_of(guest, handle);
+    if (!dev || dev->dirty == 0) return true;
+
+    bool ok = true;
+    for (size_t i = 0; i < num_sets * BLK_CACHE_WAYS && dev->dirty > 0; i++)
+    {
+        struct blk_cache_line* line = &lines[i];
+        if (line->valid && line->dirty && line->device == index_of(dev)) ok &= write_back(line);
+    }
+    return ok;
+}
+
+void blk_cache_barrier(struct guest* guest)
+{
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+    {
+        struct blk_cache_device* dev = &devices[i];
+        if (dev->used && dev->guest == guest && dev->config.flush_on_barrier) blk_cache_flush(guest, dev->handle);
+    }
+}
+
+void blk_cache_flush_all(struct guest* guest)
+{
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+    {
+        struct blk_cache_device* dev = &devices[i];
+        if (dev->used && dev->guest == guest && !blk_cache_flush(guest, dev->handle))
+            LOG_VMM("Failed to write back dirty blocks (handle=%ld dirty=%ld)\n", dev->handle, dev->dirty);
+    }
+}
+
+void blk_cache_release(struct guest* guest)
+{
+    for (size_t i = 0; i < BLK_CACHE_MAX_DEVICES; i++)
+        if (devices[i].used && devices[i].guest == guest) blk_cache_detach(guest, devices[i].handle);
+}
+
+void blk_cache_setup(struct guest* guest)
+{
+    struct mft* mft = guest_mft(guest);
+    if (!mft) return;
+
+    for (uint32_t i = 0; i < mft->entries; i++)
+    {
+        struct mft_entry* e = &mft->e[i];
+        struct blk_cache_device* dev = device_of(guest, i);
+        if (e->type != MFT_DEV_BLOCK_BASIC || !dev) continue;
+
+        e->u.block_basic.capacity = dev->blocks << dev->shift;
+        e->u.block_basic.block_size = (uint16_t)dev->block_size;
+    }
+}
+
+void blk_cache_get_stats(struct guest* guest, uint64_t handle, struct blk_cache_stats* stats)
+{
+    struct blk_cache_device* dev = device_of(guest, handle);
+    if (dev)
+        *stats = dev->stats;
+    else
+        memset(stats, 0, sizeof(struct blk_cache_stats));
+}
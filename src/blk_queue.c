@@ -0,0 +1,528 @@
+#include <microkit.h>
+#include <solo5libvmm/blk_cache.h>
+#include <solo5libvmm/blk_queue.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/iopoll.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/util.h>
+#include <solo5libvmm/zero.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct blk_queue_mapping
+{
+    bool used;
+    struct guest* guest;
+    uint64_t handle;
+    uint64_t device;
+};
+
+// Hypercall whose range is one segment of a request
+struct blk_queue_member
+{
+    struct guest* guest;
+    uint64_t handle;
+    void* hc;                           // struct hvt_hc_block_read or struct hvt_hc_block_write
+    bool cancelled;
+};
+
+// Bit per granule that is known to read as zeros
+struct blk_zero_map
+{
+    bool used;
+    uint64_t device;
+    uint64_t capacity;
+    unsigned shift;                     // log2 of the granule size
+    bool write_zeroes;
+    uint64_t* bits;                     // Caller memory from blk_queue_zero_init
+};
+
+enum blk_slot_state
+{
+    BLK_SLOT_FREE,
+    BLK_SLOT_WAITING,
+    BLK_SLOT_ISSUED
+};
+
+struct blk_queue_slot
+{
+    enum blk_slot_state state;
+    uint64_t seq;                       // Submission order, waiting requests are issued oldest first
+    struct blk_request req;
+    struct blk_queue_member members[BLK_QUEUE_MAX_SEGMENTS];
+};
+
+struct blk_queue_state
+{
+    blk_queue_issue_fn issue;
+    void* cookie;
+    size_t depth;
+    size_t inflight;
+    size_t waiting;
+    uint64_t seq;
+    struct blk_queue_mapping mappings[BLK_QUEUE_MAX_MAPPINGS];
+    struct blk_queue_slot slots[BLK_QUEUE_MAX_REQUESTS];
+    struct blk_zero_map zero_maps[BLK_ZERO_MAX_DEVICES];
+    struct blk_queue_stats stats;
+};
+
+static struct blk_queue_state queue;
+
+static struct blk_queue_mapping* mapping_of(struct guest* guest, uint64_t handle)
+{
+    for (size_t i = 0; i < BLK_QUEUE_MAX_MAPPINGS; i++)
+        if (queue.mappings[i].used && queue.mappings[i].guest == guest && queue.mappings[i].handle == handle) return &queue.mappings[i];
+    return NULL;
+}
+
+// Both hypercall structs share the layout of handle, offset, data, len and ret
+static void set_ret(struct blk_queue_member* m, enum blk_op op, int ret)
+{
+    if (op == BLK_OP_READ)
+        ((struct hvt_hc_block_read*)m->hc)->ret = ret;
+    else
+        ((struct hvt_hc_block_write*)m->hc)->ret = ret;
+}
+
+static struct blk_zero_map* zero_map_of(uint64_t device)
+{
+    for (size_t i = 0; i < BLK_ZERO_MAX_DEVICES; i++)
+        if (queue.zero_maps[i].used && queue.zero_maps[i].device == device) return &queue.zero_maps[i];
+    return NULL;
+}
+
+static bool granule_zero(struct blk_zero_map* map, uint64_t granule)
+{
+    return (map->bits[granule / 64] >> (granule % 64)) & 1;
+}
+
+static void set_granule(struct blk_zero_map* map, uint64_t granule, bool zero)
+{
+    if (zero)
+        map->bits[granule / 64] |= 1UL << (granule % 64);
+    else
+        map->bits[granule / 64] &= ~(1UL << (granule % 64));
+}
+
+static bool in_device(struct blk_zero_map* map, uint64_t offset, uint64_t len)
+{
+    return len > 0 && offset < map->capacity && len <= map->capacity - offset;
+}
+
+static bool known_zero(struct blk_zero_map* map, uint64_t offset, uint64_t len)
+{
+    if (!in_device(map, offset, len)) return false;
+
+    for (uint64_t g = offset >> map->shift; g <= (offset + len - 1) >> map->shift; g++)
+        if (!granule_zero(map, g)) return false;
+    return true;
+}
+
+// Zeros only mark granules they cover completely, data unmarks every granule it touches
+static void update_zero(struct blk_zero_map* map, uint64_t offset, uint64_t len, bool zero)
+{
+    if (!in_device(map, offset, len)) return;
+
+    uint64_t granule = 1UL << map->shift;
+    uint64_t first = zero ? (offset + granule - 1) >> map->shift : offset >> map->shift;
+    uint64_t end = zero ? (offset + len) >> map->shift : ((offset + len - 1) >> map->shift) + 1;
+
+    for (uint64_t g = first; g < end; g++)
+        set_granule(map, g, zero);
+}
+
+// Completes a hypercall without involving the driver
+static void complete_now(struct guest* guest, enum blk_op op, void* hc_data)
+{
+    struct blk_queue_member member = { .guest = guest, .hc = hc_data };
+    set_ret(&member, op, HVT_RESULT_OK);
+    sched_resume(guest, true);
+}
+
+// Appends or prepends a hypercall to a waiting request of the same device and direction that it is contiguous with
+static bool merge(uint64_t device, enum blk_op op, uint64_t offset, uint8_t* data, size_t len, struct blk_queue_member* member)
+{
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+    {
+        struct blk_queue_slot* slot = &queue.slots[i];
+        struct blk_request* req = &slot->req;
+
+        if (slot->state != BLK_SLOT_WAITING || req->device != device || req->op != op) continue;
+        if (req->num_segments == BLK_QUEUE_MAX_SEGMENTS || req->len + len > BLK_QUEUE_MAX_BYTES) continue;
+
+        size_t at;
+        if (req->offset + req->len == offset)
+            at = req->num_segments;
+        else if (offset + len == req->offset)
+        {
+            at = 0;
+            req->offset = offset;
+        }
+        else
+            continue;
+
+        memmove(&req->segments[at + 1], &req->segments[at], (req->num_segments - at) * sizeof(struct blk_segment));
+        memmove(&slot->members[at + 1], &slot->members[at], (req->num_segments - at) * sizeof(struct blk_queue_member));
+        req->segments[at] = (struct blk_segment){ .data = data, .len = len };
+        slot->members[at] = *member;
+        req->num_segments++;
+        req->len += len;
+        return true;
+    }
+    return false;
+}
+
+static struct blk_queue_slot* free_slot(void)
+{
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+        if (queue.slots[i].state == BLK_SLOT_FREE) return &queue.slots[i];
+    return NULL;
+}
+
+// Drops cancelled segments from both ends of a waiting request, frees it once none are left
+static void trim(struct blk_queue_slot* slot)
+{
+    struct blk_request* req = &slot->req;
+
+    while (req->num_segments > 0 && slot->members[req->num_segments - 1].cancelled)
+        req->len -= req->segments[--req->num_segments].len;
+    while (req->num_segments > 0 && slot->members[0].cancelled)
+    {
+        req->offset += req->segments[0].len;
+        req->len -= req->segments[0].len;
+        req->num_segments--;
+        memmove(&req->segments[0], &req->segments[1], req->num_segments * sizeof(struct blk_segment));
+        memmove(&slot->members[0], &slot->members[1], req->num_segments * sizeof(struct blk_queue_member));
+    }
+    if (req->num_segments == 0)
+    {
+        slot->state = BLK_SLOT_FREE;
+        queue.waiting--;
+    }
+}
+
+// Cuts a trimmed waiting request at its first cancelled segment, the segments after it move to a free slot which keeps the submission
+// order. Returns that slot, or NULL if nothing was cut off. Without a free slot they fail instead
+static struct blk_queue_slot* split(struct blk_queue_slot* slot)
+{
+    struct blk_request* req = &slot->req;
+    size_t cut = 0;
+    size_t len = 0;
+    while (cut < req->num_segments && !slot->members[cut].cancelled)
+        len += req->segments[cut++].len;
+    if (cut == req->num_segments) return NULL;
+
+    size_t rest = cut + 1;
+    struct blk_queue_slot* next = free_slot();
+    if (next)
+    {
+        size_t n = req->num_segments - rest;
+        next->state = BLK_SLOT_WAITING;
+        next->seq = slot->seq;
+        next->req = (struct blk_request){ .tag = (uint32_t)(next - queue.slots), .op = req->op, .device = req->device,
+            .offset = req->offset + len + req->segments[cut].len, .len = req->len - len - req->segments[cut].len, .num_segments = n };
+        memcpy(&next->req.segments[0], &req->segments[rest], n * sizeof(struct blk_segment));
+        memcpy(&next->members[0], &slot->members[rest], n * sizeof(struct blk_queue_member));
+        queue.waiting++;
+    }
+    else
+    {
+        for (size_t s = rest; s < req->num_segments; s++)
+        {
+            struct blk_queue_member* m = &slot->members[s];
+            if (m->cancelled) continue;
+
+            set_ret(m, req->op, HVT_RESULT_EUNSPEC);
+            iopoll_complete(m->guest);
+            sched_resume(m->guest, true);
+        }
+    }
+
+    req->num_segments = cut;
+    req->len = len;
+    return next;
+}
+
+static struct blk_queue_slot* oldest_waiting(void)
+{
+    struct blk_queue_slot* oldest = NULL;
+
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+        if (queue.slots[i].state == BLK_SLOT_WAITING && (!oldest || queue.slots[i].seq < oldest->seq)) oldest = &queue.slots[i];
+    return oldest;
+}
+
+static void dispatch(void)
+{
+    while (queue.waiting > 0 && queue.inflight < queue.depth)
+    {
+        struct blk_queue_slot* slot = oldest_waiting();
+        if (!queue.issue(&slot->req, queue.cookie)) return;
+
+        slot->state = BLK_SLOT_ISSUED;
+        queue.waiting--;
+        queue.inflight++;
+        queue.stats.issued++;
+        if (queue.inflight > queue.stats.max_inflight) queue.stats.max_inflight = queue.inflight;
+    }
+}
+
+bool blk_queue_init(size_t depth, blk_queue_issue_fn issue, void* cookie)
+{
+    if (depth == 0 || depth > BLK_QUEUE_MAX_REQUESTS || !issue)
+    {
+        LOG_VMM("Block queue depth must be 1-%ld (depth=%ld)\n", BLK_QUEUE_MAX_REQUESTS, depth);
+        return false;
+    }
+
+    memset(&queue, 0, sizeof(struct blk_queue_state));
+    queue.depth = depth;
+    queue.issue = issue;
+    queue.cookie = cookie;
+    return true;
+}
+
+bool blk_queue_map(struct guest* guest, uint64_t handle, uint64_t device)
+{
+    if (mapping_of(guest, handle))
+    {
+        LOG_VMM("Block handle already mapped (handle=%ld)\n", handle);
+        return false;
+    }
+
+    for (size_t i = 0; i < BLK_QUEUE_MAX_MAPPINGS; i++)
+    {
+        struct blk_queue_mapping* m = &queue.mappings[i];
+        if (m->used) continue;
+
+        *m = (struct blk_queue_mapping){ .used = true, .guest = guest, .handle = handle, .device = device };
+        return true;
+    }
+
+    LOG_VMM("Too many block queue mappings (max=%ld)\n", BLK_QUEUE_MAX_MAPPINGS);
+    return false;
+}
+
+void blk_queue_unmap(struct guest* guest, uint64_t handle)
+{
+    struct blk_queue_mapping* m = mapping_of(guest, handle);
+    if (m) m->used = false;
+}
+
+bool blk_queue_submit(struct guest* guest, enum hvt_hypercall hc, void* hc_data)
+{
+    if (hc != HVT_HYPERCALL_BLOCK_READ && hc != HVT_HYPERCALL_BLOCK_WRITE) return false;
+
+    // Both hypercalls share the layout up to ret
+    struct hvt_hc_block_read* args = hc_data;
+    struct blk_queue_mapping* mapping = mapping_of(guest, args->handle);
+    if (!queue.issue || !mapping) return false;
+
+    enum blk_op op = hc == HVT_HYPERCALL_BLOCK_READ ? BLK_OP_READ : BLK_OP_WRITE;
+    uint8_t* data = guest_ptr(guest, args->data, args->len);
+    if (!data || args->len == 0 || args->len > BLK_QUEUE_MAX_BYTES) return false;
+
+    struct blk_zero_map* zero_map = zero_map_of(mapping->device);
+    if (zero_map && op == BLK_OP_READ && known_zero(zero_map, args->offset, args->len))
+    {
+        memset(data, 0, args->len);
+        queue.stats.zero_reads++;
+        queue.stats.zero_bytes_saved += args->len;
+        complete_now(guest, op, hc_data);
+        return true;
+    }
+    if (zero_map && op == BLK_OP_WRITE)
+    {
+        bool zero = zero_detect(data, args->len);
+        if (zero)
+        {
+            queue.stats.zero_writes++;
+            // Nothing to write on a sparse backing that already reads as zeros
+            if (known_zero(zero_map, args->offset, args->len))
+            {
+                queue.stats.zero_bytes_saved += args->len;
+                complete_now(guest, op, hc_data);
+                return true;
+            }
+            if (zero_map->write_zeroes)
+            {
+                op = BLK_OP_WRITE_ZEROES;
+                queue.stats.zero_bytes_saved += args->len;
+            }
+        }
+        update_zero(zero_map, args->offset, args->len, zero);
+    }
+
+    struct blk_queue_member member = { .guest = guest, .handle = args->handle, .hc = hc_data };
+    if (merge(mapping->device, op, args->offset, data, args->len, &member))
+    {
+        queue.stats.submitted++;
+        queue.stats.merged++;
+        return true;
+    }
+
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+    {
+        struct blk_queue_slot* slot = &queue.slots[i];
+        if (slot->state != BLK_SLOT_FREE) continue;
+
+        slot->state = BLK_SLOT_WAITING;
+        slot->seq = queue.seq++;
+        slot->req = (struct blk_request){ .tag = (uint32_t)i, .op = op, .device = mapping->device, .offset = args->offset, .len = args->len,
+            .num_segments = 1 };
+        slot->req.segments[0] = (struct blk_segment){ .data = data, .len = args->len };
+        slot->members[0] = member;
+        queue.waiting++;
+        queue.stats.submitted++;
+        dispatch();
+        return true;
+    }
+    return false;
+}
+
+void blk_queue_kick(void)
+{
+    if (queue.issue) dispatch();
+}
+
+void blk_queue_complete(uint32_t tag, bool ok)
+{
+    struct blk_queue_slot* slot = tag < BLK_QUEUE_MAX_REQUESTS ? &queue.slots[tag] : NULL;
+    if (!slot || slot->state != BLK_SLOT_ISSUED)
+    {
+        LOG_VMM("Completion for unknown block request (tag=%d)\n", tag);
+        return;
+    }
+
+    // Work on a copy so the slot can be reused by whatever resuming the guests leads to
+    struct blk_queue_slot done = *slot;
+    struct blk_request* req = &done.req;
+    uint64_t offset = req->offset;
+
+    slot->state = BLK_SLOT_FREE;
+    queue.inflight--;
+    queue.stats.completed++;
+    if (!ok) queue.stats.errors++;
+
+    for (size_t i = 0; i < req->num_segments; i++)
+    {
+        struct blk_queue_member* m = &done.members[i];
+        struct blk_segment* seg = &req->segments[i];
+
+        if (!m->cancelled)
+        {
+            if (ok && req->op == BLK_OP_READ) blk_cache_fill(m->guest, m->handle, offset, seg->data, seg->len);
+            set_ret(m, req->op, ok ? HVT_RESULT_OK : HVT_RESULT_EUNSPEC);
+            iopoll_complete(m->guest);
+            sched_resume(m->guest, true);
+        }
+        offset += seg->len;
+    }
+
+    dispatch();
+}
+
+void blk_queue_cancel(struct guest* guest)
+{
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+    {
+        struct blk_queue_slot* slot = &queue.slots[i];
+        struct blk_request* req = &slot->req;
+        if (slot->state == BLK_SLOT_FREE) continue;
+
+        for (size_t s = 0; s < req->num_segments; s++)
+        {
+            if (slot->members[s].guest != guest || slot->members[s].cancelled) continue;
+            slot->members[s].cancelled = true;
+            queue.stats.cancelled++;
+        }
+
+        // Cancelled segments of a waiting request are never transferred, their guest memory is about to be replaced. Segments after one in
+        // the middle go to a request of their own so every request stays contiguous
+        for (struct blk_queue_slot* cur = slot; cur && cur->state == BLK_SLOT_WAITING;)
+        {
+            trim(cur);
+            cur = split(cur);
+        }
+    }
+}
+
+size_t blk_queue_pending(struct guest* guest)
+{
+    size_t pending = 0;
+
+    for (size_t i = 0; i < BLK_QUEUE_MAX_REQUESTS; i++)
+    {
+        struct blk_queue_slot* slot = &queue.slots[i];
+        if (slot->state == BLK_SLOT_FREE) continue;
+
+        for (size_t s = 0; s < slot->req.num_segments; s++)
+            if (slot->members[s].guest == guest) pending++;
+    }
+    return pending;
+}
+
+void blk_queue_release(struct guest* guest)
+{
+    blk_queue_cancel(guest);
+    for (size_t i = 0; i < BLK_QUEUE_MAX_MAPPINGS; i++)
+        if (queue.mappings[i].used && queue.mappings[i].guest == guest) queue.mappings[i].used = false;
+}
+
+bool blk_queue_zero_init(uint64_t device, uint64_t capacity, bool write_zeroes, uint64_t* map_bits, size_t map_size)
+{
+    if (zero_map_of(device) || capacity == 0)
+    {
+        LOG_VMM("Invalid or duplicate zero detection device (device=%ld)\n", device);
+        return false;
+    }
+    uint64_t granules = (uint64_t)(map_size / sizeof(uint64_t)) * 64;
+    if (!map_bits || granules == 0)
+    {
+        LOG_VMM("Zero map needs at least %ld bytes (device=%ld)\n", sizeof(uint64_t), device);
+        return false;
+    }
+
+    for (size_t i = 0; i < BLK_ZERO_MAX_DEVICES; i++)
+    {
+        struct blk_zero_map* map = &queue.zero_maps[i];
+        if (map->used) continue;
+
+        memset(map, 0, sizeof(struct blk_zero_map));
+        map->used = true;
+        map->device = device;
+        map->capacity = capacity;
+        map->write_zeroes = write_zeroes;
+        map->shift = (unsigned)__builtin_ctzl(BLK_ZERO_MIN_GRANULE);
+        while ((capacity - 1) >> map->shift >= granules)
+            map->shift++;
+        map->bits = map_bits;
+        memset(map_bits, 0, (size_t)((((capacity - 1) >> map->shift) / 64 + 1) * sizeof(uint64_t)));
+        return true;
+    }
+
+    LOG_VMM("Too many zero detection devices (max=%ld)\n", BLK_ZERO_MAX_DEVICES);
+    return false;
+}
+
+void blk_queue_mark_zero(uint64_t device, uint64_t offset, uint64_t len)
+{
+    struct blk_zero_map* map = zero_map_of(device);
+    if (map) update_zero(map, offset, len, true);
+}
+
+void blk_queue_absorbed(struct guest* guest, uint64_t handle, uint64_t offset, uint64_t len)
+{
+    struct blk_queue_mapping* mapping = mapping_of(guest, handle);
+    struct blk_zero_map* map = mapping ? zero_map_of(mapping->device) : NULL;
+    if (map) update_zero(map, offset, len, false);
+}
+
+void blk_queue_get_stats(struct blk_queue_stats* stats)
+{
+    *stats = queue.stats;
+}
@@ -0,0 +1,161 @@
+#include <solo5libvmm/boot_cache.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static struct boot_cache_entry cache[BOOT_CACHE_ENTRIES];
+static size_t next_victim;
+static struct boot_cache_stats stats;
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t lane)
+{
+    acc ^= hash_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+uint64_t boot_cache_hash(const uint8_t* data, size_t size, uint64_t seed)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = data + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+        // Four independent lanes so the multiplies pipeline
+        uint64_t v1 = seed + PRIME64_1 + PRIME64_2;
+        uint64_t v2 = seed + PRIME64_2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - PRIME64_1;
+        const uint8_t* limit = end - 32;
+
+        do
+        {
+            v1 = hash_round(v1, read64(p));
+            v2 = hash_round(v2, read64(p + 8));
+            v3 = hash_round(v3, read64(p + 16));
+            v4 = hash_round(v4, read64(p + 24));
+            p += 32;
+        } while (p <= limit);
+
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    }
+    else
+        h = seed + PRIME64_5;
+
+    h += (uint64_t)size;
+
+    for (; p + 8 <= end; p += 8) h = rotl64(h ^ hash_round(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+    for (; p < end; p++) h = rotl64(h ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+    // Final avalanche
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t boot_cache_key(const uint8_t* kernel, size_t kernel_size, size_t mem_size, const char* cmdline, size_t cmdline_len)
+{
+    uint64_t key = boot_cache_hash(kernel, kernel_size, mem_size);
+    return boot_cache_hash((const uint8_t*)cmdline, cmdline_len, key);
+}
+
+struct boot_cache_entry* boot_cache_lookup(uint64_t key, size_t kernel_size, size_t mem_size, const char* cmdline, size_t cmdline_len)
+{
+    for (size_t i = 0; i < BOOT_CACHE_ENTRIES; i++)
+    {
+        struct boot_cache_entry* entry = &cache[i];
+        if (entry->valid && entry->key == key && entry->kernel_size == kernel_size && entry->mem_size == mem_size
+            && entry->cmdline_len == cmdline_len && memcmp(entry->block + entry->cmdline_offset, cmdline, cmdline_len) == 0)
+        {
+            stats.hits++;
+            return entry;
+        }
+    }
+
+    stats.misses++;
+    return NULL;
+}
+
+bool boot_cache_insert(uint64_t key, size_t kernel_size, size_t mem_size, size_t cmdline_len, uint64_t p_entry, uint64_t p_end,
+    const uint8_t* block, size_t block_size, size_t cmdline_offset, size_t mft_offset, size_t mft_size)
+{
+    if (block_size > BOOT_CACHE_BLOCK_SIZE)
+    {
+        LOG_VMM("Boot block too large to cache (size=%ld, max=%ld)\n", block_size, BOOT_CACHE_BLOCK_SIZE);
+        return false;
+    }
+    if (cmdline_offset > block_size || cmdline_len > block_size - cmdline_offset || mft_offset > block_size
+        || mft_size > block_size - mft_offset)
+    {
+        LOG_VMM("Boot block cmdline/MFT outside block, not caching\n");
+        return false;
+    }
+
+    struct boot_cache_entry* entry = &cache[next_victim];
+    next_victim = (next_victim + 1) % BOOT_CACHE_ENTRIES;
+
+    entry->valid = true;
+    entry->key = key;
+    entry->kernel_size = kernel_size;
+    entry->mem_size = mem_size;
+    entry->cmdline_len = cmdline_len;
+    entry->p_entry = p_entry;
+    entry->p_end = p_end;
+    entry->cmdline_offset = cmdline_offset;
+    entry->mft_offset = mft_offset;
+    entry->mft_size = mft_size;
+    entry->block_size = block_size;
+    memcpy(entry->block, block, block_size);
+    return true;
+}
+
+void boot_cache_remove(struct boot_cache_entry* entry)
+{
+    entry->valid = false;
+}
+
+void boot_cache_invalidate(void)
+{
+    for (size_t i = 0; i < BOOT_CACHE_ENTRIES; i++) cache[i].valid = false;
+    next_victim = 0;
+}
+
+void boot_cache_get_stats(struct boot_cache_stats* out)
+{
+    *out = stats;
+}
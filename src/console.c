@@ -0,0 +1,180 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/console.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+_Static_assert((AARCH64_CONSOLE_DATA_SZ & (AARCH64_CONSOLE_DATA_SZ - 1)) == 0, "Console ring size must be a power of 2");
+_Static_assert(AARCH64_CONSOLE_DATA + AARCH64_CONSOLE_DATA_SZ <= AARCH64_CONSOLE_RING + AARCH64_CONSOLE_RING_SZ, "Console ring layout");
+
+static struct console_state* state_of(struct guest* guest)
+{
+    return &guest->console;
+}
+
+static struct hvt_console_ring* ring_of(struct guest* guest)
+{
+    struct hvt_console_ring* ring = guest_ptr(guest, AARCH64_CONSOLE_RING, sizeof(struct hvt_console_ring));
+    if (!ring || ring->magic != HVT_CONSOLE_RING_MAGIC) return NULL;
+    return ring;
+}
+
+static void print_write(struct guest* guest, const char* data, size_t len, void* cookie)
+{
+    (void)guest;
+    (void)cookie;
+    PRINT_VMM("%.*s", (int)len, data);
+}
+
+static void emit(struct guest* guest, const uint8_t* data, size_t len)
+{
+    if (len == 0) return;
+
+    struct console_state* state = state_of(guest);
+    state->write(guest, (const char*)data, len, state->cookie);
+    state->stats.flushes++;
+    state->stats.bytes += len;
+}
+
+static void console_flush_deadline(void* arg)
+{
+    console_drain(arg);
+}
+
+void console_init(struct guest* guest, console_write_fn write, void* cookie)
+{
+    struct console_state* state = state_of(guest);
+
+    if (!state->attached) timer_event_init(&state->flush_event, console_flush_deadline, guest);
+    state->attached = true;
+    state->write = write ? write : print_write;
+    state->cookie = cookie;
+}
+
+void console_deinit(struct guest* guest)
+{
+    struct console_state* state = state_of(guest);
+    if (!state->attached) return;
+
+    console_drain(guest);
+    timer_cancel(&state->flush_event);
+    state->attached = false;
+}
+
+bool console_attached(struct guest* guest)
+{
+    return state_of(guest)->attached;
+}
+
+uint64_t console_setup(struct guest* guest)
+{
+    struct console_state* state = state_of(guest);
+    struct hvt_console_ring* ring = guest_ptr(guest, AARCH64_CONSOLE_RING, sizeof(struct hvt_console_ring));
+
+    timer_cancel(&state->flush_event);
+    if (!state->attached || !ring) return 0;
+
+    memset(ring, 0, sizeof(struct hvt_console_ring));
+    ring->size = AARCH64_CONSOLE_DATA_SZ;
+    ring->data = AARCH64_CONSOLE_DATA;
+    ring->magic = HVT_CONSOLE_RING_MAGIC;
+    return AARCH64_CONSOLE_RING;
+}
+
+void console_drain(struct guest* guest)
+{
+    struct console_state* state = state_of(guest);
+    struct hvt_console_ring* ring = ring_of(guest);
+
+    timer_cancel(&state->flush_event);
+    if (!state->attached || !ring) return;
+
+    uint64_t head = ring->head;
+    uint64_t tail = ring->tail;
+    atomic_thread_fence(memory_order_acquire);
+
+    uint64_t used = head - tail;
+    if (used > AARCH64_CONSOLE_DATA_SZ)
+    {
+        // Guest broke the protocol, nothing in the ring can be trusted
+        state->stats.overruns++;
+        ring->tail = head;
+        return;
+    }
+
+    // At most two copies, the part up to the end of the ring and the wrapped part
+    const uint8_t* data = guest->mem + AARCH64_CONSOLE_DATA;
+    size_t offset = tail & (AARCH64_CONSOLE_DATA_SZ - 1);
+    size_t first = used < AARCH64_CONSOLE_DATA_SZ - offset ? used : AARCH64_CONSOLE_DATA_SZ - offset;
+    emit(guest, data + offset, first);
+    emit(guest, data, used - first);
+
+    // Make sure the data was read before the guest may overwrite it
+    atomic_thread_fence(memory_order_release);
+    ring->tail = head;
+}
+
+void console_puts(struct guest* guest, struct hvt_hc_puts* hc)
+{
+    struct console_state* state = state_of(guest);
+    struct hvt_console_ring* ring = ring_of(guest);
+    const uint8_t* data = hc->len ? guest_ptr(guest, hc->data, hc->len) : NULL;
+
+    state->stats.puts++;
+
+    if (ring)
+    {
+        // Guest is stopped so the VMM can act as producer, anything already in the ring was written before this call
+        uint64_t used = ring->head - ring->tail;
+        if (used > AARCH64_CONSOLE_DATA_SZ || AARCH64_CONSOLE_DATA_SZ - used < hc->len) console_drain(guest);
+
+        if (data && hc->len <= AARCH64_CONSOLE_DATA_SZ - (ring->head - ring->tail))
+        {
+            uint8_t* ring_data = guest->mem + AARCH64_CONSOLE_DATA;
+            size_t offset = ring->head & (AARCH64_CONSOLE_DATA_SZ - 1);
+            size_t first = hc->len < AARCH64_CONSOLE_DATA_SZ - offset ? hc->len : AARCH64_CONSOLE_DATA_SZ - offset;
+            memcpy(ring_data + offset, data, first);
+            memcpy(ring_data, data + first, hc->len - first);
+            ring->head += hc->len;
+            data = NULL;
+
+            // Same rules as for output the guest appended itself, otherwise it could sit in the ring until the next unrelated exit
+            console_exit(guest);
+        }
+    }
+
+    // No ring or larger than the whole ring (which has just been drained), write through
+    if (data) emit(guest, data, hc->len);
+
+    sched_resume(guest, false);
+}
+
+void console_exit(struct guest* guest)
+{
+    struct console_state* state = state_of(guest);
+    if (!state->attached) return;
+
+    struct hvt_console_ring* ring = ring_of(guest);
+    if (!ring) return;
+
+    uint64_t used = ring->head - ring->tail;
+    if (used == 0) return;
+
+    if (used >= CONSOLE_DRAIN_THRESHOLD)
+        console_drain(guest);
+    else if (!state->flush_event.armed)
+        timer_add(&state->flush_event, aarch64_get_counter() + aarch64_ns_to_ticks(CONSOLE_FLUSH_NS));
+}
+
+void console_get_stats(struct guest* guest, struct console_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
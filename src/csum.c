@@ -0,0 +1,89 @@
+#include <solo5libvmm/csum.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) && !defined(CSUM_NO_NEON)
+#define CSUM_NEON
+#include <arm_neon.h>
+#endif
+
+// The ones' complement sum is byte order independent, words are summed in native (little endian) order and swapped once at the end
+
+static inline uint64_t add_carry(uint64_t sum, uint64_t value)
+{
+    sum += value;
+    return sum + (sum < value);
+}
+
+static inline uint16_t fold64(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)sum;
+}
+
+static uint64_t sum_words(const uint8_t* p, size_t len, uint64_t sum)
+{
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        sum = add_carry(sum, v);
+    }
+
+    // Tail keeps its byte positions so 16-bit word pairing is preserved
+    if (len)
+    {
+        uint64_t v = 0;
+        memcpy(&v, p, len);
+        sum = add_carry(sum, v);
+    }
+    return sum;
+}
+
+#if defined(CSUM_NEON)
+// 64 bytes per iteration into four 32-bit lane accumulators with pairwise add-accumulate, spilled to 64 bits before they can overflow
+static uint64_t sum_words_neon(const uint8_t* p, size_t len, uint64_t sum)
+{
+    // Each iteration adds at most 4 * 2 * 0xffff to a 32-bit lane
+    const size_t SPILL_ITERATIONS = 4096;
+    uint64x2_t acc64 = vdupq_n_u64(0);
+
+    while (len >= 64)
+    {
+        uint32x4_t acc0 = vdupq_n_u32(0);
+        uint32x4_t acc1 = vdupq_n_u32(0);
+
+        for (size_t i = 0; i < SPILL_ITERATIONS && len >= 64; i++, p += 64, len -= 64)
+        {
+            acc0 = vpadalq_u16(acc0, vreinterpretq_u16_u8(vld1q_u8(p)));
+            acc1 = vpadalq_u16(acc1, vreinterpretq_u16_u8(vld1q_u8(p + 16)));
+            acc0 = vpadalq_u16(acc0, vreinterpretq_u16_u8(vld1q_u8(p + 32)));
+            acc1 = vpadalq_u16(acc1, vreinterpretq_u16_u8(vld1q_u8(p + 48)));
+        }
+        acc64 = vpadalq_u32(acc64, acc0);
+        acc64 = vpadalq_u32(acc64, acc1);
+    }
+
+    sum = add_carry(sum, vgetq_lane_u64(acc64, 0));
+    sum = add_carry(sum, vgetq_lane_u64(acc64, 1));
+    return sum_words(p, len, sum);
+}
+#endif
+
+uint32_t csum_partial(const void* data, size_t len, uint32_t sum)
+{
+#if defined(CSUM_NEON)
+    uint16_t folded = fold64(sum_words_neon(data, len, 0));
+#else
+    uint16_t folded = fold64(sum_words(data, len, 0));
+#endif
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    folded = __builtin_bswap16(folded);
+#endif
+    return csum_add16(sum, folded);
+}
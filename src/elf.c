@@ -1,5 +1,6 @@
 #include <elf.h>
 #include <solo5libvmm/elf.h>
+#include <solo5libvmm/lz4.h>
 #include <solo5libvmm/solo5/elf_abi.h>
 #include <solo5libvmm/util.h>
 #include <stdbool.h>
@@ -16,7 +17,7 @@
 #define EI_DATA_TARGET ELFDATA2MSB
 #endif
 
-static bool ehdr_is_valid(const Elf64_Ehdr* hdr)
+static bool ehdr_is_valid(const Elf64_Ehdr* hdr, size_t elf_size)
 {
     // Validate that this is an ELF64 header we support
     if (!(hdr->e_ident[EI_MAG0] == ELFMAG0 && hdr->e_ident[EI_MAG1] == ELFMAG1 && hdr->e_ident[EI_MAG2] == ELFMAG2 && hdr->e_ident[EI_MAG3] == ELFMAG3
@@ -27,6 +28,8 @@ static bool ehdr_is_valid(const Elf64_Ehdr* hdr)
     if (hdr->e_ehsize != sizeof(Elf64_Ehdr)) return false;
     if (hdr->e_phnum < 1) return false;
     if (hdr->e_phentsize != sizeof(Elf64_Phdr)) return false;
+    // Validate that the program header table lies within the image
+    if (hdr->e_phoff > elf_size || (size_t)hdr->e_phnum * sizeof(Elf64_Phdr) > elf_size - hdr->e_phoff) return false;
     // Validate that this is an executable for our target architecture
     if (hdr->e_type != ET_EXEC) return false;
     if (hdr->e_machine != EM_TARGET) return false;
@@ -71,8 +74,9 @@ bool elf_load_note(uint8_t* elf_ptr, size_t elf_size, uint32_t note_type, size_t
     Elf64_Ehdr ehdr;
     size_t note_offset, note_size, note_pad;
 
+    if (elf_size < sizeof(Elf64_Ehdr)) return false;
     memcpy(&ehdr, elf_ptr, sizeof(Elf64_Ehdr));
-    if (!ehdr_is_valid(&ehdr)) return false;
+    if (!ehdr_is_valid(&ehdr, elf_size)) return false;
     LOG_VMM("Validated ehdr\n");
 
     // Find the phdr containing the Solo5 NOTE of type note_type and check its headers
@@ -84,10 +88,12 @@ bool elf_load_note(uint8_t* elf_ptr, size_t elf_size, uint32_t note_type, size_t
     {
         memcpy(&phdr, next_phdr_address, sizeof(Elf64_Phdr));
         next_phdr_address += sizeof(Elf64_Phdr);
-        // TODO: should add check that we stay under elf_size
 
         if (phdr.p_type != PT_NOTE) continue;
 
+        // Note segment must lie within the image
+        if (phdr.p_offset > elf_size || phdr.p_filesz > elf_size - phdr.p_offset) return false;
+
         // p_filesz is less than minimum possible size of a NOTE header
         if (phdr.p_filesz < sizeof(Elf64_Nhdr)) return false;
 
@@ -145,8 +151,9 @@ bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* mem, size_t mem_size,
     Elf64_Addr e_end;
 
     // Copy into structs to guarantee struct required alignment
+    if (elf_size < sizeof(Elf64_Ehdr)) return false;
     memcpy(&ehdr, elf_ptr, sizeof(Elf64_Ehdr));
-    if (!ehdr_is_valid(&ehdr)) return false;
+    if (!ehdr_is_valid(&ehdr, elf_size)) return false;
     LOG_VMM("Validated ehdr\n");
 
     // e_entry must be non-zero and within range of our memory
@@ -164,8 +171,6 @@ bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* mem, size_t mem_size,
         next_phdr_address += sizeof(Elf64_Phdr);
         LOG_VMM("Read phdr %ld\n", ph_i);
 
-        // TODO: should add check that we stay under elf_size
-
         Elf64_Addr p_vaddr = phdr.p_vaddr;
         Elf64_Xword p_filesz = phdr.p_filesz;
         Elf64_Xword p_memsz = phdr.p_memsz;
@@ -191,6 +196,10 @@ bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* mem, size_t mem_size,
         // Disallow overlapping segments
         if (p_vaddr_start < e_end) return false;
 
+        // Verify segment file data is within the image
+        if (__builtin_add_overflow(phdr.p_offset, p_filesz, &temp)) return false;
+        if (temp > elf_size) return false;
+
         // Verify p_vaddr + p_filesz is within range.
         if (p_vaddr >= mem_size) return false;
         if (__builtin_add_overflow(p_vaddr, p_filesz, &temp)) return false;
@@ -221,8 +230,23 @@ bool elf_load(uint8_t* elf_ptr, size_t elf_size, uint8_t* mem, size_t mem_size,
         uint8_t* segment_data = elf_ptr + phdr.p_offset;
         // Double check result for host (caller) address space overflow
         assert(host_vaddr >= (mem + p_min_loadaddr));
-        memcpy(host_vaddr, segment_data, p_filesz);
-        memset(host_vaddr + p_filesz, 0, p_memsz - p_filesz);
+        if (phdr.p_flags & ELF_PF_LZ4)
+        {
+            // Decompress straight into guest memory, the packer strips trailing zeros so only the tail the decompressor did not write
+            // needs clearing
+            size_t out_size;
+            if (!lz4_decompress(segment_data, p_filesz, host_vaddr, p_memsz, &out_size))
+            {
+                LOG_VMM("phdr %ld failed to decompress\n", ph_i);
+                return false;
+            }
+            memset(host_vaddr + out_size, 0, p_memsz - out_size);
+        }
+        else
+        {
+            memcpy(host_vaddr, segment_data, p_filesz);
+            memset(host_vaddr + p_filesz, 0, p_memsz - p_filesz);
+        }
 
         LOG_VMM("phdr loaded\n");
 
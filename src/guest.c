@@ -1,11 +1,26 @@
 #include <microkit.h>
 #include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/aarch64/vgic.h>
+#include <solo5libvmm/blk_cache.h>
+#include <solo5libvmm/blk_queue.h>
+#include <solo5libvmm/boot_cache.h>
+#include <solo5libvmm/console.h>
 #include <solo5libvmm/elf.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/pending.h>
+#include <solo5libvmm/poll.h>
+#include <solo5libvmm/ratelimit.h>
+#include <solo5libvmm/shm.h>
 #include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
 #include <solo5libvmm/solo5/elf_abi.h>
 #include <solo5libvmm/solo5/hvt_abi.h>
 #include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/timer.h>
 #include <solo5libvmm/util.h>
+#include <solo5libvmm/vswitch.h>
+#include <solo5libvmm/wss.h>
 #include <stdalign.h>
 #include <stdatomic.h>
 #include <string.h>
@@ -13,73 +28,270 @@
 #define NOTE_BUF_ALIGN alignof(struct mft)
 #define NOTE_BUF_SIZE MFT1_NOTE_MAX_SIZE
 
+// Image loaded by load_image
+struct loaded_image
+{
+    uint64_t p_entry;
+    uint64_t p_end;
+    uint64_t cmdline;                   // Guest address of cmdline copy
+    uint64_t mft;                       // Guest address of MFT copy
+    size_t mft_size;
+    size_t block_size;                  // Boot info, cmdline and MFT from AARCH64_BOOT_INFO
+};
+
 _Static_assert(alignof(struct mft) >= alignof(struct abi1_info));
 _Static_assert(MFT1_NOTE_MAX_SIZE >= sizeof(struct abi1_info));
 
-void guest_resume(size_t vcpu_id)
+static struct guest* guests[GUEST_MAX_VCPUS];
+
+bool guest_init(struct guest* guest, size_t vcpu_id, uint8_t* mem, size_t mem_size)
+{
+    const size_t MEM_SIZE_ALIGN = AARCH64_GUEST_BLOCK_SIZE;
+
+    if (vcpu_id >= GUEST_MAX_VCPUS)
+    {
+        LOG_VMM("Invalid vcpu_id, must be below %ld (vcpu_id=%ld)\n", GUEST_MAX_VCPUS, vcpu_id);
+        return false;
+    }
+    if (guests[vcpu_id] != NULL)
+    {
+        LOG_VMM("vcpu_id %ld already has a guest, solo5 is single-threaded so each guest needs its own VCpu\n", vcpu_id);
+        return false;
+    }
+
+    assert(MEM_SIZE_ALIGN % 16 == 0);
+    if (mem_size % MEM_SIZE_ALIGN != 0)
+    {
+        size_t new_mem_size = (mem_size / MEM_SIZE_ALIGN) * MEM_SIZE_ALIGN;
+        LOG_VMM("mem_size truncated DOWN to %ld byte alignment (old=%ld new=%ld)\n", MEM_SIZE_ALIGN, mem_size, new_mem_size);
+        mem_size = new_mem_size;
+    }
+    if (mem_size == 0)
+    {
+        LOG_VMM("mem_size too small (required=%ld mem_size=%ld)", MEM_SIZE_ALIGN, mem_size);
+        return false;
+    }
+
+    memset(guest, 0, sizeof(struct guest));
+    guest->vcpu_id = vcpu_id;
+    guest->mem = mem;
+    guest->mem_size = mem_size;
+    guest->acct.state = GUEST_STATE_STOPPED;
+    guest->acct.since = aarch64_get_counter();
+    poll_init(guest);
+    vgic_reset(guest);
+    idle_init(guest);
+    ratelimit_init(guest);
+    wss_init(guest);
+    guests[vcpu_id] = guest;
+
+    return true;
+}
+
+void guest_deinit(struct guest* guest)
+{
+    assert(guests[guest->vcpu_id] == guest);
+    sched_remove(guest);
+    poll_cancel(guest);
+    pending_cancel(guest);
+    ratelimit_cancel(guest);
+    idle_cancel(guest);
+    wss_cancel(guest);
+    console_deinit(guest);
+    vswitch_release(guest);
+    net_rx_flush(guest);
+    blk_cache_release(guest);
+    blk_queue_release(guest);
+    guests[guest->vcpu_id] = NULL;
+}
+
+struct guest* guest_from_vcpu(size_t vcpu_id)
+{
+    if (vcpu_id >= GUEST_MAX_VCPUS) return NULL;
+    return guests[vcpu_id];
+}
+
+void* guest_ptr(struct guest* guest, uint64_t gpa, size_t size)
+{
+    if (gpa >= guest->mem_size || size > guest->mem_size - gpa) return shm_ptr(guest, gpa, size);
+    if (guest->wss.enabled) wss_touch(guest, gpa, size);
+    return guest->mem + gpa;
+}
+
+struct mft* guest_mft(struct guest* guest)
+{
+    struct mft* mft = guest_ptr(guest, guest->boot.mft, sizeof(struct mft));
+    if (!mft || mft->entries > MFT_MAX_ENTRIES || !guest_ptr(guest, guest->boot.mft, sizeof(struct mft) + mft->entries * sizeof(struct mft_entry)))
+        return NULL;
+    return mft;
+}
+
+static void charge(struct guest* guest, struct guest_stats* stats, uint64_t now)
+{
+    uint64_t elapsed = now - guest->acct.since;
+
+    switch (guest->acct.state)
+    {
+        case GUEST_STATE_RUNNING:
+            stats->run_ticks += elapsed;
+            break;
+        case GUEST_STATE_BLOCKED:
+            stats->blocked_ticks[guest->acct.blocked_on] += elapsed;
+            break;
+        case GUEST_STATE_IDLE:
+            stats->idle_ticks += elapsed;
+            break;
+        default:
+            stats->stopped_ticks += elapsed;
+            break;
+    }
+}
+
+void guest_account(struct guest* guest, enum guest_state state, enum hvt_hypercall blocked_on)
+{
+    uint64_t now = aarch64_get_counter();
+
+    assert(blocked_on < HVT_HYPERCALL_MAX);
+    charge(guest, &guest->stats, now);
+    guest->acct.state = state;
+    guest->acct.blocked_on = blocked_on;
+    guest->acct.since = now;
+}
+
+void guest_get_stats(struct guest* guest, struct guest_stats* stats)
+{
+    *stats = guest->stats;
+    charge(guest, stats, aarch64_get_counter());
+}
+
+void guest_stats_publish(struct guest* guest, struct guest_stats_snapshot* snapshot)
+{
+    snapshot->seq++;
+    atomic_thread_fence(memory_order_release);
+
+    snapshot->timestamp = aarch64_get_counter();
+    snapshot->stats = guest->stats;
+    charge(guest, &snapshot->stats, snapshot->timestamp);
+
+    atomic_thread_fence(memory_order_release);
+    snapshot->seq++;
+}
+
+uint64_t guest_stats_read(const struct guest_stats_snapshot* snapshot, struct guest_stats* stats)
+{
+    uint64_t seq, timestamp;
+
+    // Retry while a publish is in progress (odd seq) or completed during the copy
+    do
+    {
+        seq = snapshot->seq;
+        atomic_thread_fence(memory_order_acquire);
+        timestamp = snapshot->timestamp;
+        *stats = snapshot->stats;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) || seq != snapshot->seq);
+
+    return timestamp;
+}
+
+void guest_resume(struct guest* guest)
 {
     // Make sure any writes done to guest memory are observable by guest
     atomic_thread_fence(memory_order_release);
 
     // LOG_VMM("Resuming guest\n");
+    guest_account(guest, GUEST_STATE_RUNNING, HVT_HYPERCALL_NONE);
+    vgic_resume(guest);
     seL4_Error err;
     seL4_UserContext ctxt = {0};
-    err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + vcpu_id, seL4_True, 0, 0, &ctxt);
+    err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + guest->vcpu_id, seL4_True, 0, 0, &ctxt);
     assert(err == seL4_NoError);
+    timer_program();
     // LOG_VMM("Resumed guest!\n");
 }
 
-void guest_stop(size_t vcpu_id)
+void guest_stop(struct guest* guest)
 {
-    LOG_VMM("Stopping guest\n");
-    microkit_vcpu_stop(vcpu_id);
-    LOG_VMM("Stopped guest\n");
+    // LOG_VMM("Stopping guest\n");
+    microkit_vcpu_stop(guest->vcpu_id);
+    guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
+    timer_program();
+    // LOG_VMM("Stopped guest\n");
 }
 
-void guest_clear(size_t vcpu_id, uint8_t* mem, size_t mem_size)
+// Stops guest and writes out what it left buffered in the VMM, before its memory is replaced. Returns false while block requests issued
+// for it may still transfer to or from its memory
+static bool stop_and_drain(struct guest* guest)
 {
     LOG_VMM("Stopping guest\n");
-    microkit_vcpu_stop(vcpu_id);
+    microkit_vcpu_stop(guest->vcpu_id);
+    guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
 
-    LOG_VMM("Clearing guest RAM\n");
-    memset(mem, 0, mem_size);
+    console_drain(guest);
+    blk_cache_flush_all(guest);
 
+    blk_queue_cancel(guest);
+    size_t pending = blk_queue_pending(guest);
+    if (pending > 0)
+    {
+        LOG_VMM("Guest has block requests in flight, memory left untouched (pending=%ld)\n", pending);
+        return false;
+    }
+    return true;
+}
+
+// Resets registers and drops per guest state of the previous boot, guest memory must already be replaced
+static void reset(struct guest* guest)
+{
     LOG_VMM("Resetting guest registers\n");
-    vcpu_reset_regs(vcpu_id);
+    vcpu_reset_regs(guest->vcpu_id);
+    vgic_reset(guest);
+    poll_cancel(guest);
+    net_rx_flush(guest);
+    pending_cancel(guest);
+    ratelimit_cancel(guest);
+    idle_cancel(guest);
+    wss_cancel(guest);
+    guest->boot.booted = false;
 
     LOG_VMM("Guest reset\n");
 }
 
-bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* mem, size_t mem_size, size_t max_stack_size, char* cmdline, size_t cmdline_len)
+bool guest_clear(struct guest* guest)
 {
-    LOG_VMM("Started guest setup\n");
+    if (!stop_and_drain(guest)) return false;
 
-    const size_t MEM_SIZE_ALIGN = AARCH64_GUEST_BLOCK_SIZE;
+    LOG_VMM("Clearing guest RAM\n");
+    memset(guest->mem, 0, guest->mem_size);
 
-    // TODO: Check max stack is reasonable and doesnt overlap text/min heap
-    if (vcpu_id != 0)
-    {
-        LOG_VMM("Invalid vcpu_id, solo5 is single-threaded and only 1 VM allowed per VMM, vcpu_id should be 0\n");
-        return false;
-    }
-    if (cmdline_len > HVT_CMDLINE_SIZE)
-    {
-        LOG_VMM("cmdline longer than max: %ld (len=%ld)\n", HVT_CMDLINE_SIZE, cmdline_len);
-        return false;
-    }
+    reset(guest);
+    return true;
+}
 
-    assert(MEM_SIZE_ALIGN % 16 == 0);
-    if (mem_size % MEM_SIZE_ALIGN != 0)
-    {
-        size_t new_mem_size = (mem_size / MEM_SIZE_ALIGN) * MEM_SIZE_ALIGN;
-        LOG_VMM("mem_size truncated DOWN to %ld byte alignment (old=%ld new=%ld)\n", MEM_SIZE_ALIGN, mem_size, new_mem_size);
-        mem_size = new_mem_size;
-    }
-    if (mem_size == 0)
-    {
-        LOG_VMM("mem_size too small (required=%ld mem_size=%ld)", MEM_SIZE_ALIGN, mem_size);
-        return false;
-    }
+// Fills the per boot fields of the boot info extension, the rest comes from the boot cache on restarts
+static void setup_boot_ext(struct guest* guest)
+{
+    struct hvt_boot_info_ext* ext = (struct hvt_boot_info_ext*)(guest->mem + AARCH64_BOOT_INFO + sizeof(struct hvt_boot_info));
+    ext->console = console_setup(guest);
+}
+
+static void setup_vcpu(size_t vcpu_id, uint8_t* mem, size_t mem_size, uint64_t p_entry)
+{
+    // Add arch IFDEFS here, if you want to support more archs in the future
+
+    // TODO: Add stack protection based on max stack
+    setup_memory_mapping(mem, mem_size);
+    setup_system_registers(vcpu_id, mem_size);
+    setup_tcb_registers(vcpu_id, p_entry, AARCH64_BOOT_INFO);
+}
+
+// Parses and loads an image into memory laid out like guest memory (it may be a staging copy), load_size bounds the segments and mem_size
+// is what the guest is told it has. Memory must be zeroed, the per boot part of the boot info extension is left unset
+static bool load_image(uint8_t* mem, size_t load_size, size_t mem_size, uint8_t* kernel, size_t kernel_size, char* cmdline,
+    size_t cmdline_len, struct loaded_image* image)
+{
+    uint64_t p_entry;
+    uint64_t p_end;
 
     alignas(NOTE_BUF_ALIGN) uint8_t note_buf[NOTE_BUF_SIZE];
     size_t acc_note_size;
@@ -127,9 +339,7 @@ bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* m
     LOG_VMM("guest_setup passed arg checks\n");
 
     // TODO: Add protection propagation
-    uint64_t p_entry;
-    uint64_t p_end;
-    if (!elf_load(kernel, kernel_size, mem, mem_size, AARCH64_GUEST_MIN_BASE, &p_entry, &p_end))
+    if (!elf_load(kernel, kernel_size, mem, load_size, AARCH64_GUEST_MIN_BASE, &p_entry, &p_end))
     {
         LOG_VMM("Failed to load HVT file (incompatible or invalid)\n");
         return false;
@@ -147,8 +357,13 @@ bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* m
     info->cpu_cycle_freq = aarch64_get_counter_frequency();
     info->kernel_end = p_end;
 
+    // Extension block goes right after boot info, see hvt_ext.h
+    struct hvt_boot_info_ext* ext = (struct hvt_boot_info_ext*)((uint64_t)info + sizeof(struct hvt_boot_info));
+    ext->magic = HVT_BOOT_INFO_EXT_MAGIC;
+    ext->size = sizeof(struct hvt_boot_info_ext);
+
     // Copy in cmdline
-    uint64_t arg_ptr = (uint64_t)info + sizeof(struct hvt_boot_info);
+    uint64_t arg_ptr = (uint64_t)ext + sizeof(struct hvt_boot_info_ext);
     memcpy((uint8_t*)arg_ptr, cmdline, cmdline_len);
     *((char*)(arg_ptr + cmdline_len)) = '\0';
     info->cmdline = arg_ptr - (uint64_t)mem;
@@ -161,10 +376,10 @@ bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* m
     info->mft = arg_ptr - (uint64_t)mem;
     arg_ptr += acc_note_size;
 
-    // Check arguments fit in space and don't overlap text
-    if (arg_ptr - (uint64_t)mem > AARCH64_GUEST_MIN_BASE)
+    // Check arguments fit in space and don't overlap the console ring
+    if (arg_ptr - (uint64_t)mem > AARCH64_CONSOLE_RING)
     {
-        LOG_VMM("cmdline + mft args too long - overwrite program text\n");
+        LOG_VMM("cmdline + mft args too long - overwrite console ring\n");
         return false;
     }
 
@@ -176,12 +391,144 @@ bool guest_setup(size_t vcpu_id, uint8_t* kernel, size_t kernel_size, uint8_t* m
     LOG_VMM("cmdline guest addr: %zu\n", info->cmdline);
     LOG_VMM("mft guest addr: %zu\n", info->mft);
 
-    // Add arch IFDEFS here, if you want to support more archs in the future
+    image->p_entry = p_entry;
+    image->p_end = p_end;
+    image->cmdline = info->cmdline;
+    image->mft = info->mft;
+    image->mft_size = acc_note_size;
+    image->block_size = arg_ptr - (uint64_t)info;
+    return true;
+}
 
-    // TODO: Add stack protection based on max stack
-    setup_memory_mapping(mem, mem_size);
-    setup_system_registers(vcpu_id, mem_size);
-    setup_tcb_registers(vcpu_id, p_entry, AARCH64_BOOT_INFO);
+
+// Sets up VCpu and per guest state once the image and boot block are in guest memory
+static void finish_boot(struct guest* guest, uint64_t p_entry, uint64_t p_end, uint64_t mft)
+{
+    setup_boot_ext(guest);
+    setup_vcpu(guest->vcpu_id, guest->mem, guest->mem_size, p_entry);
+
+    guest->boot.p_entry = p_entry;
+    guest->boot.p_end = p_end;
+    guest->boot.mft = mft;
+    shm_setup(guest);
+    net_setup(guest);
+    vswitch_setup(guest);
+    blk_cache_setup(guest);
+    ratelimit_setup(guest);
+    wss_setup(guest);
+    guest->boot.booted = true;
+    guest->stats.boots++;
+}
+
+bool guest_setup(struct guest* guest, uint8_t* kernel, size_t kernel_size, size_t max_stack_size, char* cmdline, size_t cmdline_len)
+{
+    LOG_VMM("Started guest setup (vcpu_id=%ld)\n", guest->vcpu_id);
+
+    uint8_t* mem = guest->mem;
+    size_t mem_size = guest->mem_size;
+
+    // TODO: Check max stack is reasonable and doesnt overlap text/min heap
+    if (cmdline_len > HVT_CMDLINE_SIZE)
+    {
+        LOG_VMM("cmdline longer than max: %ld (len=%ld)\n", HVT_CMDLINE_SIZE, cmdline_len);
+        return false;
+    }
+
+    // Restarting the same image with the same config only needs segments reloaded, notes and boot info come from the cache
+    uint64_t p_entry;
+    uint64_t p_end;
+    uint64_t cache_key = boot_cache_key(kernel, kernel_size, mem_size, cmdline, cmdline_len);
+    struct boot_cache_entry* cached = boot_cache_lookup(cache_key, kernel_size, mem_size, cmdline, cmdline_len);
+    if (cached)
+    {
+        LOG_VMM("Boot cache hit\n");
+        if (!elf_load(kernel, kernel_size, mem, mem_size, AARCH64_GUEST_MIN_BASE, &p_entry, &p_end))
+        {
+            LOG_VMM("Failed to load HVT file (incompatible or invalid)\n");
+            return false;
+        }
+
+        // Only the kernel's hash and size were matched, a different image that collides is caught by where its segments end up
+        if (p_entry == cached->p_entry && p_end == cached->p_end)
+        {
+            memcpy(mem + AARCH64_BOOT_INFO, cached->block, cached->block_size);
+            finish_boot(guest, cached->p_entry, cached->p_end, AARCH64_BOOT_INFO + cached->mft_offset);
+            return true;
+        }
+
+        LOG_VMM("Boot cache entry does not match image, loading it in full\n");
+        boot_cache_remove(cached);
+    }
+
+    struct loaded_image image;
+    if (!load_image(mem, mem_size, mem_size, kernel, kernel_size, cmdline, cmdline_len, &image)) return false;
+
+    // Cached before the device setup functions fill in the MFT, a hit must start from the image's own entries
+    boot_cache_insert(cache_key, kernel_size, mem_size, cmdline_len, image.p_entry, image.p_end, mem + AARCH64_BOOT_INFO, image.block_size,
+        image.cmdline - AARCH64_BOOT_INFO, image.mft - AARCH64_BOOT_INFO, image.mft_size);
+    finish_boot(guest, image.p_entry, image.p_end, image.mft);
 
     return true;
-}
\ No newline at end of file
+}
+
+bool guest_stage(struct guest* guest, struct guest_stage* stage, uint8_t* staging, size_t staging_size, uint8_t* kernel, size_t kernel_size,
+    char* cmdline, size_t cmdline_len)
+{
+    LOG_VMM("Staging guest image (vcpu_id=%ld)\n", guest->vcpu_id);
+    stage->ready = false;
+
+    if (cmdline_len > HVT_CMDLINE_SIZE)
+    {
+        LOG_VMM("cmdline longer than max: %ld (len=%ld)\n", HVT_CMDLINE_SIZE, cmdline_len);
+        return false;
+    }
+
+    // Staging memory mirrors the bottom of guest memory, anything beyond the guest's RAM could never be copied in
+    if (staging_size > guest->mem_size) staging_size = guest->mem_size;
+    memset(staging, 0, staging_size);
+
+    struct loaded_image image;
+    if (!load_image(staging, staging_size, guest->mem_size, kernel, kernel_size, cmdline, cmdline_len, &image)) return false;
+
+    *stage = (struct guest_stage){
+        .ready = true,
+        .guest = guest,
+        .mem = staging,
+        .size = image.p_end,
+        .mem_size = guest->mem_size,
+        .p_entry = image.p_entry,
+        .p_end = image.p_end,
+        .mft = image.mft,
+    };
+    return true;
+}
+
+bool guest_cutover(struct guest* guest, struct guest_stage* stage)
+{
+    if (!stage->ready)
+    {
+        LOG_VMM("No image staged for guest (vcpu_id=%ld)\n", guest->vcpu_id);
+        return false;
+    }
+    if (stage->guest != guest || stage->mem_size != guest->mem_size)
+    {
+        LOG_VMM("Image was staged for another guest or RAM size (vcpu_id=%ld)\n", guest->vcpu_id);
+        return false;
+    }
+
+    uint64_t start = aarch64_get_counter();
+    if (!stop_and_drain(guest)) return false;
+
+    // Clearing all RAM beyond the image would dominate the downtime, with working set sampling running since boot only what the old
+    // image touched is zeroed. Done first as it reads the old image's page tables, which the staged copy overwrites
+    bool cleared = wss_clear_touched(guest, stage->size);
+    memcpy(guest->mem, stage->mem, stage->size);
+    if (!cleared) memset(guest->mem + stage->size, 0, guest->mem_size - stage->size);
+
+    reset(guest);
+    finish_boot(guest, stage->p_entry, stage->p_end, stage->mft);
+
+    stage->cutover_ticks = aarch64_get_counter() - start;
+    LOG_VMM("Cutover done in %ld us\n", stage->cutover_ticks * 1000000 / aarch64_get_counter_frequency());
+    return true;
+}
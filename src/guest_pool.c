@@ -0,0 +1,226 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/blk_queue.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/guest_pool.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum pool_slot_state
+{
+    POOL_SLOT_EMPTY,                    // Cleared, waiting to be booted
+    POOL_SLOT_DRAINING,                 // Stopped with block requests in flight, cleared once they completed
+    POOL_SLOT_WARMING,                  // Booted, running towards its readiness point
+    POOL_SLOT_READY,                    // Parked on its readiness hypercall
+    POOL_SLOT_ACQUIRED                  // Handed out, owned by the VMM until released
+};
+
+struct pool_slot
+{
+    struct guest* guest;
+    enum pool_slot_state state;
+    uint64_t since;                     // Counter value at boot, then at parking
+};
+
+struct guest_pool
+{
+    bool configured;
+    struct guest_pool_config config;
+    struct pool_slot slots[GUEST_POOL_MAX_GUESTS];
+    size_t num_slots;
+    struct timer_event refill_event;
+    struct guest_pool_stats stats;
+};
+
+static struct guest_pool pool;
+
+static void refill_expired(void* arg)
+{
+    (void)arg;
+    guest_pool_refill();
+}
+
+static void schedule_refill(uint64_t delay_ns)
+{
+    uint64_t deadline = aarch64_get_counter() + aarch64_ns_to_ticks(delay_ns);
+    if (pool.refill_event.armed && pool.refill_event.deadline <= deadline) return;
+    timer_add(&pool.refill_event, deadline);
+}
+
+static struct pool_slot* slot_of(struct guest* guest)
+{
+    for (size_t i = 0; i < pool.num_slots; i++)
+        if (pool.slots[i].guest == guest) return &pool.slots[i];
+    return NULL;
+}
+
+static size_t count(enum pool_slot_state state)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < pool.num_slots; i++)
+        if (pool.slots[i].state == state) n++;
+    return n;
+}
+
+static bool boot(struct pool_slot* slot)
+{
+    struct guest_pool_config* config = &pool.config;
+
+    // Block requests of the previous boot still in flight, the refill is retried later
+    if (slot->guest->boot.booted && !guest_clear(slot->guest)) return false;
+    if (!guest_setup(slot->guest, config->kernel, config->kernel_size, config->max_stack_size, config->cmdline, config->cmdline_len))
+    {
+        pool.stats.failures++;
+        return false;
+    }
+
+    slot->state = POOL_SLOT_WARMING;
+    slot->since = aarch64_get_counter();
+    sched_resume(slot->guest, false);
+    return true;
+}
+
+bool guest_pool_init(const struct guest_pool_config* config)
+{
+    if (!config->kernel || config->ready_on < 1 || config->ready_on >= HVT_HYPERCALL_MAX || config->ready_on == HVT_HYPERCALL_HALT ||
+        config->spares > GUEST_POOL_MAX_GUESTS)
+    {
+        LOG_VMM("Invalid guest pool config\n");
+        return false;
+    }
+
+    if (!pool.configured) timer_event_init(&pool.refill_event, refill_expired, NULL);
+    pool.config = *config;
+    pool.configured = true;
+
+    // Booted right away, the timer queue only runs once some guest does
+    guest_pool_refill();
+    return true;
+}
+
+bool guest_pool_add(struct guest* guest)
+{
+    if (slot_of(guest))
+    {
+        LOG_VMM("Guest already pooled (vcpu_id=%ld)\n", guest->vcpu_id);
+        return false;
+    }
+    if (pool.num_slots == GUEST_POOL_MAX_GUESTS)
+    {
+        LOG_VMM("Too many pooled guests (max=%ld)\n", GUEST_POOL_MAX_GUESTS);
+        return false;
+    }
+
+    pool.slots[pool.num_slots++] = (struct pool_slot){ .guest = guest, .state = POOL_SLOT_EMPTY };
+    guest_pool_refill();
+    return true;
+}
+
+struct guest* guest_pool_acquire(guest_pool_patch_fn patch, void* cookie)
+{
+    uint64_t start = aarch64_get_counter();
+
+    // Longest parked first, its caches are the coldest anyway
+    struct pool_slot* slot = NULL;
+    for (size_t i = 0; i < pool.num_slots; i++)
+    {
+        struct pool_slot* s = &pool.slots[i];
+        if (s->state == POOL_SLOT_READY && (!slot || s->since < slot->since)) slot = s;
+    }
+    if (!slot)
+    {
+        pool.stats.misses++;
+        return NULL;
+    }
+
+    slot->state = POOL_SLOT_ACQUIRED;
+    if (patch) patch(slot->guest, cookie);
+    sched_resume(slot->guest, false);
+
+    pool.stats.acquired++;
+    pool.stats.acquire_ticks += aarch64_get_counter() - start;
+    schedule_refill(0);
+    return slot->guest;
+}
+
+void guest_pool_release(struct guest* guest)
+{
+    struct pool_slot* slot = slot_of(guest);
+    if (!slot || slot->state != POOL_SLOT_ACQUIRED) return;
+
+    slot->state = guest_clear(guest) ? POOL_SLOT_EMPTY : POOL_SLOT_DRAINING;
+    schedule_refill(0);
+}
+
+bool guest_pool_hold(struct guest* guest, enum hvt_hypercall hc)
+{
+    struct pool_slot* slot = slot_of(guest);
+    if (!slot || slot->state != POOL_SLOT_WARMING) return false;
+
+    if (hc == pool.config.ready_on)
+    {
+        // Left stopped with pc on the hypercall, it is issued again on resume
+        guest_account(guest, GUEST_STATE_STOPPED, HVT_HYPERCALL_NONE);
+        if (sched_owns(guest)) sched_block(guest);
+        slot->state = POOL_SLOT_READY;
+        pool.stats.warmed++;
+        pool.stats.warm_ticks += aarch64_get_counter() - slot->since;
+        slot->since = aarch64_get_counter();
+        return true;
+    }
+    if (hc == HVT_HYPERCALL_HALT)
+    {
+        LOG_VMM("Pooled guest halted before its readiness point (vcpu_id=%ld)\n", guest->vcpu_id);
+        if (sched_owns(guest)) sched_block(guest);
+        slot->state = guest_clear(guest) ? POOL_SLOT_EMPTY : POOL_SLOT_DRAINING;
+        pool.stats.failures++;
+        schedule_refill(GUEST_POOL_RETRY_NS);
+        return true;
+    }
+    return false;
+}
+
+void guest_pool_refill(void)
+{
+    if (!pool.configured) return;
+
+    // Memory of a draining guest may still be written by the driver, it is only cleared and reused once its requests completed
+    for (size_t i = 0; i < pool.num_slots; i++)
+    {
+        struct pool_slot* slot = &pool.slots[i];
+        if (slot->state == POOL_SLOT_DRAINING && blk_queue_pending(slot->guest) == 0 && guest_clear(slot->guest))
+            slot->state = POOL_SLOT_EMPTY;
+    }
+    if (count(POOL_SLOT_DRAINING) > 0) schedule_refill(GUEST_POOL_RETRY_NS);
+
+    // One boot per call so other guests get to run in between, loading an image takes a while
+    size_t active = count(POOL_SLOT_READY) + count(POOL_SLOT_WARMING);
+    for (size_t i = 0; i < pool.num_slots && active < pool.config.spares; i++)
+    {
+        struct pool_slot* slot = &pool.slots[i];
+        if (slot->state != POOL_SLOT_EMPTY) continue;
+
+        if (!boot(slot))
+            schedule_refill(GUEST_POOL_RETRY_NS);
+        else if (active + 1 < pool.config.spares)
+            schedule_refill(0);
+        return;
+    }
+}
+
+size_t guest_pool_ready(void)
+{
+    return count(POOL_SLOT_READY);
+}
+
+void guest_pool_get_stats(struct guest_pool_stats* stats)
+{
+    *stats = pool.stats;
+    stats->ready = count(POOL_SLOT_READY);
+}
@@ -0,0 +1,106 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/aarch64/vgic.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static struct idle_state* state_of(struct guest* guest)
+{
+    return &guest->idle;
+}
+
+static void idle_deadline(void* arg)
+{
+    idle_wake(arg);
+}
+
+void idle_init(struct guest* guest)
+{
+    timer_event_init(&state_of(guest)->wake_event, idle_deadline, guest);
+}
+
+// Returns the guest's own virtual timer deadline in VMM counter time, or TIMER_NO_DEADLINE if it has none armed
+static uint64_t guest_timer_deadline(struct guest* guest)
+{
+    if (timer_vcpu_armed(guest->vcpu_id)) return TIMER_NO_DEADLINE;
+
+    uint64_t ctl = microkit_vcpu_arm_read_reg(guest->vcpu_id, seL4_VCPUReg_CNTV_CTL);
+    if (!(ctl & CNTV_CTL_ENABLE) || (ctl & CNTV_CTL_IMASK)) return TIMER_NO_DEADLINE;
+
+    uint64_t cval = microkit_vcpu_arm_read_reg(guest->vcpu_id, seL4_VCPUReg_CNTV_CVAL);
+    uint64_t voff = microkit_vcpu_arm_read_reg(guest->vcpu_id, seL4_VCPUReg_CNTVOFF);
+    return cval + voff;
+}
+
+void idle_handle_wfx(struct guest* guest, bool is_wfe)
+{
+    struct idle_state* state = state_of(guest);
+
+    if (is_wfe)
+    {
+        state->stats.wfe++;
+        if (sched_owns(guest))
+            sched_yield(guest);
+        else
+            guest_resume(guest);
+        return;
+    }
+
+    state->stats.wfi++;
+
+    // WFI completes immediately if an interrupt is already pending
+    if (vgic_irq_pending(guest))
+    {
+        sched_resume(guest, true);
+        return;
+    }
+
+    microkit_vcpu_stop(guest->vcpu_id);
+    guest_account(guest, GUEST_STATE_IDLE, HVT_HYPERCALL_NONE);
+    state->idle = true;
+    state->stats.idled++;
+
+    uint64_t deadline = guest_timer_deadline(guest);
+    if (deadline != TIMER_NO_DEADLINE) timer_add(&state->wake_event, deadline);
+
+    if (sched_owns(guest))
+        sched_block(guest);
+    else
+        timer_program();
+}
+
+void idle_wake(struct guest* guest)
+{
+    struct idle_state* state = state_of(guest);
+    if (!state->idle) return;
+
+    state->idle = false;
+    state->stats.wakeups++;
+    timer_cancel(&state->wake_event);
+
+    sched_resume(guest, true);
+}
+
+bool idle_is_idle(struct guest* guest)
+{
+    return state_of(guest)->idle;
+}
+
+void idle_cancel(struct guest* guest)
+{
+    struct idle_state* state = state_of(guest);
+
+    state->idle = false;
+    timer_cancel(&state->wake_event);
+}
+
+void idle_get_stats(struct guest* guest, struct idle_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
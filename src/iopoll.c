@@ -0,0 +1,77 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/iopoll.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static struct iopoll_state* state_of(struct guest* guest)
+{
+    return &guest->iopoll;
+}
+
+void iopoll_enable(struct guest* guest, uint64_t max_ns)
+{
+    struct iopoll_state* state = state_of(guest);
+
+    state->max = aarch64_ns_to_ticks(max_ns);
+    state->window = state->max / 4;
+    state->latency = 0;
+    state->started = 0;
+}
+
+bool iopoll_wait(struct guest* guest, iopoll_fn poll, void* cookie)
+{
+    struct iopoll_state* state = state_of(guest);
+    if (state->max == 0) return false;
+
+    uint64_t start = aarch64_get_counter();
+    state->started = start;
+    state->stats.polls++;
+
+    bool done = false;
+    uint64_t now = start;
+    while (!done && now - start < state->window)
+    {
+        done = poll(guest, cookie);
+        now = aarch64_get_counter();
+    }
+
+    state->stats.poll_ticks += now - start;
+    if (done)
+        state->stats.hits++;
+    else
+        state->stats.misses++;
+    return done;
+}
+
+void iopoll_complete(struct guest* guest)
+{
+    struct iopoll_state* state = state_of(guest);
+    if (state->started == 0) return;
+
+    uint64_t sample = aarch64_get_counter() - state->started;
+    state->started = 0;
+
+    if (state->latency == 0)
+        state->latency = sample;
+    else
+        state->latency = state->latency - (state->latency >> IOPOLL_EWMA_SHIFT) + (sample >> IOPOLL_EWMA_SHIFT);
+
+    uint64_t target = state->latency + state->latency / 2;
+    if (target <= state->max)
+        state->window = target;
+    else
+        state->window /= 2;
+}
+
+void iopoll_get_stats(struct guest* guest, struct iopoll_stats* stats)
+{
+    struct iopoll_state* state = state_of(guest);
+
+    *stats = state->stats;
+    stats->window_ns = aarch64_ticks_to_ns(state->window);
+    stats->latency_ns = aarch64_ticks_to_ns(state->latency);
+}
@@ -0,0 +1,80 @@
+#include <solo5libvmm/lz4.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+
+// Reads an LZ4 extended length (sequence of 255 bytes terminated by a byte < 255) and adds it to (*len). Returns false on truncated input
+// or size_t overflow
+static inline bool read_ext_len(const uint8_t** ip, const uint8_t* iend, size_t* len)
+{
+    uint8_t b;
+    do
+    {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        if (__builtin_add_overflow(*len, b, len)) return false;
+    } while (b == 255);
+
+    return true;
+}
+
+bool lz4_decompress(const uint8_t* src, size_t src_size, uint8_t* dst, size_t dst_capacity, size_t* out_size)
+{
+    const uint8_t* ip = src;
+    const uint8_t* const iend = src + src_size;
+    uint8_t* op = dst;
+    uint8_t* const oend = dst + dst_capacity;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+
+        // Literal run
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_ext_len(&ip, iend, &lit_len)) return false;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return false;
+        memcpy(op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        // Last sequence of a block is literals only
+        if (ip == iend) break;
+
+        // Match, offset is relative to current output position and may not reach before start of the output buffer
+        if (iend - ip < 2) return false;
+        size_t offset = (size_t)ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return false;
+
+        size_t match_len = token & 15;
+        if (match_len == 15 && !read_ext_len(&ip, iend, &match_len)) return false;
+        match_len += LZ4_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return false;
+
+        const uint8_t* match = op - offset;
+        if (offset >= match_len)
+        {
+            memcpy(op, match, match_len);
+            op += match_len;
+        }
+        else if (offset == 1)
+        {
+            // Run of a single byte, most commonly zero padding
+            memset(op, *match, match_len);
+            op += match_len;
+        }
+        else
+        {
+            // Overlapping copy, must go forwards byte by byte to replicate the repeating pattern
+            uint8_t* mend = op + match_len;
+            while (op < mend) *op++ = *match++;
+        }
+    }
+
+    *out_size = (size_t)(op - dst);
+    return true;
+}
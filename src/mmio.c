@@ -0,0 +1,111 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/mmio.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct mmio_state* state_of(struct guest* guest)
+{
+    return &guest->mmio;
+}
+
+// Returns index of the first region with base > addr
+static size_t upper_bound(struct mmio_state* state, uint64_t addr)
+{
+    size_t lo = 0;
+    size_t hi = state->num_regions;
+
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (state->regions[mid].base <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static struct mmio_region* find_region(struct mmio_state* state, uint64_t addr)
+{
+    size_t i = upper_bound(state, addr);
+    if (i == 0) return NULL;
+
+    struct mmio_region* region = &state->regions[i - 1];
+    return addr - region->base < region->size ? region : NULL;
+}
+
+bool mmio_register(struct guest* guest, uint64_t base, uint64_t size, mmio_read_fn read, mmio_write_fn write, void* cookie)
+{
+    struct mmio_state* state = state_of(guest);
+    const uint64_t window_end = AARCH64_MMIO_BASE + AARCH64_MMIO_SZ;
+    const uint64_t hypercall_end = HVT_HYPERCALL_ADDRESS((uint64_t)HVT_EXT_HYPERCALL_MAX);
+
+    if (size == 0 || base < hypercall_end || base >= window_end || size > window_end - base)
+    {
+        LOG_VMM("MMIO region outside MMIO window or overlapping hypercalls (base=0x%lx size=0x%lx)\n", base, size);
+        return false;
+    }
+    if (state->num_regions == MMIO_MAX_REGIONS)
+    {
+        LOG_VMM("Too many MMIO regions (max=%ld)\n", MMIO_MAX_REGIONS);
+        return false;
+    }
+
+    size_t i = upper_bound(state, base);
+    if ((i > 0 && base - state->regions[i - 1].base < state->regions[i - 1].size)
+        || (i < state->num_regions && state->regions[i].base - base < size))
+    {
+        LOG_VMM("MMIO region overlaps existing region (base=0x%lx size=0x%lx)\n", base, size);
+        return false;
+    }
+
+    memmove(&state->regions[i + 1], &state->regions[i], (state->num_regions - i) * sizeof(struct mmio_region));
+    state->regions[i] = (struct mmio_region){ .base = base, .size = size, .read = read, .write = write, .cookie = cookie };
+    state->num_regions++;
+    return true;
+}
+
+void mmio_unregister(struct guest* guest, uint64_t base)
+{
+    struct mmio_state* state = state_of(guest);
+    size_t i = upper_bound(state, base);
+
+    if (i == 0 || state->regions[i - 1].base != base) return;
+    i--;
+    memmove(&state->regions[i], &state->regions[i + 1], (state->num_regions - i - 1) * sizeof(struct mmio_region));
+    state->num_regions--;
+}
+
+bool mmio_access(struct guest* guest, uint64_t addr, size_t size, bool is_write, uint64_t* value)
+{
+    struct mmio_state* state = state_of(guest);
+    struct mmio_region* region = find_region(state, addr);
+
+    // Accesses straddling the end of a region are not emulated
+    if (!region || size > region->size - (addr - region->base)) return false;
+
+    uint64_t offset = addr - region->base;
+    if (is_write)
+    {
+        state->stats.writes++;
+        if (region->write) region->write(guest, offset, size, *value, region->cookie);
+    }
+    else
+    {
+        state->stats.reads++;
+        *value = region->read ? region->read(guest, offset, size, region->cookie) : 0;
+    }
+    return true;
+}
+
+void mmio_get_stats(struct guest* guest, struct mmio_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
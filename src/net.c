@@ -0,0 +1,769 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/csum.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/pending.h>
+#include <solo5libvmm/poll.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <solo5libvmm/vswitch.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ETH_TYPE_IPV4 0x0800
+#define ETH_TYPE_IPV6 0x86dd
+#define IPV4_MIN_HDR_SIZE 20
+#define IPV4_DF 0x4000
+#define IPV4_MF 0x2000
+#define IPV4_FRAG_OFFSET 0x1fff
+#define IPV4_MAX_HDR_SIZE 60
+#define IPV4_OPT_EOL 0
+#define IPV4_OPT_NOP 1
+#define IPV4_OPT_COPIED 0x80
+#define IPV6_HDR_SIZE 40
+#define IP_PROTO_TCP 6
+#define IP_PROTO_UDP 17
+#define TCP_MIN_HDR_SIZE 20
+#define TCP_FIN 0x01
+#define TCP_PSH 0x08
+#define TCP_CWR 0x80
+#define UDP_HDR_SIZE 8
+
+// Frames are built here one at a time while segmenting, the transmit function copies them out
+static uint8_t tx_frame[NET_ETH_HDR_SIZE + NET_MAX_MTU];
+
+static inline uint16_t get16(const uint8_t* p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get32(const uint8_t* p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static inline void put16(uint8_t* p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static inline void put32(uint8_t* p, uint32_t v)
+{
+    put16(p, (uint16_t)(v >> 16));
+    put16(p + 2, (uint16_t)v);
+}
+
+static uint32_t pseudo_header_sum(const uint8_t* ip, bool v6, uint8_t proto, size_t l4_len)
+{
+    // Source and destination addresses
+    uint32_t sum = v6 ? csum_partial(ip + 8, 32, 0) : csum_partial(ip + 12, 8, 0);
+    sum = csum_add16(sum, proto);
+    sum = csum_add16(sum, (uint16_t)(l4_len >> 16));
+    return csum_add16(sum, (uint16_t)l4_len);
+}
+
+static void set_ipv4_header(uint8_t* ip, size_t ip_hdr_len, size_t total_len, uint16_t id, uint16_t frag)
+{
+    put16(ip + 2, (uint16_t)total_len);
+    put16(ip + 4, id);
+    put16(ip + 6, frag);
+    put16(ip + 10, 0);
+    put16(ip + 10, csum_fold(csum_partial(ip, ip_hdr_len, 0)));
+}
+
+struct l4_info
+{
+    uint8_t* ip;
+    size_t ip_hdr_len;
+    bool v6;
+    uint8_t proto;
+    uint8_t* l4;
+    size_t l4_len;
+    bool fragment;                      // IPv4 fragment, the L4 checksum cannot be checked per frame
+};
+
+// Finds IP and TCP/UDP headers of an Ethernet frame, lengths come from the IP header. Returns false for anything else or truncated frames
+static bool parse_l4(uint8_t* frame, size_t len, struct l4_info* info)
+{
+    if (len < NET_ETH_HDR_SIZE) return false;
+
+    uint16_t type = get16(frame + 12);
+    uint8_t* ip = frame + NET_ETH_HDR_SIZE;
+    size_t avail = len - NET_ETH_HDR_SIZE;
+    size_t ip_len;
+
+    memset(info, 0, sizeof(struct l4_info));
+    info->ip = ip;
+    if (type == ETH_TYPE_IPV4 && avail >= IPV4_MIN_HDR_SIZE && (ip[0] >> 4) == 4)
+    {
+        info->ip_hdr_len = (size_t)(ip[0] & 0xf) * 4;
+        info->proto = ip[9];
+        info->fragment = (get16(ip + 6) & (IPV4_MF | IPV4_FRAG_OFFSET)) != 0;
+        ip_len = get16(ip + 2);
+    }
+    else if (type == ETH_TYPE_IPV6 && avail >= IPV6_HDR_SIZE && (ip[0] >> 4) == 6)
+    {
+        info->ip_hdr_len = IPV6_HDR_SIZE;
+        info->v6 = true;
+        info->proto = ip[6];
+        ip_len = IPV6_HDR_SIZE + get16(ip + 4);
+    }
+    else
+        return false;
+
+    if (info->ip_hdr_len < IPV4_MIN_HDR_SIZE || ip_len < info->ip_hdr_len || ip_len > avail) return false;
+    info->l4 = ip + info->ip_hdr_len;
+    info->l4_len = ip_len - info->ip_hdr_len;
+    return true;
+}
+
+// Offset of the checksum field in the L4 header, 0 if the protocol is not handled or the header is truncated
+static size_t l4_csum_offset(struct l4_info* info)
+{
+    if (info->fragment) return 0;
+    if (info->proto == IP_PROTO_TCP && info->l4_len >= TCP_MIN_HDR_SIZE) return 16;
+    if (info->proto == IP_PROTO_UDP && info->l4_len >= UDP_HDR_SIZE) return 6;
+    return 0;
+}
+
+// Fills IPv4 header and TCP/UDP checksums of a frame in place
+static void fill_checksums(uint8_t* frame, size_t len)
+{
+    struct l4_info info;
+    if (!parse_l4(frame, len, &info)) return;
+
+    if (!info.v6)
+    {
+        put16(info.ip + 10, 0);
+        put16(info.ip + 10, csum_fold(csum_partial(info.ip, info.ip_hdr_len, 0)));
+    }
+
+    size_t offset = l4_csum_offset(&info);
+    if (!offset) return;
+
+    put16(info.l4 + offset, 0);
+    uint16_t csum = csum_fold(csum_partial(info.l4, info.l4_len, pseudo_header_sum(info.ip, info.v6, info.proto, info.l4_len)));
+    // A zero UDP checksum means none, the computed value 0 is sent as its ones' complement equivalent
+    if (info.proto == IP_PROTO_UDP && csum == 0) csum = 0xffff;
+    put16(info.l4 + offset, csum);
+}
+
+// Returns false if a frame carries a wrong IPv4 header or TCP/UDP checksum, frames that cannot be checked pass
+static bool verify_checksums(const uint8_t* frame, size_t len)
+{
+    struct l4_info info;
+    if (!parse_l4((uint8_t*)frame, len, &info)) return true;
+
+    if (!info.v6 && csum_fold(csum_partial(info.ip, info.ip_hdr_len, 0)) != 0) return false;
+
+    size_t offset = l4_csum_offset(&info);
+    if (!offset) return true;
+    if (info.proto == IP_PROTO_UDP && !info.v6 && get16(info.l4 + offset) == 0) return true;
+
+    return csum_fold(csum_partial(info.l4, info.l4_len, pseudo_header_sum(info.ip, info.v6, info.proto, info.l4_len))) == 0;
+}
+
+static struct net_state* state_of(struct guest* guest)
+{
+    return &guest->net;
+}
+
+static struct net_rx_queue* queue_of(struct guest* guest, uint64_t handle)
+{
+    struct net_state* state = state_of(guest);
+
+    for (size_t i = 0; i < NET_MAX_QUEUES; i++)
+        if (state->queues[i].used && state->queues[i].handle == handle) return &state->queues[i];
+    return NULL;
+}
+
+static void notify_ready(struct net_rx_queue* q)
+{
+    timer_cancel(&q->coalesce);
+    if (q->signalled) return;
+
+    q->signalled = true;
+    q->stats.signals++;
+    poll_set_ready(q->guest, q->handle);
+}
+
+static void coalesce_expired(void* arg)
+{
+    struct net_rx_queue* q = arg;
+    if (q->count > 0) notify_ready(q);
+}
+
+static struct net_rx_packet pop(struct net_rx_queue* q)
+{
+    struct net_rx_packet pkt = q->packets[q->head];
+
+    q->head = (q->head + 1) % NET_RX_MAX_DEPTH;
+    q->count--;
+    if (q->count == 0)
+    {
+        // Drained, next arrival starts a new coalescing round
+        timer_cancel(&q->coalesce);
+        q->signalled = false;
+        poll_clear_ready(q->guest, q->handle);
+    }
+    return pkt;
+}
+
+static void release(struct net_rx_queue* q, struct net_rx_packet* pkt)
+{
+    if (pkt->release) pkt->release(q->guest, q->handle, pkt->cookie);
+}
+
+// Copies the next packet that fits into dst, dropping ones that do not. Returns packet length or 0 if the queue ran empty
+static size_t deliver(struct net_rx_queue* q, uint8_t* dst, size_t capacity)
+{
+    while (q->count > 0)
+    {
+        struct net_rx_packet pkt = pop(q);
+        bool fits = pkt.len <= capacity;
+
+        if ((state_of(q->guest)->offload[q->handle] & NET_OFFLOAD_CSUM_RX) && !verify_checksums(pkt.data, pkt.len))
+        {
+            q->stats.csum_errors++;
+            release(q, &pkt);
+            continue;
+        }
+
+        if (fits)
+        {
+            memcpy(dst, pkt.data, pkt.len);
+            q->stats.delivered++;
+        }
+        else
+            q->stats.truncated++;
+        release(q, &pkt);
+
+        if (fits) return pkt.len;
+    }
+    return 0;
+}
+
+bool net_rx_init(struct guest* guest, uint64_t handle, const struct net_rx_config* config, net_rx_release_fn release_fn)
+{
+    struct net_state* state = state_of(guest);
+
+    if (handle >= MFT_MAX_ENTRIES || queue_of(guest, handle))
+    {
+        LOG_VMM("Invalid or duplicate net handle (handle=%ld)\n", handle);
+        return false;
+    }
+    if (config->depth == 0 || config->depth > NET_RX_MAX_DEPTH)
+    {
+        LOG_VMM("Net RX queue depth must be 1-%ld (depth=%ld)\n", NET_RX_MAX_DEPTH, config->depth);
+        return false;
+    }
+
+    for (size_t i = 0; i < NET_MAX_QUEUES; i++)
+    {
+        struct net_rx_queue* q = &state->queues[i];
+        if (q->used) continue;
+
+        memset(q, 0, sizeof(struct net_rx_queue));
+        q->guest = guest;
+        q->used = true;
+        q->handle = handle;
+        q->config = *config;
+        if (q->config.coalesce_packets == 0) q->config.coalesce_packets = 1;
+        q->release = release_fn;
+        timer_event_init(&q->coalesce, coalesce_expired, q);
+        return true;
+    }
+
+    LOG_VMM("Too many net RX queues (max=%ld)\n", NET_MAX_QUEUES);
+    return false;
+}
+
+static void drop_all(struct net_rx_queue* q)
+{
+    while (q->count > 0)
+    {
+        struct net_rx_packet pkt = pop(q);
+        release(q, &pkt);
+    }
+}
+
+void net_rx_deinit(struct guest* guest, uint64_t handle)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+    if (!q) return;
+
+    drop_all(q);
+    timer_cancel(&q->coalesce);
+    q->used = false;
+}
+
+static bool push(struct net_rx_queue* q, struct net_rx_packet pkt)
+{
+    if (q->count == q->config.depth)
+    {
+        q->stats.dropped++;
+        if (q->config.overflow == NET_OVERFLOW_DROP_NEW)
+        {
+            release(q, &pkt);
+            return false;
+        }
+
+        struct net_rx_packet old = q->packets[q->head];
+        q->head = (q->head + 1) % NET_RX_MAX_DEPTH;
+        q->count--;
+        release(q, &old);
+    }
+
+    q->packets[(q->head + q->count) % NET_RX_MAX_DEPTH] = pkt;
+    q->count++;
+    q->stats.packets++;
+
+    if (q->signalled) return true;
+    if (q->count >= q->config.coalesce_packets || q->config.coalesce_ns == 0)
+        notify_ready(q);
+    else if (!q->coalesce.armed)
+        timer_add(&q->coalesce, aarch64_get_counter() + aarch64_ns_to_ticks(q->config.coalesce_ns));
+
+    return true;
+}
+
+bool net_rx_push(struct guest* guest, uint64_t handle, const void* data, size_t len, void* cookie)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+    if (!q) return false;
+
+    return push(q, (struct net_rx_packet){ .data = data, .len = len, .release = q->release, .cookie = cookie });
+}
+
+bool net_rx_push_with(struct guest* guest, uint64_t handle, const void* data, size_t len, net_rx_release_fn release_fn, void* cookie)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+    if (!q)
+    {
+        if (release_fn) release_fn(guest, handle, cookie);
+        return false;
+    }
+
+    return push(q, (struct net_rx_packet){ .data = data, .len = len, .release = release_fn, .cookie = cookie });
+}
+
+bool net_rx_direct(struct guest* guest, uint64_t handle, const void* data, size_t len)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+    if (!q || q->count > 0) return false;
+
+    pending_tag_t tag = pending_find(guest, HVT_HYPERCALL_NET_READ, handle);
+    const struct pending_op* op = pending_get(tag);
+    if (!op) return false;
+
+    q->stats.packets++;
+    if ((state_of(guest)->offload[handle] & NET_OFFLOAD_CSUM_RX) && !verify_checksums(data, len))
+    {
+        q->stats.csum_errors++;
+        return true;
+    }
+    if (len > op->len)
+    {
+        q->stats.truncated++;
+        return true;
+    }
+
+    memcpy(op->data, data, len);
+    q->stats.delivered++;
+    pending_complete(tag, HVT_RESULT_OK, len);
+    return true;
+}
+
+void net_read_handle(struct guest* guest, struct hvt_hc_net_read* hc)
+{
+    struct net_rx_queue* q = queue_of(guest, hc->handle);
+    uint8_t* dst = guest_ptr(guest, hc->data, hc->len);
+
+    if (!q || !dst)
+        hc->ret = HVT_RESULT_EINVAL;
+    else
+    {
+        q->stats.reads++;
+        size_t len = deliver(q, dst, hc->len);
+        hc->len = len;
+        hc->ret = len ? HVT_RESULT_OK : HVT_RESULT_AGAIN;
+    }
+
+    sched_resume(guest, false);
+}
+
+void net_readv_handle(struct guest* guest, struct hvt_hc_net_readv* hc)
+{
+    struct net_rx_queue* q = queue_of(guest, hc->handle);
+    struct hvt_net_iov* iov = NULL;
+
+    hc->npackets = 0;
+    if (q && hc->iovcnt <= NET_RX_MAX_DEPTH) iov = guest_ptr(guest, hc->iov, hc->iovcnt * sizeof(struct hvt_net_iov));
+    if (!iov)
+    {
+        hc->ret = HVT_RESULT_EINVAL;
+        return;
+    }
+
+    q->stats.reads++;
+    hc->ret = HVT_RESULT_OK;
+    for (uint64_t i = 0; i < hc->iovcnt && q->count > 0; i++)
+    {
+        uint64_t capacity = iov[i].len;
+        uint8_t* dst = guest_ptr(guest, iov[i].data, capacity);
+        if (!dst)
+        {
+            hc->ret = HVT_RESULT_EINVAL;
+            break;
+        }
+
+        size_t len = deliver(q, dst, capacity);
+        if (len == 0) break;
+        iov[i].len = len;
+        hc->npackets++;
+    }
+
+    if (hc->npackets == 0 && hc->ret == HVT_RESULT_OK) hc->ret = HVT_RESULT_AGAIN;
+}
+
+size_t net_rx_pending(struct guest* guest, uint64_t handle)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+    return q ? q->count : 0;
+}
+
+void net_rx_flush(struct guest* guest)
+{
+    struct net_state* state = state_of(guest);
+
+    for (size_t i = 0; i < NET_MAX_QUEUES; i++)
+    {
+        struct net_rx_queue* q = &state->queues[i];
+        if (!q->used) continue;
+
+        drop_all(q);
+        timer_cancel(&q->coalesce);
+    }
+}
+
+void net_rx_get_stats(struct guest* guest, uint64_t handle, struct net_rx_stats* stats)
+{
+    struct net_rx_queue* q = queue_of(guest, handle);
+
+    if (q)
+        *stats = q->stats;
+    else
+        memset(stats, 0, sizeof(struct net_rx_stats));
+}
+
+static struct net_tx_port* port_of(struct guest* guest, uint64_t handle)
+{
+    struct net_state* state = state_of(guest);
+
+    for (size_t i = 0; i < NET_MAX_QUEUES; i++)
+        if (state->ports[i].used && state->ports[i].handle == handle) return &state->ports[i];
+    return NULL;
+}
+
+static void send_frame(struct guest* guest, struct net_tx_port* port, const uint8_t* data, size_t len, uint64_t* nframes)
+{
+    // Frames for guests on the same virtual switch never reach the driver
+    if (!vswitch_forward(guest, port->handle, data, len))
+        port->tx(guest, port->handle, data, len, port->cookie);
+    port->stats.frames++;
+    port->stats.bytes += len;
+    (*nframes)++;
+}
+
+static int lso_tcp(struct guest* guest, struct net_tx_port* port, const uint8_t* frame, size_t len, size_t ip_hdr_len, bool v6, uint64_t mss,
+    uint64_t* nframes)
+{
+    const uint8_t* tcp = frame + NET_ETH_HDR_SIZE + ip_hdr_len;
+    if (len < NET_ETH_HDR_SIZE + ip_hdr_len + TCP_MIN_HDR_SIZE) return HVT_RESULT_EINVAL;
+
+    size_t tcp_hdr_len = (size_t)(tcp[12] >> 4) * 4;
+    size_t hdr_len = NET_ETH_HDR_SIZE + ip_hdr_len + tcp_hdr_len;
+    if (tcp_hdr_len < TCP_MIN_HDR_SIZE || len < hdr_len || port->mtu <= ip_hdr_len + tcp_hdr_len) return HVT_RESULT_EINVAL;
+
+    size_t payload = len - hdr_len;
+    size_t max_mss = port->mtu - ip_hdr_len - tcp_hdr_len;
+    if (mss == 0 || mss > max_mss) mss = max_mss;
+
+    const uint8_t* ip = frame + NET_ETH_HDR_SIZE;
+    uint16_t id = v6 ? 0 : get16(ip + 4);
+    uint32_t seq = get32(tcp + 4);
+    size_t offset = 0;
+    do
+    {
+        size_t chunk = payload - offset < mss ? payload - offset : mss;
+        uint8_t* out_ip = tx_frame + NET_ETH_HDR_SIZE;
+        uint8_t* out_tcp = out_ip + ip_hdr_len;
+
+        memcpy(tx_frame, frame, hdr_len);
+        memcpy(tx_frame + hdr_len, frame + hdr_len + offset, chunk);
+
+        if (v6)
+            put16(out_ip + 4, (uint16_t)(tcp_hdr_len + chunk));
+        else
+            set_ipv4_header(out_ip, ip_hdr_len, ip_hdr_len + tcp_hdr_len + chunk, (uint16_t)(id + *nframes), get16(ip + 6));
+
+        // FIN and PSH belong to the last segment, CWR to the first
+        put32(out_tcp + 4, seq + (uint32_t)offset);
+        if (offset + chunk < payload) out_tcp[13] &= ~(TCP_FIN | TCP_PSH);
+        if (offset > 0) out_tcp[13] &= ~TCP_CWR;
+        put16(out_tcp + 16, 0);
+        uint32_t sum = pseudo_header_sum(out_ip, v6, IP_PROTO_TCP, tcp_hdr_len + chunk);
+        put16(out_tcp + 16, csum_fold(csum_partial(out_tcp, tcp_hdr_len + chunk, sum)));
+
+        send_frame(guest, port, tx_frame, hdr_len + chunk, nframes);
+        offset += chunk;
+    } while (offset < payload);
+
+    return HVT_RESULT_OK;
+}
+
+// Builds the IPv4 header of the fragments after the first, RFC 791 only repeats options with the copied flag set there. Returns its length
+// or 0 if the options are malformed
+static size_t ipv4_fragment_header(const uint8_t* ip, size_t ip_hdr_len, uint8_t* out)
+{
+    size_t len = IPV4_MIN_HDR_SIZE;
+    memcpy(out, ip, IPV4_MIN_HDR_SIZE);
+
+    for (size_t i = IPV4_MIN_HDR_SIZE; i < ip_hdr_len && ip[i] != IPV4_OPT_EOL;)
+    {
+        if (ip[i] == IPV4_OPT_NOP)
+        {
+            i++;
+            continue;
+        }
+
+        if (ip_hdr_len - i < 2 || ip[i + 1] < 2 || ip[i + 1] > ip_hdr_len - i) return 0;
+        if (ip[i] & IPV4_OPT_COPIED)
+        {
+            memcpy(out + len, ip + i, ip[i + 1]);
+            len += ip[i + 1];
+        }
+        i += ip[i + 1];
+    }
+
+    // Header length counts 32 bit words, the option list is padded with end of list bytes
+    while (len % 4) out[len++] = IPV4_OPT_EOL;
+    out[0] = (uint8_t)((out[0] & 0xf0) | (len / 4));
+    return len;
+}
+
+static int lso_udp(struct guest* guest, struct net_tx_port* port, const uint8_t* frame, size_t len, size_t ip_hdr_len, uint64_t* nframes)
+{
+    const uint8_t* ip = frame + NET_ETH_HDR_SIZE;
+    const uint8_t* udp = ip + ip_hdr_len;
+    size_t hdr_len = NET_ETH_HDR_SIZE + ip_hdr_len;
+    if (len < hdr_len + UDP_HDR_SIZE || port->mtu < ip_hdr_len + 8) return HVT_RESULT_EINVAL;
+
+    uint16_t frag = get16(ip + 6);
+    size_t datagram = len - hdr_len;
+    // Guest must not have fragmented already, and must allow fragmentation if it is needed
+    if ((frag & (IPV4_MF | IPV4_FRAG_OFFSET)) || (datagram > port->mtu - ip_hdr_len && (frag & IPV4_DF))) return HVT_RESULT_EINVAL;
+
+    // UDP length and checksum cover the whole datagram and only appear in the first fragment
+    uint8_t udp_hdr[UDP_HDR_SIZE];
+    memcpy(udp_hdr, udp, UDP_HDR_SIZE);
+    put16(udp_hdr + 4, (uint16_t)datagram);
+    put16(udp_hdr + 6, 0);
+    uint32_t sum = pseudo_header_sum(ip, false, IP_PROTO_UDP, datagram);
+    sum = csum_partial(udp + UDP_HDR_SIZE, datagram - UDP_HDR_SIZE, csum_partial(udp_hdr, UDP_HDR_SIZE, sum));
+    uint16_t csum = csum_fold(sum);
+    put16(udp_hdr + 6, csum ? csum : 0xffff);
+
+    bool fragmented = datagram > port->mtu - ip_hdr_len;
+    uint8_t frag_ip[IPV4_MAX_HDR_SIZE];
+    size_t frag_ip_len = fragmented ? ipv4_fragment_header(ip, ip_hdr_len, frag_ip) : ip_hdr_len;
+    if (!frag_ip_len) return HVT_RESULT_EINVAL;
+
+    size_t offset = 0;
+    do
+    {
+        // Later fragments may carry a shorter header, and so more data
+        const uint8_t* out_ip = offset ? frag_ip : ip;
+        size_t out_ip_len = offset ? frag_ip_len : ip_hdr_len;
+        size_t max_frag = ((port->mtu - out_ip_len) / 8) * 8;
+        size_t out_hdr_len = NET_ETH_HDR_SIZE + out_ip_len;
+
+        size_t chunk = datagram - offset;
+        if (fragmented && chunk > max_frag) chunk = max_frag;
+        bool last = offset + chunk == datagram;
+
+        memcpy(tx_frame, frame, NET_ETH_HDR_SIZE);
+        memcpy(tx_frame + NET_ETH_HDR_SIZE, out_ip, out_ip_len);
+        memcpy(tx_frame + out_hdr_len, udp + offset, chunk);
+        if (offset == 0) memcpy(tx_frame + out_hdr_len, udp_hdr, UDP_HDR_SIZE);
+
+        uint16_t out_frag = (uint16_t)((frag & IPV4_DF) | (offset / 8) | (last ? 0 : IPV4_MF));
+        set_ipv4_header(tx_frame + NET_ETH_HDR_SIZE, out_ip_len, out_ip_len + chunk, get16(ip + 4), out_frag);
+
+        send_frame(guest, port, tx_frame, out_hdr_len + chunk, nframes);
+        offset += chunk;
+    } while (offset < datagram);
+
+    return HVT_RESULT_OK;
+}
+
+static int lso_send(struct guest* guest, struct net_tx_port* port, const uint8_t* frame, size_t len, uint64_t mss, uint64_t* nframes)
+{
+    if (len < NET_ETH_HDR_SIZE) return HVT_RESULT_EINVAL;
+
+    const uint8_t* ip = frame + NET_ETH_HDR_SIZE;
+    uint16_t type = get16(frame + 12);
+    size_t ip_hdr_len = 0;
+    uint8_t proto = 0;
+
+    if (type == ETH_TYPE_IPV4 && len >= NET_ETH_HDR_SIZE + IPV4_MIN_HDR_SIZE && (ip[0] >> 4) == 4)
+    {
+        ip_hdr_len = (size_t)(ip[0] & 0xf) * 4;
+        proto = ip[9];
+        if (ip_hdr_len < IPV4_MIN_HDR_SIZE || len < NET_ETH_HDR_SIZE + ip_hdr_len) return HVT_RESULT_EINVAL;
+    }
+    else if (type == ETH_TYPE_IPV6 && len >= NET_ETH_HDR_SIZE + IPV6_HDR_SIZE && (ip[0] >> 4) == 6)
+    {
+        ip_hdr_len = IPV6_HDR_SIZE;
+        proto = ip[6];
+    }
+
+    if (ip_hdr_len && proto == IP_PROTO_TCP) return lso_tcp(guest, port, frame, len, ip_hdr_len, type == ETH_TYPE_IPV6, mss, nframes);
+    if (ip_hdr_len && proto == IP_PROTO_UDP && type == ETH_TYPE_IPV4) return lso_udp(guest, port, frame, len, ip_hdr_len, nframes);
+
+    // Anything else is sent as is if it fits
+    if (len > NET_ETH_HDR_SIZE + (size_t)port->mtu) return HVT_RESULT_EINVAL;
+    send_frame(guest, port, frame, len, nframes);
+    return HVT_RESULT_OK;
+}
+
+bool net_tx_init(struct guest* guest, uint64_t handle, uint16_t mtu, net_tx_fn tx, void* cookie)
+{
+    struct net_state* state = state_of(guest);
+
+    if (handle >= MFT_MAX_ENTRIES || port_of(guest, handle) || !tx)
+    {
+        LOG_VMM("Invalid or duplicate net handle (handle=%ld)\n", handle);
+        return false;
+    }
+    if (mtu < IPV6_HDR_SIZE + TCP_MIN_HDR_SIZE || mtu > NET_MAX_MTU)
+    {
+        LOG_VMM("Net MTU must be %d-%d (mtu=%d)\n", IPV6_HDR_SIZE + TCP_MIN_HDR_SIZE, NET_MAX_MTU, mtu);
+        return false;
+    }
+
+    for (size_t i = 0; i < NET_MAX_QUEUES; i++)
+    {
+        struct net_tx_port* port = &state->ports[i];
+        if (port->used) continue;
+
+        *port = (struct net_tx_port){ .used = true, .handle = handle, .mtu = mtu, .tx = tx, .cookie = cookie };
+        return true;
+    }
+
+    LOG_VMM("Too many net TX ports (max=%ld)\n", NET_MAX_QUEUES);
+    return false;
+}
+
+void net_tx_deinit(struct guest* guest, uint64_t handle)
+{
+    struct net_tx_port* port = port_of(guest, handle);
+    if (port) port->used = false;
+}
+
+void net_write_handle(struct guest* guest, struct hvt_hc_net_write* hc)
+{
+    struct net_tx_port* port = port_of(guest, hc->handle);
+    const uint8_t* data = guest_ptr(guest, hc->data, hc->len);
+    uint64_t nframes = 0;
+
+    if (!port || !data || hc->len < NET_ETH_HDR_SIZE || hc->len > NET_ETH_HDR_SIZE + (size_t)port->mtu)
+    {
+        if (port) port->stats.errors++;
+        hc->ret = HVT_RESULT_EINVAL;
+    }
+    else
+    {
+        port->stats.writes++;
+        if (state_of(guest)->offload[hc->handle] & NET_OFFLOAD_CSUM_TX)
+        {
+            // Guest buffer is left untouched, checksums go into the copy
+            memcpy(tx_frame, data, hc->len);
+            fill_checksums(tx_frame, hc->len);
+            data = tx_frame;
+        }
+        send_frame(guest, port, data, hc->len, &nframes);
+        hc->ret = HVT_RESULT_OK;
+    }
+
+    sched_resume(guest, false);
+}
+
+void net_write_lso_handle(struct guest* guest, struct hvt_hc_net_write_lso* hc)
+{
+    struct net_tx_port* port = port_of(guest, hc->handle);
+    const uint8_t* data = hc->len <= NET_LSO_MAX_SIZE ? guest_ptr(guest, hc->data, hc->len) : NULL;
+
+    hc->nframes = 0;
+    if (!port || !data)
+    {
+        if (port) port->stats.errors++;
+        hc->ret = HVT_RESULT_EINVAL;
+        return;
+    }
+
+    port->stats.writes++;
+    hc->ret = lso_send(guest, port, data, hc->len, hc->mss, &hc->nframes);
+    if (hc->ret != HVT_RESULT_OK)
+        port->stats.errors++;
+    else if (hc->nframes > 1)
+        port->stats.offloaded++;
+}
+
+void net_tx_get_stats(struct guest* guest, uint64_t handle, struct net_tx_stats* stats)
+{
+    struct net_tx_port* port = port_of(guest, handle);
+
+    if (port)
+        *stats = port->stats;
+    else
+        memset(stats, 0, sizeof(struct net_tx_stats));
+}
+
+bool net_set_offload(struct guest* guest, uint64_t handle, uint32_t flags)
+{
+    if (handle >= MFT_MAX_ENTRIES || (flags & ~(NET_OFFLOAD_CSUM_TX | NET_OFFLOAD_CSUM_RX)))
+    {
+        LOG_VMM("Invalid net offload flags (handle=%ld flags=0x%x)\n", handle, flags);
+        return false;
+    }
+
+    state_of(guest)->offload[handle] = flags;
+    return true;
+}
+
+void net_setup(struct guest* guest)
+{
+    struct net_state* state = state_of(guest);
+
+    struct mft* mft = guest_mft(guest);
+    if (!mft) return;
+
+    for (uint32_t i = 0; i < mft->entries; i++)
+    {
+        struct mft_entry* e = &mft->e[i];
+        if (e->type != MFT_DEV_NET_BASIC) continue;
+
+        struct mft_net_ext* net = (struct mft_net_ext*)&e->u;
+        struct net_tx_port* port = port_of(guest, i);
+        net->mtu = port ? port->mtu : NET_DEFAULT_MTU;
+        net->offload = state->offload[i];
+        if (port) net->offload |= MFT_NET_OFFLOAD_LSO;
+    }
+}
@@ -0,0 +1,224 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/iopoll.h>
+#include <solo5libvmm/pending.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+_Static_assert(PENDING_MAX_OPS > 0 && PENDING_MAX_OPS <= (1 << PENDING_INDEX_BITS), "Pending op index must fit a tag");
+
+#define INDEX_MASK ((1U << PENDING_INDEX_BITS) - 1)
+
+struct pending_slot
+{
+    bool used;
+    uint16_t generation;                // Bumped on every release, never 0 so no tag equals PENDING_TAG_INVALID
+    struct pending_op op;
+};
+
+struct pending_state
+{
+    struct pending_slot slots[PENDING_MAX_OPS];
+    uint16_t free[PENDING_MAX_OPS];     // Stack of free slot indices
+    size_t num_free;
+    bool initialised;
+    size_t count;
+    struct pending_stats stats;
+};
+
+static struct pending_state table;
+
+static void init_table(void)
+{
+    for (size_t i = 0; i < PENDING_MAX_OPS; i++)
+    {
+        table.slots[i].generation = 1;
+        table.free[i] = (uint16_t)(PENDING_MAX_OPS - 1 - i);
+    }
+    table.num_free = PENDING_MAX_OPS;
+    table.initialised = true;
+}
+
+static struct pending_slot* slot_of(pending_tag_t tag)
+{
+    uint32_t index = tag & INDEX_MASK;
+    if (index >= PENDING_MAX_OPS) return NULL;
+
+    struct pending_slot* slot = &table.slots[index];
+    return slot->used && slot->generation == tag >> PENDING_INDEX_BITS ? slot : NULL;
+}
+
+static pending_tag_t tag_of(struct pending_slot* slot)
+{
+    return ((pending_tag_t)slot->generation << PENDING_INDEX_BITS) | (pending_tag_t)(slot - table.slots);
+}
+
+static void release(struct pending_slot* slot)
+{
+    slot->used = false;
+    if (++slot->generation == 0) slot->generation = 1;
+    table.free[table.num_free++] = (uint16_t)(slot - table.slots);
+    table.count--;
+}
+
+// Fills handle, offset and buffer of the hypercalls the table supports
+static bool decode(struct guest* guest, enum hvt_hypercall hc, void* hc_data, struct pending_op* op)
+{
+    uint64_t buf;
+
+    switch (hc)
+    {
+        case HVT_HYPERCALL_BLOCK_READ:
+        {
+            struct hvt_hc_block_read* args = hc_data;
+            op->handle = args->handle;
+            op->offset = args->offset;
+            buf = args->data;
+            op->len = args->len;
+            break;
+        }
+        case HVT_HYPERCALL_BLOCK_WRITE:
+        {
+            struct hvt_hc_block_write* args = hc_data;
+            op->handle = args->handle;
+            op->offset = args->offset;
+            buf = args->data;
+            op->len = args->len;
+            break;
+        }
+        case HVT_HYPERCALL_NET_READ:
+        {
+            struct hvt_hc_net_read* args = hc_data;
+            op->handle = args->handle;
+            buf = args->data;
+            op->len = args->len;
+            break;
+        }
+        case HVT_HYPERCALL_NET_WRITE:
+        {
+            struct hvt_hc_net_write* args = hc_data;
+            op->handle = args->handle;
+            buf = args->data;
+            op->len = args->len;
+            break;
+        }
+        default:
+            return false;
+    }
+
+    op->data = guest_ptr(guest, buf, op->len);
+    return op->data != NULL;
+}
+
+pending_tag_t pending_add(struct guest* guest, enum hvt_hypercall hc, void* hc_data)
+{
+    if (!table.initialised) init_table();
+
+    struct pending_op op = { .guest = guest, .hc = hc, .hc_data = hc_data };
+    if (!decode(guest, hc, hc_data, &op)) return PENDING_TAG_INVALID;
+
+    if (table.num_free == 0)
+    {
+        table.stats.full++;
+        return PENDING_TAG_INVALID;
+    }
+
+    struct pending_slot* slot = &table.slots[table.free[--table.num_free]];
+    op.since = aarch64_get_counter();
+    slot->used = true;
+    slot->op = op;
+
+    table.count++;
+    table.stats.added++;
+    if (table.count > table.stats.max_pending) table.stats.max_pending = table.count;
+    return tag_of(slot);
+}
+
+const struct pending_op* pending_get(pending_tag_t tag)
+{
+    struct pending_slot* slot = slot_of(tag);
+    return slot ? &slot->op : NULL;
+}
+
+pending_tag_t pending_find(struct guest* guest, enum hvt_hypercall hc, uint64_t handle)
+{
+    struct pending_slot* oldest = NULL;
+
+    for (size_t i = 0; i < PENDING_MAX_OPS && table.count > 0; i++)
+    {
+        struct pending_slot* slot = &table.slots[i];
+        if (!slot->used || slot->op.guest != guest || slot->op.hc != hc || slot->op.handle != handle) continue;
+        if (!oldest || slot->op.since < oldest->op.since) oldest = slot;
+    }
+    return oldest ? tag_of(oldest) : PENDING_TAG_INVALID;
+}
+
+bool pending_complete(pending_tag_t tag, int ret, size_t len)
+{
+    struct pending_slot* slot = slot_of(tag);
+    if (!slot)
+    {
+        table.stats.stale++;
+        return false;
+    }
+
+    struct pending_op op = slot->op;
+    release(slot);
+    table.stats.completed++;
+    table.stats.latency_ticks += aarch64_get_counter() - op.since;
+
+    switch (op.hc)
+    {
+        case HVT_HYPERCALL_BLOCK_READ:
+            ((struct hvt_hc_block_read*)op.hc_data)->ret = ret;
+            break;
+        case HVT_HYPERCALL_BLOCK_WRITE:
+            ((struct hvt_hc_block_write*)op.hc_data)->ret = ret;
+            break;
+        case HVT_HYPERCALL_NET_READ:
+            ((struct hvt_hc_net_read*)op.hc_data)->len = len;
+            ((struct hvt_hc_net_read*)op.hc_data)->ret = ret;
+            break;
+        case HVT_HYPERCALL_NET_WRITE:
+            ((struct hvt_hc_net_write*)op.hc_data)->ret = ret;
+            break;
+        default:
+            break;
+    }
+
+    iopoll_complete(op.guest);
+    sched_resume(op.guest, true);
+    return true;
+}
+
+void pending_cancel(struct guest* guest)
+{
+    for (size_t i = 0; i < PENDING_MAX_OPS; i++)
+    {
+        struct pending_slot* slot = &table.slots[i];
+        if (!slot->used || slot->op.guest != guest) continue;
+
+        release(slot);
+        table.stats.cancelled++;
+    }
+}
+
+size_t pending_count(struct guest* guest)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < PENDING_MAX_OPS && table.count > 0; i++)
+        if (table.slots[i].used && table.slots[i].op.guest == guest) count++;
+    return count;
+}
+
+void pending_get_stats(struct pending_stats* stats)
+{
+    *stats = table.stats;
+}
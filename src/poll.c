@@ -0,0 +1,121 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/idle.h>
+#include <solo5libvmm/poll.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static void poll_timeout(void* arg);
+
+static inline struct poll_state* state_of(struct guest* guest)
+{
+    return &guest->poll;
+}
+
+static void complete(struct guest* guest)
+{
+    struct poll_state* state = state_of(guest);
+    struct hvt_hc_poll* hc = state->pending;
+
+    state->pending = NULL;
+    timer_cancel(&state->timeout);
+
+    hc->ready_set = state->ready_set;
+    hc->ret = __builtin_popcountll(state->ready_set);
+
+    sched_resume(guest, true);
+}
+
+static void poll_timeout(void* arg)
+{
+    struct guest* guest = arg;
+    struct poll_state* state = state_of(guest);
+    if (!state->pending) return;
+
+    state->stats.timeouts++;
+    complete(guest);
+}
+
+void poll_init(struct guest* guest)
+{
+    timer_event_init(&state_of(guest)->timeout, poll_timeout, guest);
+}
+
+void poll_handle(struct guest* guest, struct hvt_hc_poll* hc)
+{
+    struct poll_state* state = state_of(guest);
+
+    assert(state->pending == NULL);
+    state->stats.polls++;
+    state->pending = hc;
+
+    if (state->ready_set != 0 || hc->timeout_nsecs == 0)
+    {
+        state->stats.immediate++;
+        complete(guest);
+        return;
+    }
+
+    uint64_t now = aarch64_get_counter();
+    uint64_t deadline;
+    if (__builtin_add_overflow(now, aarch64_ns_to_ticks(hc->timeout_nsecs), &deadline)) deadline = TIMER_NO_DEADLINE - 1;
+
+    if (!timer_add(&state->timeout, deadline))
+    {
+        // No room to wait, behave as a zero timeout poll rather than blocking the guest forever
+        state->stats.timeouts++;
+        complete(guest);
+        return;
+    }
+
+    // Guest idles until woken, give the core away
+    if (sched_owns(guest)) sched_block(guest);
+}
+
+void poll_set_ready(struct guest* guest, uint64_t handle)
+{
+    assert(handle < 64);
+    struct poll_state* state = state_of(guest);
+
+    state->ready_set |= 1ULL << handle;
+    idle_wake(guest);
+    if (state->pending)
+    {
+        state->stats.woken++;
+        complete(guest);
+    }
+}
+
+void poll_clear_ready(struct guest* guest, uint64_t handle)
+{
+    assert(handle < 64);
+    state_of(guest)->ready_set &= ~(1ULL << handle);
+}
+
+uint64_t poll_ready_set(struct guest* guest)
+{
+    return state_of(guest)->ready_set;
+}
+
+bool poll_pending(struct guest* guest)
+{
+    return state_of(guest)->pending != NULL;
+}
+
+void poll_cancel(struct guest* guest)
+{
+    struct poll_state* state = state_of(guest);
+
+    state->pending = NULL;
+    timer_cancel(&state->timeout);
+}
+
+void poll_get_stats(struct guest* guest, struct poll_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
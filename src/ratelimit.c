@@ -0,0 +1,237 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/ratelimit.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/solo5/hvt_abi.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct ratelimit_state* state_of(struct guest* guest)
+{
+    return &guest->ratelimit;
+}
+
+static struct ratelimit_limit* find_limit(struct ratelimit_state* state, const char* name)
+{
+    for (size_t i = 0; i < state->num_limits; i++)
+        if (strncmp(state->limits[i].name, name, MFT_NAME_SIZE) == 0) return &state->limits[i];
+    return NULL;
+}
+
+static void bucket_init(struct ratelimit_bucket* b, uint64_t rate, uint64_t burst)
+{
+    b->rate = rate;
+    b->burst = (int64_t)(burst ? burst : rate);
+    b->tokens = b->burst;
+}
+
+static void bucket_refill(struct ratelimit_bucket* b, uint64_t ticks, uint64_t freq)
+{
+    if (b->rate == 0) return;
+
+    unsigned __int128 add = (unsigned __int128)ticks * b->rate / freq;
+    b->tokens = add >= (unsigned __int128)(b->burst - b->tokens) ? b->burst : b->tokens + (int64_t)add;
+}
+
+// Ticks until the bucket is out of debt
+static uint64_t bucket_wait(struct ratelimit_bucket* b, uint64_t freq)
+{
+    if (b->rate == 0 || b->tokens >= 0) return 0;
+    return (uint64_t)(((unsigned __int128)(-b->tokens) * freq + b->rate - 1) / b->rate);
+}
+
+static void refill(struct ratelimit_state* state)
+{
+    uint64_t now = aarch64_get_counter();
+    uint64_t freq = aarch64_get_counter_frequency();
+    uint64_t elapsed = now - state->last_refill;
+    state->last_refill = now;
+
+    for (size_t i = 0; i < state->num_limits; i++)
+    {
+        struct ratelimit_limit* limit = &state->limits[i];
+        if (!limit->bound) continue;
+
+        bucket_refill(&limit->bytes, elapsed, freq);
+        bucket_refill(&limit->ops, elapsed, freq);
+    }
+}
+
+static struct ratelimit_limit* find_bound(struct ratelimit_state* state, uint64_t handle)
+{
+    for (size_t i = 0; i < state->num_limits; i++)
+        if (state->limits[i].bound && state->limits[i].handle == handle) return &state->limits[i];
+    return NULL;
+}
+
+// Decodes device and size of the hypercalls that are limited
+static bool decode(enum hvt_hypercall hc, void* hc_data, uint64_t* handle, uint64_t* len)
+{
+    // Extension hypercall numbers lie outside enum hvt_hypercall
+    if ((uint64_t)hc == HVT_EXT_HYPERCALL_NET_WRITE_LSO)
+    {
+        *handle = ((struct hvt_hc_net_write_lso*)hc_data)->handle;
+        *len = ((struct hvt_hc_net_write_lso*)hc_data)->len;
+        return true;
+    }
+
+    switch (hc)
+    {
+        case HVT_HYPERCALL_NET_WRITE:
+            *handle = ((struct hvt_hc_net_write*)hc_data)->handle;
+            *len = ((struct hvt_hc_net_write*)hc_data)->len;
+            return true;
+        case HVT_HYPERCALL_BLOCK_READ:
+            *handle = ((struct hvt_hc_block_read*)hc_data)->handle;
+            *len = ((struct hvt_hc_block_read*)hc_data)->len;
+            return true;
+        case HVT_HYPERCALL_BLOCK_WRITE:
+            *handle = ((struct hvt_hc_block_write*)hc_data)->handle;
+            *len = ((struct hvt_hc_block_write*)hc_data)->len;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Winds pc back onto the hypercall store and resumes the guest so it issues the hypercall again
+static void retry(void* arg)
+{
+    struct guest* guest = arg;
+    struct ratelimit_state* state = state_of(guest);
+
+    seL4_UserContext regs;
+    seL4_Error err = seL4_TCB_ReadRegisters(BASE_VM_TCB_CAP + guest->vcpu_id, false, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word), &regs);
+    assert(err == seL4_NoError);
+    regs.pc -= 4;
+    err = seL4_TCB_WriteRegisters(BASE_VM_TCB_CAP + guest->vcpu_id, seL4_False, 0, 1, &regs);
+    assert(err == seL4_NoError);
+
+    state->stats.deferred_ticks += aarch64_get_counter() - state->deferred_since;
+    state->deferred_since = 0;
+
+    sched_resume(guest, true);
+}
+
+void ratelimit_init(struct guest* guest)
+{
+    timer_event_init(&state_of(guest)->retry_event, retry, guest);
+}
+
+bool ratelimit_set(struct guest* guest, const char* name, const struct ratelimit_config* config)
+{
+    struct ratelimit_state* state = state_of(guest);
+    struct ratelimit_limit* limit = find_limit(state, name);
+
+    if (!limit)
+    {
+        if (state->num_limits == RATELIMIT_MAX_LIMITS)
+        {
+            LOG_VMM("Too many rate limits (max=%ld)\n", RATELIMIT_MAX_LIMITS);
+            return false;
+        }
+        limit = &state->limits[state->num_limits++];
+        limit->bound = false;
+    }
+
+    limit->name = name;
+    limit->config = *config;
+    return true;
+}
+
+void ratelimit_clear(struct guest* guest, const char* name)
+{
+    struct ratelimit_state* state = state_of(guest);
+    struct ratelimit_limit* limit = find_limit(state, name);
+    if (!limit) return;
+
+    *limit = state->limits[--state->num_limits];
+}
+
+void ratelimit_setup(struct guest* guest)
+{
+    struct ratelimit_state* state = state_of(guest);
+
+    for (size_t i = 0; i < state->num_limits; i++)
+        state->limits[i].bound = false;
+    state->last_refill = aarch64_get_counter();
+
+    struct mft* mft = guest_mft(guest);
+    if (!mft) return;
+
+    for (size_t i = 0; i < state->num_limits; i++)
+    {
+        struct ratelimit_limit* limit = &state->limits[i];
+        uint32_t handle = 0;
+        while (handle < mft->entries && strncmp(mft->e[handle].name, limit->name, MFT_NAME_SIZE) != 0)
+            handle++;
+
+        if (handle == mft->entries)
+        {
+            LOG_VMM("No MFT entry for rate limit %s\n", limit->name);
+            continue;
+        }
+
+        limit->bound = true;
+        limit->handle = handle;
+        bucket_init(&limit->bytes, limit->config.bytes_per_sec, limit->config.bytes_burst);
+        bucket_init(&limit->ops, limit->config.ops_per_sec, limit->config.ops_burst);
+    }
+}
+
+bool ratelimit_admit(struct guest* guest, enum hvt_hypercall hc, void* hc_data)
+{
+    struct ratelimit_state* state = state_of(guest);
+    uint64_t handle;
+    uint64_t len;
+
+    if (!decode(hc, hc_data, &handle, &len)) return true;
+
+    struct ratelimit_limit* limit = find_bound(state, handle);
+    if (!limit) return true;
+    refill(state);
+
+    uint64_t freq = aarch64_get_counter_frequency();
+    uint64_t wait = bucket_wait(&limit->bytes, freq);
+    uint64_t ops_wait = bucket_wait(&limit->ops, freq);
+    if (ops_wait > wait) wait = ops_wait;
+
+    if (wait > 0)
+    {
+        state->stats.deferred++;
+        state->deferred_since = aarch64_get_counter();
+        if (!timer_add(&state->retry_event, state->deferred_since + wait))
+        {
+            // No room to wait, let it through rather than leaving the guest stopped for good
+            LOG_VMM("Timer queue full, rate limit not enforced\n");
+            state->deferred_since = 0;
+            return true;
+        }
+        return false;
+    }
+
+    if (limit->bytes.rate) limit->bytes.tokens -= (int64_t)len;
+    if (limit->ops.rate) limit->ops.tokens -= 1;
+    state->stats.admitted++;
+    return true;
+}
+
+void ratelimit_cancel(struct guest* guest)
+{
+    struct ratelimit_state* state = state_of(guest);
+
+    timer_cancel(&state->retry_event);
+    state->deferred_since = 0;
+}
+
+void ratelimit_get_stats(struct guest* guest, struct ratelimit_stats* stats)
+{
+    *stats = state_of(guest)->stats;
+}
@@ -0,0 +1,342 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+struct sched_queue
+{
+    struct sched_entity* head;
+    struct sched_entity* tail;
+};
+
+static struct sched_queue runq[SCHED_PRIO_COUNT];
+static struct sched_entity* current;
+static uint64_t slice_ticks;
+static uint64_t period_ticks;
+static uint64_t period_start;
+static uint64_t total_weight;
+static struct timer_event slice_event;
+
+static void enqueue(struct sched_entity* e)
+{
+    assert(!e->queued);
+    struct sched_queue* q = &runq[e->prio];
+
+    e->next = NULL;
+    e->prev = q->tail;
+    if (q->tail)
+        q->tail->next = e;
+    else
+        q->head = e;
+    q->tail = e;
+    e->queued = true;
+}
+
+static void dequeue(struct sched_entity* e)
+{
+    assert(e->queued);
+    struct sched_queue* q = &runq[e->prio];
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        q->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        q->tail = e->prev;
+    e->next = e->prev = NULL;
+    e->queued = false;
+}
+
+static struct sched_entity* pick_next(void)
+{
+    for (int p = 0; p < SCHED_PRIO_COUNT; p++)
+    {
+        struct sched_entity* e = runq[p].head;
+        if (e)
+        {
+            dequeue(e);
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static inline enum sched_prio credit_prio(struct sched_entity* e)
+{
+    return e->credit > 0 ? SCHED_PRIO_UNDER : SCHED_PRIO_OVER;
+}
+
+// Hands out credit for every accounting period elapsed since the last one, capped at one period's share so idle guests cannot hoard
+static void replenish(uint64_t now)
+{
+    if (total_weight == 0 || now - period_start < period_ticks) return;
+
+    uint64_t periods = (now - period_start) / period_ticks;
+    period_start += periods * period_ticks;
+
+    for (size_t i = 0; i < GUEST_MAX_VCPUS; i++)
+    {
+        struct guest* guest = guest_from_vcpu(i);
+        if (!guest || !guest->sched.guest) continue;
+        struct sched_entity* e = &guest->sched;
+
+        int64_t share = (int64_t)((period_ticks * e->weight) / total_weight);
+        e->credit += share * (int64_t)periods;
+        if (e->credit > share) e->credit = share;
+        if (e->credit < -share) e->credit = -share;
+
+        // Requeue waiting guests whose priority changed, boosted guests keep their boost until they run
+        if (e->queued && e->prio != SCHED_PRIO_BOOST && e->prio != credit_prio(e))
+        {
+            dequeue(e);
+            e->prio = credit_prio(e);
+            enqueue(e);
+        }
+    }
+}
+
+static void account(struct sched_entity* e, uint64_t now)
+{
+    uint64_t ran = now - e->run_start;
+    e->credit -= (int64_t)ran;
+    e->stats.run_ticks += ran;
+    e->run_start = now;
+}
+
+static void switch_to(struct sched_entity* e)
+{
+    current = e;
+    if (!e) return;
+
+    e->stats.slices++;
+    e->run_start = aarch64_get_counter();
+    timer_add(&slice_event, e->run_start + slice_ticks);
+    guest_resume(e->guest);
+}
+
+// Deschedules current guest, leaving it runnable at the back of its priority queue
+static void preempt_current(uint64_t now)
+{
+    struct sched_entity* e = current;
+
+    current = NULL;
+    guest_stop(e->guest);
+    timer_cancel(&slice_event);
+    account(e, now);
+    e->stats.preemptions++;
+    e->prio = credit_prio(e);
+    enqueue(e);
+}
+
+static inline struct sched_entity* entity_of(struct guest* guest)
+{
+    return &guest->sched;
+}
+
+static void slice_expired(void* arg)
+{
+    (void)arg;
+    sched_tick();
+}
+
+void sched_init(uint64_t slice_ns)
+{
+    timer_event_init(&slice_event, slice_expired, NULL);
+    slice_ticks = aarch64_ns_to_ticks(slice_ns);
+    if (slice_ticks == 0) slice_ticks = 1;
+    period_ticks = slice_ticks * SCHED_SLICES_PER_PERIOD;
+    period_start = aarch64_get_counter();
+}
+
+bool sched_add(struct guest* guest, uint32_t weight)
+{
+    struct sched_entity* e = entity_of(guest);
+    if (e->guest)
+    {
+        LOG_VMM("Guest (vcpu_id=%ld) already added to scheduler\n", guest->vcpu_id);
+        return false;
+    }
+    if (weight == 0)
+    {
+        LOG_VMM("Scheduler weight must be non-zero\n");
+        return false;
+    }
+
+    memset(e, 0, sizeof(struct sched_entity));
+    e->guest = guest;
+    e->weight = weight;
+    e->prio = SCHED_PRIO_OVER;
+    total_weight += weight;
+
+    return true;
+}
+
+void sched_remove(struct guest* guest)
+{
+    struct sched_entity* e = entity_of(guest);
+    if (!e->guest) return;
+
+    if (e == current)
+    {
+        guest_stop(guest);
+        timer_cancel(&slice_event);
+        account(e, aarch64_get_counter());
+        switch_to(pick_next());
+    }
+    else if (e->queued)
+        dequeue(e);
+
+    total_weight -= e->weight;
+    e->guest = NULL;
+}
+
+void sched_set_weight(struct guest* guest, uint32_t weight)
+{
+    struct sched_entity* e = entity_of(guest);
+    if (!e->guest || weight == 0) return;
+
+    total_weight = total_weight - e->weight + weight;
+    e->weight = weight;
+}
+
+bool sched_owns(struct guest* guest)
+{
+    return guest->sched.guest == guest;
+}
+
+void sched_wake(struct guest* guest, bool io_completion)
+{
+    struct sched_entity* e = entity_of(guest);
+    assert(e->guest == guest);
+
+    uint64_t now = aarch64_get_counter();
+    replenish(now);
+
+    if (e == current)
+    {
+        // Still holds the core, e.g. a synchronous hypercall was handled
+        guest_resume(guest);
+        return;
+    }
+    if (e->runnable) return;
+
+    e->runnable = true;
+    if (io_completion && e->credit >= 0)
+    {
+        e->prio = SCHED_PRIO_BOOST;
+        e->stats.boosts++;
+    }
+    else
+        e->prio = credit_prio(e);
+    enqueue(e);
+
+    if (!current)
+        switch_to(pick_next());
+    else if (e->prio == SCHED_PRIO_BOOST && current->prio != SCHED_PRIO_BOOST)
+    {
+        // I/O bound guest preempts a CPU bound one for low wakeup latency
+        preempt_current(now);
+        switch_to(pick_next());
+    }
+}
+
+void sched_resume(struct guest* guest, bool io_completion)
+{
+    if (sched_owns(guest))
+        sched_wake(guest, io_completion);
+    else
+        guest_resume(guest);
+}
+
+void sched_block(struct guest* guest)
+{
+    struct sched_entity* e = entity_of(guest);
+    assert(e->guest == guest);
+
+    e->runnable = false;
+    if (e == current)
+    {
+        uint64_t now = aarch64_get_counter();
+        timer_cancel(&slice_event);
+        account(e, now);
+        replenish(now);
+        switch_to(pick_next());
+    }
+    else if (e->queued)
+        dequeue(e);
+}
+
+static bool others_waiting(void)
+{
+    for (int p = 0; p < SCHED_PRIO_COUNT; p++)
+        if (runq[p].head) return true;
+    return false;
+}
+
+void sched_yield(struct guest* guest)
+{
+    struct sched_entity* e = entity_of(guest);
+    assert(e->guest == guest);
+
+    if (e == current && !others_waiting())
+    {
+        guest_resume(guest);
+        return;
+    }
+
+    // Not holding the core, it queues behind the guests already waiting instead of running alongside the current one
+    if (e != current)
+    {
+        sched_wake(guest, false);
+        return;
+    }
+
+    uint64_t now = aarch64_get_counter();
+    preempt_current(now);
+    replenish(now);
+    switch_to(pick_next());
+}
+
+void sched_tick(void)
+{
+    if (!current) return;
+
+    uint64_t now = aarch64_get_counter();
+    struct sched_entity* e = current;
+    account(e, now);
+    replenish(now);
+
+    // Keep running if nobody else is waiting, boost only lasts one slice
+    if (!others_waiting())
+    {
+        e->prio = credit_prio(e);
+        timer_add(&slice_event, now + slice_ticks);
+        return;
+    }
+
+    preempt_current(now);
+    switch_to(pick_next());
+}
+
+struct guest* sched_current(void)
+{
+    return current ? current->guest : NULL;
+}
+
+void sched_get_stats(struct guest* guest, struct sched_stats* stats)
+{
+    struct sched_entity* e = entity_of(guest);
+    uint64_t now = aarch64_get_counter();
+
+    *stats = e->stats;
+    stats->credit = e->credit;
+    if (e == current) stats->run_ticks += now - e->run_start;
+}
@@ -0,0 +1,104 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/hvt_ext.h>
+#include <solo5libvmm/shm.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+static struct shm_state* state_of(struct guest* guest)
+{
+    return &guest->shm;
+}
+
+static struct shm_window* find_window(struct shm_state* state, const char* name)
+{
+    for (size_t i = 0; i < state->num_windows; i++)
+        if (strncmp(state->windows[i].name, name, MFT_NAME_SIZE) == 0) return &state->windows[i];
+    return NULL;
+}
+
+bool shm_add_window(struct guest* guest, const char* name, uint64_t gpa, uint64_t size, void* vaddr)
+{
+    struct shm_state* state = state_of(guest);
+    const uint64_t align = AARCH64_GUEST_BLOCK_SIZE;
+
+    if (strlen(name) > MFT_NAME_MAX || find_window(state, name))
+    {
+        LOG_VMM("Invalid or duplicate shared memory window name (name=%s)\n", name);
+        return false;
+    }
+    if (size == 0 || gpa % align != 0 || size % align != 0 || gpa < AARCH64_SHM_BASE || gpa >= AARCH64_SHM_BASE + AARCH64_SHM_SZ
+        || size > AARCH64_SHM_BASE + AARCH64_SHM_SZ - gpa)
+    {
+        LOG_VMM("Shared memory window must be %ld byte aligned and inside 0x%lx-0x%lx (gpa=0x%lx size=0x%lx)\n", align, AARCH64_SHM_BASE,
+            AARCH64_SHM_BASE + AARCH64_SHM_SZ, gpa, size);
+        return false;
+    }
+    for (size_t i = 0; i < state->num_windows; i++)
+    {
+        struct shm_window* w = &state->windows[i];
+        if (gpa < w->gpa + w->size && w->gpa < gpa + size)
+        {
+            LOG_VMM("Shared memory window %s overlaps %s\n", name, w->name);
+            return false;
+        }
+    }
+    if (state->num_windows == SHM_MAX_WINDOWS)
+    {
+        LOG_VMM("Too many shared memory windows (max=%ld)\n", SHM_MAX_WINDOWS);
+        return false;
+    }
+
+    state->windows[state->num_windows++] = (struct shm_window){ .name = name, .gpa = gpa, .size = size, .vaddr = vaddr };
+    return true;
+}
+
+void shm_remove_window(struct guest* guest, const char* name)
+{
+    struct shm_state* state = state_of(guest);
+    struct shm_window* w = find_window(state, name);
+    if (!w) return;
+
+    *w = state->windows[--state->num_windows];
+}
+
+void shm_setup(struct guest* guest)
+{
+    struct shm_state* state = state_of(guest);
+
+    for (size_t i = 0; i < state->num_windows; i++)
+        setup_shm_mapping(guest->mem, state->windows[i].gpa, state->windows[i].size);
+
+    struct mft* mft = guest_mft(guest);
+    if (!mft) return;
+
+    for (uint32_t i = 0; i < mft->entries; i++)
+    {
+        struct mft_entry* e = &mft->e[i];
+        if (e->type != MFT_DEV_SHM_BASIC) continue;
+
+        struct shm_window* w = find_window(state, e->name);
+        struct mft_shm_basic* shm = (struct mft_shm_basic*)&e->u;
+        shm->addr = w ? w->gpa : 0;
+        shm->size = w ? w->size : 0;
+        e->attached = w != NULL;
+        if (!w) LOG_VMM("No shared memory window for MFT entry %s\n", e->name);
+    }
+}
+
+void* shm_ptr(struct guest* guest, uint64_t gpa, size_t size)
+{
+    struct shm_state* state = state_of(guest);
+
+    for (size_t i = 0; i < state->num_windows; i++)
+    {
+        struct shm_window* w = &state->windows[i];
+        if (gpa >= w->gpa && gpa - w->gpa < w->size && size <= w->size - (gpa - w->gpa)) return w->vaddr + (gpa - w->gpa);
+    }
+    return NULL;
+}
@@ -0,0 +1,159 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/sched.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define NO_VCPU ((size_t)-1)
+
+static struct timer_event* heap[TIMER_MAX_EVENTS];
+static size_t heap_size;
+
+// Virtual timer currently programmed, avoids rewriting VCpu registers when nothing changed
+static size_t armed_vcpu = NO_VCPU;
+static uint64_t armed_deadline = TIMER_NO_DEADLINE;
+
+static inline void heap_set(size_t i, struct timer_event* event)
+{
+    heap[i] = event;
+    event->index = i;
+}
+
+static void sift_up(size_t i)
+{
+    struct timer_event* event = heap[i];
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (heap[parent]->deadline <= event->deadline) break;
+        heap_set(i, heap[parent]);
+        i = parent;
+    }
+    heap_set(i, event);
+}
+
+static void sift_down(size_t i)
+{
+    struct timer_event* event = heap[i];
+    for (;;)
+    {
+        size_t child = 2 * i + 1;
+        if (child >= heap_size) break;
+        if (child + 1 < heap_size && heap[child + 1]->deadline < heap[child]->deadline) child++;
+        if (event->deadline <= heap[child]->deadline) break;
+        heap_set(i, heap[child]);
+        i = child;
+    }
+    heap_set(i, event);
+}
+
+static void heap_remove(struct timer_event* event)
+{
+    size_t i = event->index;
+    assert(i < heap_size && heap[i] == event);
+
+    heap_size--;
+    event->armed = false;
+    if (i == heap_size) return;
+
+    heap_set(i, heap[heap_size]);
+    if (i > 0 && heap[(i - 1) / 2]->deadline > heap[i]->deadline)
+        sift_up(i);
+    else
+        sift_down(i);
+}
+
+static size_t pick_timer_vcpu(void)
+{
+    struct guest* current = sched_current();
+    if (current) return current->vcpu_id;
+
+    for (size_t i = 0; i < GUEST_MAX_VCPUS; i++)
+    {
+        struct guest* guest = guest_from_vcpu(i);
+        if (guest && guest->acct.state == GUEST_STATE_RUNNING) return i;
+    }
+    return NO_VCPU;
+}
+
+void timer_program(void)
+{
+    uint64_t deadline = timer_next_deadline();
+    size_t vcpu = deadline == TIMER_NO_DEADLINE ? NO_VCPU : pick_timer_vcpu();
+
+    if (vcpu == armed_vcpu && deadline == armed_deadline) return;
+
+    if (armed_vcpu != NO_VCPU && vcpu != armed_vcpu) vcpu_vtimer_disarm(armed_vcpu);
+    armed_vcpu = vcpu;
+    armed_deadline = vcpu == NO_VCPU ? TIMER_NO_DEADLINE : deadline;
+    if (vcpu == NO_VCPU) return;
+
+    uint64_t now = aarch64_get_counter();
+    vcpu_vtimer_arm(vcpu, deadline > now ? deadline - now : 0);
+}
+
+bool timer_vcpu_armed(size_t vcpu_id)
+{
+    return armed_vcpu == vcpu_id;
+}
+
+void timer_event_init(struct timer_event* event, timer_fn fn, void* arg)
+{
+    event->deadline = TIMER_NO_DEADLINE;
+    event->fn = fn;
+    event->arg = arg;
+    event->index = 0;
+    event->armed = false;
+}
+
+bool timer_add(struct timer_event* event, uint64_t deadline)
+{
+    if (event->armed) heap_remove(event);
+    if (heap_size == TIMER_MAX_EVENTS)
+    {
+        LOG_VMM("Timer queue full (max=%ld)\n", TIMER_MAX_EVENTS);
+        return false;
+    }
+
+    event->deadline = deadline;
+    event->armed = true;
+    heap_set(heap_size++, event);
+    sift_up(event->index);
+
+    timer_program();
+    return true;
+}
+
+void timer_cancel(struct timer_event* event)
+{
+    if (!event->armed) return;
+    heap_remove(event);
+    timer_program();
+}
+
+uint64_t timer_next_deadline(void)
+{
+    return heap_size ? heap[0]->deadline : TIMER_NO_DEADLINE;
+}
+
+void timer_expire(void)
+{
+    // Fired timer is no longer pending in hardware
+    if (armed_vcpu != NO_VCPU) vcpu_vtimer_disarm(armed_vcpu);
+    armed_vcpu = NO_VCPU;
+    armed_deadline = TIMER_NO_DEADLINE;
+
+    uint64_t now = aarch64_get_counter();
+    while (heap_size && heap[0]->deadline <= now)
+    {
+        struct timer_event* event = heap[0];
+        heap_remove(event);
+        event->fn(event->arg);
+    }
+
+    timer_program();
+}
@@ -0,0 +1,343 @@
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/util.h>
+#include <solo5libvmm/vswitch.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define ETH_ALEN 6
+
+struct vswitch_port
+{
+    bool used;
+    struct guest* guest;
+    uint64_t handle;
+    uint8_t mac[ETH_ALEN];
+};
+
+struct vswitch_mac
+{
+    bool used;
+    bool fixed;                         // MAC of a port, never ages or moves
+    uint8_t mac[ETH_ALEN];
+    size_t port;
+    uint64_t last_seen;
+};
+
+struct vswitch_buf
+{
+    uint8_t data[(VSWITCH_BUF_SIZE + 7) / 8 * 8];
+    uint32_t refs;                      // Receive queues holding the frame, plus one while it is being switched
+    struct vswitch_buf* next_free;
+};
+
+_Static_assert(sizeof(struct vswitch_buf) == VSWITCH_BUF_STORAGE, "VSWITCH_BUF_STORAGE must match the buffer layout");
+
+static struct vswitch_port ports[VSWITCH_MAX_PORTS];
+static struct vswitch_mac macs[VSWITCH_MAC_ENTRIES];
+static struct vswitch_buf* free_bufs;
+static size_t num_bufs = 0;
+static size_t num_free = 0;
+static struct vswitch_stats stats;
+
+static struct vswitch_port* port_of(struct guest* guest, uint64_t handle)
+{
+    for (size_t i = 0; i < VSWITCH_MAX_PORTS; i++)
+        if (ports[i].used && ports[i].guest == guest && ports[i].handle == handle) return &ports[i];
+    return NULL;
+}
+
+static void forget_port(size_t port)
+{
+    for (size_t i = 0; i < VSWITCH_MAC_ENTRIES; i++)
+        if (macs[i].used && macs[i].port == port) macs[i].used = false;
+}
+
+static struct vswitch_mac* find_mac(const uint8_t* mac)
+{
+    for (size_t i = 0; i < VSWITCH_MAC_ENTRIES; i++)
+        if (macs[i].used && memcmp(macs[i].mac, mac, ETH_ALEN) == 0) return &macs[i];
+    return NULL;
+}
+
+static bool expired(const struct vswitch_mac* e, uint64_t now)
+{
+    return !e->fixed && now - e->last_seen >= aarch64_ns_to_ticks(VSWITCH_MAC_AGE_NS);
+}
+
+// Free entry, else an expired one, else the least recently seen learned one
+static struct vswitch_mac* alloc_mac(uint64_t now)
+{
+    struct vswitch_mac* victim = NULL;
+
+    for (size_t i = 0; i < VSWITCH_MAC_ENTRIES; i++)
+    {
+        struct vswitch_mac* e = &macs[i];
+        if (!e->used || expired(e, now)) return e;
+        if (!e->fixed && (!victim || e->last_seen < victim->last_seen)) victim = e;
+    }
+    return victim;
+}
+
+static void learn(const uint8_t* mac, size_t port, uint64_t now)
+{
+    // Group addresses are never a source
+    if (mac[0] & 1) return;
+
+    struct vswitch_mac* e = find_mac(mac);
+    if (e)
+    {
+        if (e->fixed) return;
+        if (e->port != port) stats.learned++;
+    }
+    else
+    {
+        e = alloc_mac(now);
+        if (!e) return;
+        stats.learned++;
+    }
+
+    *e = (struct vswitch_mac){ .used = true, .port = port, .last_seen = now };
+    memcpy(e->mac, mac, ETH_ALEN);
+}
+
+static struct vswitch_buf* buf_get(void)
+{
+    struct vswitch_buf* buf = free_bufs;
+    if (!buf) return NULL;
+
+    free_bufs = buf->next_free;
+    num_free--;
+    buf->refs = 1;
+    return buf;
+}
+
+static void buf_put(struct vswitch_buf* buf)
+{
+    assert(buf->refs > 0);
+    if (--buf->refs > 0) return;
+
+    buf->next_free = free_bufs;
+    free_bufs = buf;
+    num_free++;
+}
+
+static void buf_release(struct guest* guest, uint64_t handle, void* cookie)
+{
+    (void)guest;
+    (void)handle;
+    buf_put(cookie);
+}
+
+// Queues the frame on a port, the queue holds a reference until it delivers or drops it
+static bool deliver(struct vswitch_buf* buf, size_t len, const struct vswitch_port* port)
+{
+    buf->refs++;
+    if (net_rx_push_with(port->guest, port->handle, buf->data, len, buf_release, buf)) return true;
+
+    stats.dropped++;
+    return false;
+}
+
+bool vswitch_init(void* storage, size_t size)
+{
+    if (num_free != num_bufs)
+    {
+        LOG_VMM("Switch buffers cannot change while frames are queued (queued=%ld)\n", num_bufs - num_free);
+        return false;
+    }
+
+    size_t count = size / sizeof(struct vswitch_buf);
+    if (!storage || count == 0)
+    {
+        LOG_VMM("Switch storage too small for one buffer (size=%ld required=%ld)\n", size, sizeof(struct vswitch_buf));
+        return false;
+    }
+
+    struct vswitch_buf* bufs = storage;
+    free_bufs = NULL;
+    for (size_t i = count; i > 0; i--)
+    {
+        bufs[i - 1].next_free = free_bufs;
+        free_bufs = &bufs[i - 1];
+    }
+    num_bufs = count;
+    num_free = count;
+    stats.buffers = count;
+    return true;
+}
+
+bool vswitch_add_port(struct guest* guest, uint64_t handle, const uint8_t* mac)
+{
+    static const uint8_t zero_mac[ETH_ALEN];
+
+    if (num_bufs == 0)
+    {
+        LOG_VMM("Virtual switch has no buffers, see vswitch_init\n");
+        return false;
+    }
+    if (handle >= MFT_MAX_ENTRIES || port_of(guest, handle))
+    {
+        LOG_VMM("Invalid or duplicate switch port (handle=%ld)\n", handle);
+        return false;
+    }
+    if (memcmp(mac, zero_mac, ETH_ALEN) == 0 || (mac[0] & 1))
+    {
+        LOG_VMM("Switch port MAC must be a non-zero unicast address (handle=%ld)\n", handle);
+        return false;
+    }
+
+    // A learned entry for the MAC is taken over, one of another port is a conflict
+    struct vswitch_mac* e = find_mac(mac);
+    if (e && e->fixed)
+    {
+        LOG_VMM("Duplicate MAC on switch port (handle=%ld)\n", handle);
+        return false;
+    }
+    if (!e) e = alloc_mac(aarch64_get_counter());
+    if (!e)
+    {
+        LOG_VMM("Switch MAC table full\n");
+        return false;
+    }
+
+    for (size_t i = 0; i < VSWITCH_MAX_PORTS; i++)
+    {
+        if (ports[i].used) continue;
+
+        ports[i] = (struct vswitch_port){ .used = true, .guest = guest, .handle = handle };
+        memcpy(ports[i].mac, mac, ETH_ALEN);
+        *e = (struct vswitch_mac){ .used = true, .fixed = true, .port = i };
+        memcpy(e->mac, mac, ETH_ALEN);
+        return true;
+    }
+
+    LOG_VMM("Too many switch ports (max=%ld)\n", VSWITCH_MAX_PORTS);
+    return false;
+}
+
+void vswitch_remove_port(struct guest* guest, uint64_t handle)
+{
+    struct vswitch_port* port = port_of(guest, handle);
+    if (!port) return;
+
+    forget_port((size_t)(port - ports));
+    port->used = false;
+}
+
+void vswitch_release(struct guest* guest)
+{
+    for (size_t i = 0; i < VSWITCH_MAX_PORTS; i++)
+        if (ports[i].used && ports[i].guest == guest) vswitch_remove_port(guest, ports[i].handle);
+}
+
+bool vswitch_forward(struct guest* guest, uint64_t handle, const uint8_t* data, size_t len)
+{
+    struct vswitch_port* src = port_of(guest, handle);
+    if (!src || len < NET_ETH_HDR_SIZE) return false;
+
+    uint64_t now = aarch64_get_counter();
+    size_t src_idx = (size_t)(src - ports);
+    learn(data + ETH_ALEN, src_idx, now);
+
+    // Destination MAC, the group bit marks broadcast and multicast
+    bool group = data[0] & 1;
+    struct vswitch_mac* dst = NULL;
+    if (!group)
+    {
+        dst = find_mac(data);
+        if (dst && expired(dst, now))
+        {
+            dst->used = false;
+            dst = NULL;
+        }
+        if (!dst)
+        {
+            stats.uplink++;
+            return false;
+        }
+        if (dst->port == src_idx)
+        {
+            stats.dropped++;
+            return true;
+        }
+    }
+
+    if (len > VSWITCH_BUF_SIZE)
+    {
+        stats.too_big++;
+        stats.uplink++;
+        return false;
+    }
+
+    // Ports with a NET_READ pending get the frame copied straight from the sender. The others share one switch buffer, only taken if
+    // such a port exists, and copy it out again when they read
+    struct vswitch_buf* buf = NULL;
+    for (size_t i = 0; i < VSWITCH_MAX_PORTS; i++)
+    {
+        if (!ports[i].used || i == src_idx || (dst && dst->port != i)) continue;
+
+        if (net_rx_direct(ports[i].guest, ports[i].handle, data, len))
+        {
+            stats.direct++;
+            stats.bytes += len;
+            if (group)
+                stats.flooded++;
+            else
+                stats.switched++;
+            continue;
+        }
+        if (!buf)
+        {
+            buf = buf_get();
+            if (!buf)
+            {
+                stats.dropped++;
+                break;
+            }
+            memcpy(buf->data, data, len);
+            stats.bytes += len;
+        }
+        if (deliver(buf, len, &ports[i]))
+        {
+            if (group)
+                stats.flooded++;
+            else
+                stats.switched++;
+        }
+    }
+    if (buf) buf_put(buf);
+
+    if (!group) return true;
+
+    stats.uplink++;
+    return false;
+}
+
+void vswitch_setup(struct guest* guest)
+{
+    struct mft* mft = guest_mft(guest);
+    if (!mft) return;
+
+    for (size_t i = 0; i < VSWITCH_MAX_PORTS; i++)
+    {
+        struct vswitch_port* port = &ports[i];
+        if (!port->used || port->guest != guest) continue;
+
+        if (port->handle >= mft->entries || mft->e[port->handle].type != MFT_DEV_NET_BASIC)
+        {
+            LOG_VMM("Switch port is not a net device of the guest (handle=%ld)\n", port->handle);
+            continue;
+        }
+        memcpy(mft->e[port->handle].u.net_basic.mac, port->mac, ETH_ALEN);
+    }
+}
+
+void vswitch_get_stats(struct vswitch_stats* out)
+{
+    *out = stats;
+}
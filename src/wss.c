@@ -0,0 +1,256 @@
+#include <microkit.h>
+#include <solo5libvmm/aarch64/vcpu.h>
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/timer.h>
+#include <solo5libvmm/util.h>
+#include <solo5libvmm/wss.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Pages below AARCH64_PGT_MAP_START are left unmapped
+#define FIRST_PAGE (AARCH64_PGT_MAP_START / PAGE_SIZE)
+
+// Cores without 16-bit ASID support ignore the upper half, only ASIDs both widths agree on are used. 0 is the one the guest boots with
+#define ASID_COUNT 256
+
+_Static_assert(WSS_HISTORY < 256, "Working set ages must fit uint8_t");
+
+static struct wss_state* state_of(struct guest* guest)
+{
+    return &guest->wss;
+}
+
+static inline _Atomic uint64_t* pte(struct guest* guest, size_t page)
+{
+    return (_Atomic uint64_t*)(guest->mem + AARCH64_PTE_PGT_BASE) + page;
+}
+
+// PMD tables are contiguous, block n of RAM is entry n
+static inline _Atomic uint64_t* pmd(struct guest* guest, size_t block)
+{
+    return (_Atomic uint64_t*)(guest->mem + AARCH64_PMD_PGT_BASE) + block;
+}
+
+static inline size_t num_blocks(struct guest* guest)
+{
+    return guest->mem_size / PMD_SIZE;
+}
+
+// Hardware sets Access flags with atomic updates too, plain stores could lose one
+static inline bool test_and_clear(_Atomic uint64_t* entry)
+{
+    return atomic_fetch_and_explicit(entry, ~SECT_AF, memory_order_relaxed) & SECT_AF;
+}
+
+// Entries are made non-global so their TLB entries are tagged with the ASID, see next_asid
+static inline void track(_Atomic uint64_t* entry)
+{
+    atomic_fetch_or_explicit(entry, SECT_NG, memory_order_relaxed);
+    test_and_clear(entry);
+}
+
+static inline void untrack(_Atomic uint64_t* entry)
+{
+    atomic_fetch_or_explicit(entry, SECT_AF, memory_order_relaxed);
+    atomic_fetch_and_explicit(entry, ~SECT_NG, memory_order_relaxed);
+}
+
+static inline void mark(uint64_t* bits, size_t i)
+{
+    bits[i / 64] |= 1ULL << (i % 64);
+}
+
+static inline bool marked(const uint64_t* bits, size_t i)
+{
+    return bits[i / 64] & (1ULL << (i % 64));
+}
+
+static void next_asid(struct guest* guest)
+{
+    struct wss_state* state = state_of(guest);
+
+    // Translations cached under the previous ASID are not used in the new window, every access walks the tables. Once the ASIDs run out
+    // they are reused, a translation cached ASID_COUNT - 1 windows earlier that is still in the TLB then hides accesses through it
+    if (++state->asid == ASID_COUNT)
+    {
+        state->asid = 1;
+        state->stats.asid_wraps++;
+    }
+    microkit_vcpu_arm_write_reg(guest->vcpu_id, seL4_VCPUReg_TTBR0, AARCH64_PGD_PGT_BASE | (uint64_t)state->asid << TTBR_ASID_SHIFT);
+}
+
+static inline void age(uint8_t* a, bool touched)
+{
+    if (touched)
+        *a = 0;
+    else if (*a < WSS_HISTORY)
+        (*a)++;
+}
+
+static void sample(struct guest* guest)
+{
+    struct wss_state* state = state_of(guest);
+    uint64_t bytes = 0;
+
+    for (size_t i = FIRST_PAGE; i < WSS_PAGES; i++)
+    {
+        bool touched = test_and_clear(pte(guest, i));
+        age(&state->page_age[i], touched);
+        if (!touched) continue;
+        bytes += PAGE_SIZE;
+        mark(state->touched_pages, i);
+    }
+    for (size_t i = 1; i < num_blocks(guest); i++)
+    {
+        bool touched = test_and_clear(pmd(guest, i));
+        age(&state->block_age[i], touched);
+        if (!touched) continue;
+        bytes += PMD_SIZE;
+        mark(state->touched_blocks, i);
+    }
+    next_asid(guest);
+
+    struct wss_stats* stats = &state->stats;
+    memmove(&stats->history[1], &stats->history[0], (WSS_HISTORY - 1) * sizeof(uint64_t));
+    stats->history[0] = bytes;
+    if (bytes > stats->peak_bytes) stats->peak_bytes = bytes;
+    stats->windows++;
+}
+
+static void window_expired(void* arg)
+{
+    struct guest* guest = arg;
+    struct wss_state* state = state_of(guest);
+
+    sample(guest);
+    timer_add(&state->window_event, aarch64_get_counter() + aarch64_ns_to_ticks(state->window_ns));
+}
+
+void wss_init(struct guest* guest)
+{
+    struct wss_state* state = state_of(guest);
+
+    memset(state->page_age, WSS_HISTORY, sizeof(state->page_age));
+    memset(state->block_age, WSS_HISTORY, sizeof(state->block_age));
+    timer_event_init(&state->window_event, window_expired, guest);
+}
+
+bool wss_enable(struct guest* guest, uint64_t window_ns)
+{
+    if (window_ns == 0)
+    {
+        LOG_VMM("Working set window must be non-zero\n");
+        return false;
+    }
+
+    struct wss_state* state = state_of(guest);
+    state->window_ns = window_ns;
+    if (state->enabled)
+    {
+        if (state->window_event.armed) timer_add(&state->window_event, aarch64_get_counter() + aarch64_ns_to_ticks(window_ns));
+        return true;
+    }
+
+    state->enabled = true;
+    if (guest->boot.booted) wss_setup(guest);
+    return true;
+}
+
+void wss_disable(struct guest* guest)
+{
+    struct wss_state* state = state_of(guest);
+    if (!state->enabled) return;
+
+    state->enabled = false;
+    timer_cancel(&state->window_event);
+    if (!guest->boot.booted) return;
+
+    // Flags must all be set before hardware updates are turned off, the guest cannot handle Access flag faults
+    for (size_t i = FIRST_PAGE; i < WSS_PAGES; i++)
+        untrack(pte(guest, i));
+    for (size_t i = 1; i < num_blocks(guest); i++)
+        untrack(pmd(guest, i));
+    microkit_vcpu_arm_write_reg(guest->vcpu_id, seL4_VCPUReg_TCR, TCR_EL1_INIT);
+    microkit_vcpu_arm_write_reg(guest->vcpu_id, seL4_VCPUReg_TTBR0, AARCH64_PGD_PGT_BASE);
+}
+
+void wss_setup(struct guest* guest)
+{
+    struct wss_state* state = state_of(guest);
+    if (!state->enabled) return;
+
+    memset(state->page_age, WSS_HISTORY, sizeof(state->page_age));
+    memset(state->block_age, WSS_HISTORY, sizeof(state->block_age));
+    memset(&state->stats, 0, sizeof(struct wss_stats));
+    memset(state->touched_pages, 0, sizeof(state->touched_pages));
+    memset(state->touched_blocks, 0, sizeof(state->touched_blocks));
+    // Called before the boot completes by guest_setup, enabling on a running guest misses what it touched so far
+    state->whole_boot = !guest->boot.booted;
+
+    // First window starts with every flag clear
+    microkit_vcpu_arm_write_reg(guest->vcpu_id, seL4_VCPUReg_TCR, TCR_EL1_INIT | TCR_HA);
+    for (size_t i = FIRST_PAGE; i < WSS_PAGES; i++)
+        track(pte(guest, i));
+    for (size_t i = 1; i < num_blocks(guest); i++)
+        track(pmd(guest, i));
+    next_asid(guest);
+
+    timer_add(&state->window_event, aarch64_get_counter() + aarch64_ns_to_ticks(state->window_ns));
+}
+
+void wss_cancel(struct guest* guest)
+{
+    timer_cancel(&state_of(guest)->window_event);
+}
+
+void wss_touch(struct guest* guest, uint64_t gpa, size_t size)
+{
+    struct wss_state* state = state_of(guest);
+    if (size == 0) return;
+
+    uint64_t last = gpa + size - 1;
+    for (; gpa <= last && gpa < AARCH64_GUEST_BLOCK_SIZE; gpa = (gpa / PAGE_SIZE + 1) * PAGE_SIZE)
+        mark(state->touched_pages, gpa / PAGE_SIZE);
+    for (; gpa <= last; gpa = (gpa / PMD_SIZE + 1) * PMD_SIZE)
+        mark(state->touched_blocks, gpa / PMD_SIZE);
+}
+
+// Zeroes [from, to) clipped to start
+static inline void clear_range(struct guest* guest, uint64_t start, uint64_t from, uint64_t to)
+{
+    if (to <= start) return;
+    if (from < start) from = start;
+    memset(guest->mem + from, 0, to - from);
+}
+
+bool wss_clear_touched(struct guest* guest, uint64_t start)
+{
+    struct wss_state* state = state_of(guest);
+    if (!state->enabled || !state->whole_boot || !guest->boot.booted) return false;
+
+    // Pages below FIRST_PAGE are not mapped for the guest, only the VMM writes there
+    if (start < AARCH64_PGT_MAP_START) return false;
+
+    // Flags set since the last window belong to the old image too
+    for (size_t i = FIRST_PAGE; i < WSS_PAGES; i++)
+        if (marked(state->touched_pages, i) || test_and_clear(pte(guest, i))) clear_range(guest, start, i * PAGE_SIZE, (i + 1) * PAGE_SIZE);
+    for (size_t i = 1; i < num_blocks(guest); i++)
+        if (marked(state->touched_blocks, i) || test_and_clear(pmd(guest, i))) clear_range(guest, start, i * PMD_SIZE, (i + 1) * PMD_SIZE);
+    return true;
+}
+
+void wss_get_stats(struct guest* guest, struct wss_stats* stats)
+{
+    struct wss_state* state = state_of(guest);
+
+    *stats = state->stats;
+    stats->mem_size = (WSS_PAGES - FIRST_PAGE) * PAGE_SIZE + (num_blocks(guest) - 1) * PMD_SIZE;
+    memset(stats->idle_bytes, 0, sizeof(stats->idle_bytes));
+    for (size_t i = FIRST_PAGE; i < WSS_PAGES; i++)
+        stats->idle_bytes[state->page_age[i]] += PAGE_SIZE;
+    for (size_t i = 1; i < num_blocks(guest); i++)
+        stats->idle_bytes[state->block_age[i]] += PMD_SIZE;
+}
@@ -0,0 +1,56 @@
+#include <solo5libvmm/zero.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Bytes ORed together between checks, long enough to keep the loop branch light, short enough to bail out early on data
+#define ZERO_STRIDE 256
+
+static bool zero_tail(const uint8_t* p, size_t len)
+{
+    uint64_t acc = 0;
+
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        acc |= v;
+    }
+    for (; len > 0; p++, len--)
+        acc |= *p;
+    return acc == 0;
+}
+
+#if defined(__ARM_NEON)
+static bool zero_stride(const uint8_t* p)
+{
+    uint8x16_t acc0 = vdupq_n_u8(0);
+    uint8x16_t acc1 = vdupq_n_u8(0);
+
+    for (size_t i = 0; i < ZERO_STRIDE; i += 64)
+    {
+        acc0 = vorrq_u8(acc0, vorrq_u8(vld1q_u8(p + i), vld1q_u8(p + i + 16)));
+        acc1 = vorrq_u8(acc1, vorrq_u8(vld1q_u8(p + i + 32), vld1q_u8(p + i + 48)));
+    }
+    return vmaxvq_u8(vorrq_u8(acc0, acc1)) == 0;
+}
+#else
+static bool zero_stride(const uint8_t* p)
+{
+    return zero_tail(p, ZERO_STRIDE);
+}
+#endif
+
+bool zero_detect(const void* data, size_t len)
+{
+    const uint8_t* p = data;
+
+    for (; len >= ZERO_STRIDE; p += ZERO_STRIDE, len -= ZERO_STRIDE)
+        if (!zero_stride(p)) return false;
+    return zero_tail(p, len);
+}
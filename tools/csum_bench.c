@@ -0,0 +1,159 @@
+// csum_bench - Host correctness check and benchmark for the checksum engine of csum.c
+/*
+    Build: see the csum_bench target in solo5libvmm.mk, src/csum.c is linked twice: as is (NEON on targets that have it) and built with
+    CSUM_NO_NEON and csum_partial renamed to csum_partial_scalar
+    Usage: csum_bench [seconds per measurement]
+
+    Both variants are first checked against a plain RFC 1071 loop over big endian 16-bit words: random lengths and alignments, sums chained
+    over split buffers, and all-ones buffers large enough to exercise the NEON accumulator spill. Then throughput is measured for typical
+    packet sizes. Exits non-zero on the first mismatch.
+*/
+#include <solo5libvmm/csum.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_LEN (1024 * 1024)
+#define RANDOM_CASES 200000
+
+uint32_t csum_partial_scalar(const void* data, size_t len, uint32_t sum);
+
+typedef uint32_t (*csum_fn)(const void* data, size_t len, uint32_t sum);
+
+static uint8_t buf[MAX_LEN + 64];
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+// RFC 1071 section 4.1, an odd trailing byte is the high byte of a zero padded word
+static uint16_t reference(const uint8_t* p, size_t len)
+{
+    uint64_t sum = 0;
+
+    for (; len > 1; p += 2, len -= 2)
+        sum += (uint32_t)p[0] << 8 | p[1];
+    if (len) sum += (uint32_t)p[0] << 8;
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Splits at an even offset to exercise chaining
+static uint16_t chained(csum_fn fn, const uint8_t* p, size_t len, size_t split)
+{
+    split &= ~(size_t)1;
+    if (split > len) split = len & ~(size_t)1;
+    return csum_fold(fn(p + split, len - split, fn(p, split, 0)));
+}
+
+static bool check(const char* name, csum_fn fn)
+{
+    for (size_t i = 0; i < RANDOM_CASES; i++)
+    {
+        size_t len = next_random() % (i < RANDOM_CASES / 2 ? 2048 : 65536);
+        size_t align = next_random() % 64;
+        uint8_t* p = buf + align;
+        for (size_t j = 0; j < len; j++)
+            p[j] = (uint8_t)next_random();
+
+        uint16_t expect = reference(p, len);
+        uint16_t got = csum_fold(fn(p, len, 0));
+        uint16_t got_chained = chained(fn, p, len, next_random() % (len + 1));
+        if (got != expect || got_chained != expect)
+        {
+            fprintf(stderr, "%s: mismatch len=%zu align=%zu: expected 0x%04x, got 0x%04x (chained 0x%04x)\n", name, len, align, expect,
+                got, got_chained);
+            return false;
+        }
+    }
+
+    // Largest lane sums, past the point where 32-bit lanes must be spilled
+    memset(buf, 0xff, sizeof(buf));
+    for (size_t len = MAX_LEN - 3; len <= MAX_LEN; len++)
+    {
+        uint16_t expect = reference(buf + 1, len);
+        uint16_t got = csum_fold(fn(buf + 1, len, 0));
+        if (got != expect)
+        {
+            fprintf(stderr, "%s: mismatch on all-ones len=%zu: expected 0x%04x, got 0x%04x\n", name, len, expect, got);
+            return false;
+        }
+    }
+
+    printf("%s: %d random buffers and all-ones buffers match RFC 1071\n", name, RANDOM_CASES);
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static uint32_t reference_fn(const void* data, size_t len, uint32_t sum)
+{
+    return csum_add16(sum, reference(data, len));
+}
+
+// Keeps the calls from being optimised away
+static volatile uint32_t sink;
+
+// Bytes per second summing len bytes over and over for about seconds
+static double measure(csum_fn fn, size_t len, double seconds)
+{
+    uint64_t bytes = 0;
+    double start = now();
+    double elapsed;
+
+    do
+    {
+        for (int i = 0; i < 1000; i++)
+            sink += fn(buf, len, 0);
+        bytes += (uint64_t)len * 1000;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return (double)bytes / elapsed;
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 0.2;
+    if (seconds <= 0)
+    {
+        fprintf(stderr, "Usage: %s [seconds per measurement]\n", argv[0]);
+        return 2;
+    }
+
+#if defined(__ARM_NEON)
+    const char* name = "neon";
+#else
+    const char* name = "default";
+#endif
+
+    if (!check(name, csum_partial) || !check("scalar", csum_partial_scalar)) return 1;
+
+    for (size_t i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)next_random();
+
+    static const size_t sizes[] = { 64, 576, 1500, 9000, 65536 };
+    printf("%8s %12s %12s %12s\n", "bytes", name, "scalar", "rfc1071");
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        size_t len = sizes[i];
+        printf("%8zu %9.2f GB/s %7.2f GB/s %7.2f GB/s\n", len, measure(csum_partial, len, seconds) / 1e9,
+            measure(csum_partial_scalar, len, seconds) / 1e9, measure(reference_fn, len, seconds) / 1e9);
+    }
+    return 0;
+}
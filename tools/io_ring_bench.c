@@ -0,0 +1,163 @@
+// io_ring_bench - Host stress test and throughput benchmark for the descriptor rings of io_ring.h
+/*
+    Build: cc -O2 -pthread -o io_ring_bench tools/io_ring_bench.c -Iinclude
+    Usage: io_ring_bench [descriptors] [batch]
+
+    A producer and a consumer thread stand in for the VMM and a driver PD. Every descriptor carries its sequence number in tag and values
+    derived from it in the other fields, offset holds a checksum over them, the consumer checks order and checksum of each one. Both sides
+    wait on a semaphore whenever the ring is empty or full and only post it when io_ring_notify_needed()/io_ring_space_notify_needed() say
+    so, a lost wakeup in the idle protocol shows up as a hang. Exits non-zero on the first corrupt or out of order descriptor.
+*/
+#include <pthread.h>
+#include <semaphore.h>
+#include <solo5libvmm/io_ring.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_COUNT 50000000UL
+#define MAX_BATCH IO_RING_SIZE
+
+static struct io_ring ring;
+static sem_t descs_ready;
+static sem_t space_ready;
+static uint64_t count = DEFAULT_COUNT;
+static size_t batch = 32;
+
+static uint64_t producer_waits;
+static uint64_t consumer_waits;
+static atomic_bool failed;
+
+static uint64_t mix(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return v;
+}
+
+static uint64_t checksum(const struct io_ring_desc* d)
+{
+    return mix(((uint64_t)d->tag << 32 | (uint64_t)d->op << 24 | (uint16_t)d->status) ^ mix((uint64_t)d->handle << 32 | d->len) ^ d->addr);
+}
+
+static void fill(struct io_ring_desc* d, uint64_t seq)
+{
+    uint64_t r = mix(seq);
+    *d = (struct io_ring_desc){
+        .tag = (uint32_t)seq,
+        .op = (uint8_t)(IO_RING_OP_NET_WRITE + r % 5),
+        .status = (int16_t)(r >> 8),
+        .handle = (uint32_t)(r >> 24) & 0xff,
+        .len = (uint32_t)(r >> 32) & 0xffff,
+        .addr = r,
+    };
+    d->offset = checksum(d);
+}
+
+static void* consumer(void* arg)
+{
+    (void)arg;
+    struct io_ring_desc descs[MAX_BATCH];
+    uint64_t expect = 0;
+
+    while (expect < count)
+    {
+        size_t n = io_ring_dequeue(&ring, descs, batch);
+        if (n == 0)
+        {
+            if (io_ring_consumer_idle(&ring))
+            {
+                consumer_waits++;
+                sem_wait(&descs_ready);
+            }
+            continue;
+        }
+        if (io_ring_space_notify_needed(&ring)) sem_post(&space_ready);
+
+        for (size_t i = 0; i < n; i++, expect++)
+        {
+            if (descs[i].tag == (uint32_t)expect && descs[i].offset == checksum(&descs[i])) continue;
+
+            fprintf(stderr, "Bad descriptor %lu: tag %u, checksum %s\n", (unsigned long)expect, descs[i].tag,
+                descs[i].offset == checksum(&descs[i]) ? "ok" : "mismatch");
+            atomic_store(&failed, true);
+            sem_post(&space_ready);
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static double seconds(const struct timespec* start, const struct timespec* end)
+{
+    return (double)(end->tv_sec - start->tv_sec) + (double)(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1) count = strtoull(argv[1], NULL, 0);
+    if (argc > 2) batch = strtoul(argv[2], NULL, 0);
+    if (count == 0 || batch == 0 || batch > MAX_BATCH)
+    {
+        fprintf(stderr, "Usage: %s [descriptors] [batch 1-%d]\n", argv[0], MAX_BATCH);
+        return 2;
+    }
+
+    io_ring_init(&ring);
+    sem_init(&descs_ready, 0, 0);
+    sem_init(&space_ready, 0, 0);
+
+    struct timespec start;
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, consumer, NULL) != 0)
+    {
+        fprintf(stderr, "Failed to start consumer\n");
+        return 1;
+    }
+
+    struct io_ring_desc descs[MAX_BATCH];
+    uint64_t next = 0;
+    size_t filled = 0;
+    while (next < count && !atomic_load(&failed))
+    {
+        while (filled < batch && next + filled < count)
+        {
+            fill(&descs[filled], next + filled);
+            filled++;
+        }
+
+        size_t n = io_ring_enqueue(&ring, descs, filled);
+        if (n > 0 && io_ring_notify_needed(&ring)) sem_post(&descs_ready);
+        next += n;
+
+        // Descriptors that did not fit are sent first next round
+        for (size_t i = n; i < filled; i++)
+            descs[i - n] = descs[i];
+        filled -= n;
+
+        if (filled > 0 && io_ring_producer_idle(&ring))
+        {
+            producer_waits++;
+            sem_wait(&space_ready);
+        }
+    }
+
+    pthread_join(thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (atomic_load(&failed)) return 1;
+
+    double s = seconds(&start, &end);
+    printf("%lu descriptors in %.3f s, batch %lu: %.1f M descriptors/s, %.1f ns each\n", (unsigned long)count, s, (unsigned long)batch,
+        (double)count / s / 1e6, s * 1e9 / (double)count);
+    printf("Producer waited %lu times, consumer %lu times\n", (unsigned long)producer_waits, (unsigned long)consumer_waits);
+    return 0;
+}
@@ -0,0 +1,245 @@
+// s5lpack - Host tool that compresses the PT_LOAD segments of a solo5 HVT image for loading with solo5libvmm's elf_load
+/*
+    Build: cc -O2 -o s5lpack tools/s5lpack.c -Iinclude
+    Usage: s5lpack <input.hvt> <output.hvt>
+
+    The output image keeps the ELF and program headers, and the PT_NOTE data (ABI1/MFT1 notes are read in place by elf_load_note),
+    section headers are dropped. Each PT_LOAD segment has trailing zero bytes stripped (elf_load zero fills up to p_memsz anyway) and is
+    compressed as a raw LZ4 block, segments are only marked with ELF_PF_LZ4 if compression made them smaller.
+*/
+#include <elf.h>
+#include <solo5libvmm/elf.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_MAX_OFFSET 65535
+// Block format end conditions, the last match must start at least 12 bytes before the end and the last 5 bytes are always literals
+#define LZ4_MF_LIMIT 12
+#define LZ4_LAST_LITERALS 5
+#define HASH_BITS 16
+
+static uint32_t read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static uint8_t* write_len(uint8_t* op, size_t len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t* write_sequence(uint8_t* op, const uint8_t* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit_len >= 15 ? 15 : lit_len) << 4);
+    if (lit_len >= 15) op = write_len(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len == 0) return op;
+
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    match_len -= LZ4_MIN_MATCH;
+    *token |= (uint8_t)(match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15) op = write_len(op, match_len - 15);
+    return op;
+}
+
+// Worst case output size of a block
+static size_t lz4_bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+
+// Greedy single-probe LZ4 block compressor, returns compressed size
+static size_t lz4_compress(const uint8_t* src, size_t size, uint8_t* dst)
+{
+    static uint32_t table[1 << HASH_BITS];
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    uint8_t* op = dst;
+
+    memset(table, 0, sizeof(table));
+
+    if (size >= LZ4_MF_LIMIT + 1)
+    {
+        const uint8_t* mflimit = src + size - LZ4_MF_LIMIT;
+        const uint8_t* matchlimit = src + size - LZ4_LAST_LITERALS;
+
+        while (ip < mflimit)
+        {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash32(seq);
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+
+            if (ref >= ip || (size_t)(ip - ref) > LZ4_MAX_OFFSET || read32(ref) != seq)
+            {
+                ip++;
+                continue;
+            }
+
+            const uint8_t* mp = ip + LZ4_MIN_MATCH;
+            const uint8_t* rp = ref + LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp)
+            {
+                mp++;
+                rp++;
+            }
+
+            op = write_sequence(op, anchor, (size_t)(ip - anchor), (size_t)(ip - ref), (size_t)(mp - ip));
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    op = write_sequence(op, anchor, (size_t)(src + size - anchor), 0, 0);
+    return (size_t)(op - dst);
+}
+
+static uint8_t* read_file(const char* path, size_t* size)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* buf = len > 0 ? malloc((size_t)len) : NULL;
+    if (buf && fread(buf, 1, (size_t)len, f) != (size_t)len)
+    {
+        free(buf);
+        buf = NULL;
+    }
+    fclose(f);
+
+    *size = (size_t)len;
+    return buf;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s <input.hvt> <output.hvt>\n", argv[0]);
+        return 1;
+    }
+
+    size_t in_size;
+    uint8_t* in = read_file(argv[1], &in_size);
+    if (!in)
+    {
+        fprintf(stderr, "s5lpack: cannot read %s\n", argv[1]);
+        return 1;
+    }
+
+    Elf64_Ehdr ehdr;
+    if (in_size < sizeof(ehdr))
+    {
+        fprintf(stderr, "s5lpack: %s is not an ELF64 file\n", argv[1]);
+        return 1;
+    }
+    memcpy(&ehdr, in, sizeof(ehdr));
+    if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0 || ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_phentsize != sizeof(Elf64_Phdr)
+        || ehdr.e_phoff + (uint64_t)ehdr.e_phnum * sizeof(Elf64_Phdr) > in_size)
+    {
+        fprintf(stderr, "s5lpack: %s is not an ELF64 file\n", argv[1]);
+        return 1;
+    }
+
+    Elf64_Phdr* phdrs = calloc(ehdr.e_phnum, sizeof(Elf64_Phdr));
+    memcpy(phdrs, in + ehdr.e_phoff, ehdr.e_phnum * sizeof(Elf64_Phdr));
+
+    // Output layout: ehdr, phdrs, then segment data in program header order
+    size_t out_cap = sizeof(Elf64_Ehdr) + ehdr.e_phnum * sizeof(Elf64_Phdr);
+    for (Elf64_Half i = 0; i < ehdr.e_phnum; i++)
+    {
+        if (phdrs[i].p_offset + phdrs[i].p_filesz > in_size)
+        {
+            fprintf(stderr, "s5lpack: phdr %u data out of range\n", i);
+            return 1;
+        }
+        out_cap += lz4_bound(phdrs[i].p_filesz) + 8;
+    }
+
+    uint8_t* out = calloc(1, out_cap);
+    size_t out_off = sizeof(Elf64_Ehdr) + ehdr.e_phnum * sizeof(Elf64_Phdr);
+    size_t total_raw = 0;
+    size_t total_packed = 0;
+
+    for (Elf64_Half i = 0; i < ehdr.e_phnum; i++)
+    {
+        Elf64_Phdr* phdr = &phdrs[i];
+        const uint8_t* data = in + phdr->p_offset;
+        size_t size = phdr->p_filesz;
+
+        if (size == 0) continue;
+
+        // Keep 8 byte alignment of segment data so notes stay aligned
+        out_off = (out_off + 7) & ~(size_t)7;
+
+        if (phdr->p_type == PT_LOAD)
+        {
+            // Trailing zeros are covered by elf_load's zero fill up to p_memsz
+            size_t trimmed = size;
+            while (trimmed > 0 && data[trimmed - 1] == 0) trimmed--;
+
+            size_t packed = lz4_compress(data, trimmed, out + out_off);
+            if (packed < size)
+            {
+                printf("phdr %u: %zu -> %zu bytes (LZ4)\n", i, size, packed);
+                phdr->p_flags |= ELF_PF_LZ4;
+                phdr->p_filesz = packed;
+            }
+            else
+            {
+                printf("phdr %u: %zu bytes (stored)\n", i, size);
+                memcpy(out + out_off, data, size);
+            }
+        }
+        else
+            memcpy(out + out_off, data, size);
+
+        total_raw += size;
+        total_packed += phdr->p_filesz;
+        phdr->p_offset = out_off;
+        out_off += phdr->p_filesz;
+    }
+
+    ehdr.e_phoff = sizeof(Elf64_Ehdr);
+    ehdr.e_shoff = 0;
+    ehdr.e_shnum = 0;
+    ehdr.e_shstrndx = SHN_UNDEF;
+    memcpy(out, &ehdr, sizeof(ehdr));
+    memcpy(out + ehdr.e_phoff, phdrs, ehdr.e_phnum * sizeof(Elf64_Phdr));
+
+    FILE* f = fopen(argv[2], "wb");
+    if (!f || fwrite(out, 1, out_off, f) != out_off || fclose(f) != 0)
+    {
+        fprintf(stderr, "s5lpack: cannot write %s\n", argv[2]);
+        return 1;
+    }
+
+    printf("%s: %zu -> %zu bytes (segments %zu -> %zu)\n", argv[2], in_size, out_off, total_raw, total_packed);
+    return 0;
+}
@@ -0,0 +1,417 @@
+// vswitch_bench - Host correctness check and forwarding benchmark for the virtual switch of vswitch.c
+/*
+    Build: see the vswitch_bench target in solo5libvmm.mk, src/vswitch.c is linked with host stand-ins for the counter, the guest's MFT,
+    the net receive queues and pending reads
+    Usage: vswitch_bench [seconds per measurement]
+
+    Each port gets a receive queue that holds what vswitch_forward() pushes, a count of NET_READs standing in for the ones a VMM holds
+    pending (net_rx_direct() fills them straight from the sender) and guest memory holding just an MFT with the port's net entry. Every
+    frame received either way is copied out and checked to have arrived on the port its destination MAC belongs to with the payload it was
+    sent with, queued switch buffers are handed back once drained. Before measuring, the switch is checked for port MACs (written into the
+    MFT, known up front, never moved), learning, flooding, hairpin drops, direct delivery and buffer accounting: the switch is given
+    storage for BUFFERS buffers, every one is in use once that many frames are queued and all of them are free again after a drain. Then
+    unicast frames of 64 and 1514 bytes (queued, and direct into pending reads), broadcast frames and unknown unicast frames against a full
+    MAC table are switched in batches of BATCH per port. Exits non-zero on the first misdelivered or corrupt frame.
+*/
+#include <solo5libvmm/guest.h>
+#include <solo5libvmm/net.h>
+#include <solo5libvmm/solo5/mft_abi.h>
+#include <solo5libvmm/vswitch.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NUM_PORTS 8
+#ifndef BUFFERS
+#define BUFFERS 128
+#endif
+#define QUEUE_DEPTH (BUFFERS + 1)
+#define BATCH 32
+#define MAX_FRAME 1514
+
+_Static_assert(NUM_PORTS <= VSWITCH_MAX_PORTS, "Benchmark ports must fit the switch");
+
+struct queued
+{
+    const uint8_t* data;
+    size_t len;
+    net_rx_release_fn release;
+    void* cookie;
+};
+
+struct port
+{
+    struct guest guest;
+    uint8_t mac[6];
+    // Guest memory, only the MFT
+    _Alignas(struct mft) uint8_t mft[sizeof(struct mft) + sizeof(struct mft_entry)];
+    struct queued queue[QUEUE_DEPTH];
+    size_t count;
+    size_t reads;                       // NET_READs the VMM holds pending, each takes one frame straight from the sender
+    uint64_t received;
+};
+
+static struct port ports[NUM_PORTS];
+static uint64_t storage[BUFFERS * VSWITCH_BUF_STORAGE / sizeof(uint64_t)];
+static uint64_t ticks;
+static bool failed;
+
+// Stand-ins for what vswitch.c uses from the rest of the library
+uint64_t aarch64_get_counter(void)
+{
+    return ++ticks;
+}
+
+uint64_t aarch64_ns_to_ticks(uint64_t ns)
+{
+    return ns;
+}
+
+static struct port* port_of(struct guest* guest)
+{
+    return (struct port*)((uint8_t*)guest - offsetof(struct port, guest));
+}
+
+struct mft* guest_mft(struct guest* guest)
+{
+    return (struct mft*)port_of(guest)->mft;
+}
+
+bool net_rx_push_with(struct guest* guest, uint64_t handle, const void* data, size_t len, net_rx_release_fn release, void* cookie)
+{
+    struct port* port = port_of(guest);
+    if (port->count == QUEUE_DEPTH)
+    {
+        release(guest, handle, cookie);
+        return false;
+    }
+
+    port->queue[port->count++] = (struct queued){ .data = data, .len = len, .release = release, .cookie = cookie };
+    return true;
+}
+
+static void receive(struct port* port, const uint8_t* data, size_t len);
+
+bool net_rx_direct(struct guest* guest, uint64_t handle, const void* data, size_t len)
+{
+    (void)handle;
+    struct port* port = port_of(guest);
+    if (port->reads == 0 || port->count > 0) return false;
+
+    port->reads--;
+    receive(port, data, len);
+    return true;
+}
+
+static uint64_t mix(uint64_t v)
+{
+    v ^= v >> 33;
+    v *= 0xff51afd7ed558ccdULL;
+    v ^= v >> 33;
+    return v;
+}
+
+#define PAYLOAD (14 + sizeof(uint64_t))
+
+// Destination, source, then the sequence number and a pattern derived from it
+static void build(uint8_t* frame, size_t len, const uint8_t* dst, const uint8_t* src, uint64_t seq)
+{
+    memcpy(frame, dst, 6);
+    memcpy(frame + 6, src, 6);
+    frame[12] = 0x08;
+    frame[13] = 0x00;
+    memcpy(frame + 14, &seq, sizeof(seq));
+    uint64_t r = mix(seq);
+    for (size_t i = PAYLOAD; i < len; i += sizeof(r))
+        memcpy(frame + i, &r, len - i < sizeof(r) ? len - i : sizeof(r));
+}
+
+static bool intact(const uint8_t* frame, size_t len)
+{
+    uint64_t seq;
+    memcpy(&seq, frame + 14, sizeof(seq));
+    uint64_t r = mix(seq);
+    uint64_t diff = 0;
+    size_t i = PAYLOAD;
+    for (; i + sizeof(r) <= len; i += sizeof(r))
+    {
+        uint64_t v;
+        memcpy(&v, frame + i, sizeof(v));
+        diff |= v ^ r;
+    }
+    return diff == 0 && memcmp(frame + i, &r, len - i) == 0;
+}
+
+static uint8_t sink[MAX_FRAME];
+
+// Copies a frame out the way net.c copies it to the guest and checks it was meant for the port
+static void receive(struct port* port, const uint8_t* data, size_t len)
+{
+    memcpy(sink, data, len);
+
+    bool group = sink[0] & 1;
+    if (!failed && ((!group && memcmp(sink, port->mac, 6) != 0) || memcmp(sink + 6, port->mac, 6) == 0 || !intact(sink, len)))
+    {
+        fprintf(stderr, "Port %zu: misdelivered or corrupt frame of %zu bytes\n", (size_t)(port - ports), len);
+        failed = true;
+    }
+    port->received++;
+}
+
+// Reads every queued frame, then releases it
+static void drain(struct port* port)
+{
+    for (size_t i = 0; i < port->count; i++)
+    {
+        struct queued* q = &port->queue[i];
+        receive(port, q->data, q->len);
+        q->release(&port->guest, 0, q->cookie);
+    }
+    port->count = 0;
+}
+
+static void drain_all(void)
+{
+    for (size_t i = 0; i < NUM_PORTS; i++)
+        drain(&ports[i]);
+}
+
+static uint64_t received(void)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < NUM_PORTS; i++)
+        n += ports[i].received;
+    return n;
+}
+
+static bool expect(bool ok, const char* what)
+{
+    if (!ok) fprintf(stderr, "Check failed: %s\n", what);
+    return ok;
+}
+
+static bool check(void)
+{
+    static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    static const uint8_t unknown[6] = { 0x02, 0xee, 0xee, 0xee, 0xee, 0xee };
+    uint8_t frame[MAX_FRAME];
+    struct vswitch_stats stats;
+
+    // Setup hands every guest the MAC of its port
+    bool macs_set = true;
+    for (size_t i = 0; i < NUM_PORTS; i++)
+    {
+        vswitch_setup(&ports[i].guest);
+        macs_set &= memcmp(((struct mft*)ports[i].mft)->e[0].u.net_basic.mac, ports[i].mac, 6) == 0;
+    }
+    if (!expect(macs_set, "port MACs are written into the MFT")) return false;
+    if (!expect(!vswitch_add_port(&ports[2].guest, 1, ports[1].mac), "a MAC can only belong to one port")) return false;
+
+    // Port MACs are known before their guests send anything, other destinations go to the uplink only
+    build(frame, 64, ports[1].mac, ports[0].mac, 0);
+    if (!expect(vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[1].count == 1, "port MACs are known up front")) return false;
+    drain_all();
+    build(frame, 64, unknown, ports[0].mac, 0);
+    if (!expect(!vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[1].count == 0, "unknown unicast goes to the uplink")) return false;
+
+    // Broadcast from every port reaches every other port
+    uint64_t before = received();
+    for (size_t i = 0; i < NUM_PORTS; i++)
+    {
+        build(frame, 64, broadcast, ports[i].mac, i);
+        if (!expect(!vswitch_forward(&ports[i].guest, 0, frame, 64), "broadcast also goes to the uplink")) return false;
+        drain_all();
+    }
+    if (!expect(received() - before == NUM_PORTS * (NUM_PORTS - 1), "broadcast reaches every other port")) return false;
+
+    // Known unicast only reaches its port, a frame for the sender's own MAC is dropped
+    build(frame, 64, ports[1].mac, ports[0].mac, 1);
+    if (!expect(vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[1].count == 1, "known unicast reaches its port")) return false;
+    build(frame, 64, ports[0].mac, ports[0].mac, 2);
+    if (!expect(vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[0].count == 0, "hairpin frames are dropped")) return false;
+    drain_all();
+
+    // A frame sent with another port's MAC as source does not move it
+    build(frame, 64, ports[3].mac, ports[1].mac, 3);
+    vswitch_forward(&ports[2].guest, 0, frame, 64);
+    build(frame, 64, ports[1].mac, ports[0].mac, 3);
+    if (!expect(vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[1].count == 1 && ports[2].count == 0, "port MACs are never moved"))
+        return false;
+    drain_all();
+
+    // Pending reads take frames straight from the sender, ports without one still get theirs queued
+    vswitch_get_stats(&stats);
+    uint64_t direct = stats.direct;
+    before = received();
+    ports[1].reads = 1;
+    build(frame, 64, ports[1].mac, ports[0].mac, 3);
+    if (!expect(vswitch_forward(&ports[0].guest, 0, frame, 64) && ports[1].count == 0 && received() == before + 1,
+            "known unicast goes straight into a pending read"))
+        return false;
+    ports[2].reads = 1;
+    build(frame, 64, broadcast, ports[0].mac, 4);
+    vswitch_forward(&ports[0].guest, 0, frame, 64);
+    vswitch_get_stats(&stats);
+    if (!expect(ports[2].count == 0 && ports[3].count == 1 && stats.direct == direct + 2, "broadcast uses pending reads where posted"))
+        return false;
+    drain_all();
+
+    // Every buffer can be in flight at once and each one comes back, frames past that are dropped
+    vswitch_get_stats(&stats);
+    if (!expect(stats.buffers == BUFFERS, "storage holds the expected number of buffers")) return false;
+    uint64_t dropped = stats.dropped;
+    for (size_t i = 0; i < BUFFERS; i++)
+    {
+        build(frame, 64, ports[1].mac, ports[0].mac, i);
+        vswitch_forward(&ports[0].guest, 0, frame, 64);
+    }
+    vswitch_get_stats(&stats);
+    if (!expect(stats.dropped == dropped && ports[1].count == BUFFERS, "all switch buffers are usable")) return false;
+    vswitch_forward(&ports[0].guest, 0, frame, 64);
+    vswitch_get_stats(&stats);
+    if (!expect(stats.dropped == dropped + 1, "frames are dropped once the buffers run out")) return false;
+    drain_all();
+    for (size_t i = 0; i < BUFFERS; i++)
+        vswitch_forward(&ports[0].guest, 0, frame, 64);
+    vswitch_get_stats(&stats);
+    if (!expect(stats.dropped == dropped + 1, "drained buffers are handed back")) return false;
+    drain_all();
+
+    if (failed) return false;
+    printf("Port MACs, learning, flooding, hairpin drops, direct delivery and buffer accounting are correct\n");
+    return true;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+enum pattern
+{
+    UNICAST,
+    BROADCAST,
+    UNKNOWN
+};
+
+struct result
+{
+    uint64_t frames;                    // Sent to the switch
+    uint64_t deliveries;                // Read from receive queues
+    double elapsed;
+};
+
+// Ports take turns sending BATCH frames for about seconds, receivers are drained after every batch. With reads set, unicast receivers
+// have a read pending for every frame
+static struct result measure(enum pattern pattern, size_t len, bool reads, double seconds)
+{
+    static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    static const uint8_t unknown[6] = { 0x02, 0xee, 0xee, 0xee, 0xee, 0xee };
+    static uint8_t frames[NUM_PORTS][MAX_FRAME];
+    static uint64_t seq;
+
+    for (size_t i = 0; i < NUM_PORTS; i++)
+    {
+        const uint8_t* dst = pattern == UNICAST ? ports[(i + 1) % NUM_PORTS].mac : pattern == BROADCAST ? broadcast : unknown;
+        build(frames[i], len, dst, ports[i].mac, seq++);
+    }
+
+    struct result result = { 0 };
+    uint64_t before = received();
+    double start = now();
+    do
+    {
+        for (size_t i = 0; i < NUM_PORTS; i++)
+        {
+            if (reads) ports[(i + 1) % NUM_PORTS].reads = BATCH;
+            for (size_t j = 0; j < BATCH; j++)
+                vswitch_forward(&ports[i].guest, 0, frames[i], len);
+            drain_all();
+        }
+        result.frames += NUM_PORTS * BATCH;
+        result.elapsed = now() - start;
+    } while (result.elapsed < seconds);
+
+    result.deliveries = received() - before;
+    return result;
+}
+
+// Learned entries for MACs that never send again, every lookup of an unknown MAC walks all of them
+static void fill_mac_table(void)
+{
+    static const uint8_t broadcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    uint8_t frame[64];
+
+    for (size_t i = 0; i < VSWITCH_MAC_ENTRIES - NUM_PORTS; i++)
+    {
+        uint8_t mac[6] = { 0x06, 0, 0, 0, (uint8_t)(i >> 8), (uint8_t)i };
+        build(frame, sizeof(frame), broadcast, mac, i);
+        vswitch_forward(&ports[0].guest, 0, frame, sizeof(frame));
+        drain_all();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    double seconds = argc > 1 ? strtod(argv[1], NULL) : 0.5;
+    if (seconds <= 0)
+    {
+        fprintf(stderr, "Usage: %s [seconds per measurement]\n", argv[0]);
+        return 2;
+    }
+
+    if (!vswitch_init(storage, sizeof(storage))) return 1;
+    for (size_t i = 0; i < NUM_PORTS; i++)
+    {
+        struct port* port = &ports[i];
+        port->guest.vcpu_id = i;
+        memcpy(port->mac, (uint8_t[6]){ 0x02, 0, 0, 0, 0, (uint8_t)(i + 1) }, 6);
+        struct mft* mft = (struct mft*)port->mft;
+        mft->entries = 1;
+        mft->e[0].type = MFT_DEV_NET_BASIC;
+        if (!vswitch_add_port(&port->guest, 0, port->mac)) return 1;
+    }
+
+    if (!check()) return 1;
+
+    static const struct
+    {
+        const char* name;
+        enum pattern pattern;
+        size_t len;
+        bool reads;
+    } runs[] = {
+        { "unicast", UNICAST, 64, false },
+        { "unicast", UNICAST, 1514, false },
+        { "direct", UNICAST, 64, true },
+        { "direct", UNICAST, 1514, true },
+        { "broadcast", BROADCAST, 64, false },
+        { "unknown", UNKNOWN, 64, false },
+    };
+
+    printf("%d ports, batches of %d frames\n", NUM_PORTS, BATCH);
+    printf("%-10s %6s %10s %14s %10s\n", "frames", "bytes", "Mframes/s", "Mdeliveries/s", "Gbit/s");
+    for (size_t i = 0; i < sizeof(runs) / sizeof(runs[0]); i++)
+    {
+        if (runs[i].pattern == UNKNOWN) fill_mac_table();
+
+        struct result r = measure(runs[i].pattern, runs[i].len, runs[i].reads, seconds);
+        if (failed) return 1;
+
+        double delivered = (double)r.deliveries / r.elapsed;
+        printf("%-10s %6zu %10.2f %14.2f %10.2f\n", runs[i].name, runs[i].len, (double)r.frames / r.elapsed / 1e6, delivered / 1e6,
+            delivered * (double)runs[i].len * 8 / 1e9);
+    }
+
+    struct vswitch_stats stats;
+    vswitch_get_stats(&stats);
+    printf("Switched %lu, flooded %lu, direct %lu, uplink %lu, dropped %lu\n", (unsigned long)stats.switched, (unsigned long)stats.flooded,
+        (unsigned long)stats.direct, (unsigned long)stats.uplink, (unsigned long)stats.dropped);
+    return 0;
+}